@@ -0,0 +1,117 @@
+//
+//  AsyncWriter.hpp
+//  K-means Clustering
+//
+//  A background thread writing snapshots into a file. A snapshot is written into a temporary
+//  file which is then renamed onto the target, so that the file always holds a complete snapshot.
+//  If a snapshot is submitted while the previous one is still being written, only the latest
+//  pending snapshot is kept.
+//
+
+#ifndef AsyncWriter_hpp
+#define AsyncWriter_hpp
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstdio>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+class AsyncWriter {
+
+public:
+    AsyncWriter() : _worker(&AsyncWriter::_work, this)
+    {
+    }
+
+    ~AsyncWriter()
+    {
+        this->wait();
+        {
+            std::lock_guard<std::mutex> lock(this->_mutex);
+            this->_stopping = true;
+        }
+        this->_ready.notify_all();
+        this->_worker.join();
+    }
+
+    // Queue a snapshot to be written into file.
+    // The contents of data are swapped with a buffer returned by an earlier write, so that
+    // a caller submitting snapshots of the same size repeatedly does not allocate memory.
+    void submit(const std::string & file, std::vector<char> & data)
+    {
+        {
+            std::lock_guard<std::mutex> lock(this->_mutex);
+            this->_pending.swap(data);
+            this->_pending_file = file;
+            this->_has_pending = true;
+        }
+        this->_ready.notify_one();
+    }
+
+    // Block until every submitted snapshot is written
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(this->_mutex);
+        this->_done.wait(lock, [this]{ return !this->_has_pending && !this->_writing; });
+    }
+
+    // Number of snapshots failed to be written
+    int failures()
+    {
+        std::lock_guard<std::mutex> lock(this->_mutex);
+        return this->_failures;
+    }
+
+private:
+    std::vector<char> _pending;
+    std::vector<char> _current;         // snapshot being written
+    std::string _pending_file;
+    std::string _current_file;
+    bool _has_pending = false;
+    bool _writing = false;
+    bool _stopping = false;
+    int _failures = 0;
+    std::mutex _mutex;
+    std::condition_variable _ready;
+    std::condition_variable _done;
+    std::thread _worker;                // declared last so that it starts after the other members
+
+    void _work()
+    {
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(this->_mutex);
+                this->_ready.wait(lock, [this]{ return this->_stopping || this->_has_pending; });
+                if (!this->_has_pending)
+                    return;
+                this->_current.swap(this->_pending);
+                this->_current_file = this->_pending_file;
+                this->_has_pending = false;
+                this->_writing = true;
+            }
+            const std::string tmp = this->_current_file + ".tmp";
+            bool failed;
+            {
+                std::ofstream output(tmp, std::ios::binary | std::ios::trunc);
+                output.write(this->_current.data(), this->_current.size());
+                output.close();
+                failed = output.fail();
+            }
+            if (!failed)
+                failed = std::rename(tmp.c_str(), this->_current_file.c_str()) != 0;
+            {
+                std::lock_guard<std::mutex> lock(this->_mutex);
+                if (failed)
+                    this->_failures++;
+                this->_writing = false;
+            }
+            this->_done.notify_all();
+        }
+    }
+};
+
+#endif /* AsyncWriter_hpp */
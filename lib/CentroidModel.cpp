@@ -0,0 +1,206 @@
+//
+//  CentroidModel.cpp
+//  K-means Clustering
+//
+
+#include "CentroidModel.hpp"
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+CentroidModel::CentroidModel()
+{
+}
+
+CentroidModel::~CentroidModel()
+{
+    this->close();
+}
+
+int CentroidModel::open(const std::string & file)
+{
+    this->close();
+#if !defined(_WIN32)
+    int fd = ::open(file.c_str(), O_RDONLY);
+    if (fd < 0)
+        return 1;       // Unable to open the file
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        ::close(fd);
+        return 1;
+    }
+    if (st.st_size < (off_t)sizeof(KMeans::ModelHeader))
+    {
+        ::close(fd);
+        return 2;
+    }
+    void * data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+        return 1;
+    this->_data = static_cast<const char *>(data);
+    this->_size = st.st_size;
+    this->_mapped = true;
+#else
+    std::ifstream input(file, std::ios::binary);
+    if (input.fail())
+        return 1;       // Unable to open the file
+    this->_buffer.resize(input.seekg(0, std::ios::end).tellg());
+    input.seekg(0, std::ios::beg).read(this->_buffer.data(), this->_buffer.size());
+    if (input.fail())
+        return 1;
+    this->_data = this->_buffer.data();
+    this->_size = this->_buffer.size();
+#endif
+
+    // Validate the header and the bounds of sections
+    const KMeans::ModelHeader * h = reinterpret_cast<const KMeans::ModelHeader *>(this->_data);
+    if (this->_size < sizeof(KMeans::ModelHeader) || std::memcmp(h->magic, KMeans::MODEL_MAGIC, sizeof(h->magic)) != 0
+        || h->version != KMeans::MODEL_VERSION || h->file_size != this->_size || h->tile < 1 || h->n_clusters < 1 || h->n_features < 0)
+    {
+        this->close();
+        return 2;       // Invalid model file
+    }
+    const std::size_t n_tiles = (h->n_clusters + h->tile - 1)/h->tile;
+    if (h->feature_offset + h->n_features*sizeof(int) > h->file_size
+        || h->weight_offset + n_tiles*h->n_features*h->tile*sizeof(double) > h->file_size
+        || h->norm_offset + h->n_clusters*sizeof(double) > h->file_size
+        || h->size_offset + h->n_clusters*sizeof(std::int64_t) > h->file_size)
+    {
+        this->close();
+        return 2;
+    }
+    this->_header = h;
+    this->_weights = reinterpret_cast<const double *>(this->_data + h->weight_offset);
+    this->_norms = reinterpret_cast<const double *>(this->_data + h->norm_offset);
+
+    // Features are stored in ascending order
+    const int * features = reinterpret_cast<const int *>(this->_data + h->feature_offset);
+    for (int f = 0; f < h->n_features; ++f)
+    {
+        if (features[f] < 0 || (f > 0 && features[f] <= features[f-1]))
+        {
+            this->close();
+            return 2;
+        }
+    }
+    int max_feature = h->n_features > 0 ? features[h->n_features-1] : -1;
+    this->_feature_row.assign(max_feature+1, -1);
+    for (int f = 0; f < h->n_features; ++f)
+        this->_feature_row[features[f]] = f;
+    return 0;
+}
+
+void CentroidModel::close()
+{
+#if !defined(_WIN32)
+    if (this->_mapped)
+        munmap(const_cast<char *>(this->_data), this->_size);
+#endif
+    std::vector<char>().swap(this->_buffer);
+    std::vector<int>().swap(this->_feature_row);
+    this->_data = nullptr;
+    this->_size = 0;
+    this->_mapped = false;
+    this->_header = nullptr;
+    this->_weights = nullptr;
+    this->_norms = nullptr;
+}
+
+const KMeans::ModelHeader & CentroidModel::header() const
+{
+    return *this->_header;
+}
+
+int CentroidModel::size() const
+{
+    return this->_header->n_clusters;
+}
+
+int CentroidModel::score(const int * attribute, const double * value, const int & size, double & similarity, Workspace & ws) const
+{
+    int cluster;
+    const Document * doc = &ws.document;
+    this->prepare(attribute, value, size, ws.document, ws);
+    this->scoreBlock(&doc, 1, &cluster, &similarity, ws);
+    return cluster;
+}
+
+void CentroidModel::prepare(const int * attribute, const double * value, const int & size, Document & doc, Workspace & ws) const
+{
+    double norm = 0;
+    ws.entries.clear();
+    for (int i = 0; i < size; ++i)
+    {
+        norm += value[i]*value[i];
+        if (attribute[i] >= 0 && attribute[i] < (int)this->_feature_row.size() && this->_feature_row[attribute[i]] != -1)
+            ws.entries.push_back(std::make_pair(this->_feature_row[attribute[i]], value[i]));
+    }
+    std::sort(ws.entries.begin(), ws.entries.end());
+    doc.index.resize(ws.entries.size());
+    doc.value.resize(ws.entries.size());
+    for (std::size_t i = 0; i < ws.entries.size(); ++i)
+    {
+        doc.index[i] = ws.entries[i].first;
+        doc.value[i] = ws.entries[i].second;
+    }
+    doc.norm = std::sqrt(norm);
+}
+
+void CentroidModel::scoreBlock(const Document * const * docs, const int & n, int * cluster, double * similarity, Workspace & ws) const
+{
+    const int tile = this->_header->tile;
+    const int n_clusters = this->_header->n_clusters;
+    const int n_tiles = (n_clusters + tile - 1)/tile;
+    const int width = n_tiles*tile;
+    const std::size_t tile_size = (std::size_t)this->_header->n_features*tile;
+
+    ws.similarity.resize((std::size_t)n*width);
+    if (tile == KMeans::CENTROID_TILE)
+    {
+        for (int t = 0; t < n_tiles; ++t)
+            for (int d = 0; d < n; ++d)
+                if (!docs[d]->index.empty())
+                    KMeans::scoreTile(docs[d]->index.data(), docs[d]->value.data(), docs[d]->index.size(),
+                                      this->_weights + t*tile_size, ws.similarity.data() + (std::size_t)d*width + t*tile);
+    }
+    else
+    {
+        // Model saved with a different tile width
+        std::fill(ws.similarity.begin(), ws.similarity.end(), 0);
+        for (int t = 0; t < n_tiles; ++t)
+            for (int d = 0; d < n; ++d)
+                for (std::size_t i = 0; i < docs[d]->index.size(); ++i)
+                    for (int w = 0; w < tile; ++w)
+                        ws.similarity[(std::size_t)d*width + t*tile + w] += docs[d]->value[i]*this->_weights[t*tile_size + (std::size_t)docs[d]->index[i]*tile + w];
+    }
+
+    double sim;
+    for (int d = 0; d < n; ++d)
+    {
+        cluster[d] = -1;
+        similarity[d] = 0;
+        if (docs[d]->index.empty() || docs[d]->norm == 0)
+            continue;
+        const double * s = ws.similarity.data() + (std::size_t)d*width;
+        similarity[d] = -2;
+        for (int c = 0; c < n_clusters; ++c)
+        {
+            if (this->_norms[c] == 0)
+                continue;
+            sim = s[c]/(docs[d]->norm*this->_norms[c]);
+            if (sim > similarity[d])
+            {
+                similarity[d] = sim;
+                cluster[d] = c;
+            }
+        }
+        if (cluster[d] == -1)
+            similarity[d] = 0;
+    }
+}
@@ -0,0 +1,70 @@
+//
+//  CentroidModel.hpp
+//  K-means Clustering
+//
+//  Read-only view of a model file saved by KMeans::saveModel(),
+//  for assigning documents to the clusters of a saved model
+//
+
+#ifndef CentroidModel_hpp
+#define CentroidModel_hpp
+
+#include <vector>
+#include <string>
+#include <utility>
+
+#include "KMeans.hpp"
+
+class CentroidModel {
+
+public:
+    // A document whose tokens are mapped to rows of the weights of the model
+    struct Document
+    {
+        std::vector<int> index;
+        std::vector<double> value;
+        double norm = 0;
+    };
+    // Buffers used when scoring documents. Each scoring thread needs its own workspace.
+    struct Workspace
+    {
+        std::vector<std::pair<int, double> > entries;
+        Document document;
+        std::vector<double> similarity;
+    };
+
+    CentroidModel();
+    ~CentroidModel();
+    // Map a model file into memory
+    // Return 0 on success, 1 if the file cannot be opened, 2 if the file is not a valid model file
+    int open(const std::string & file);
+    // Unmap the model file
+    void close();
+    // Get the header of the model file
+    const KMeans::ModelHeader & header() const;
+    // Get the number of clusters
+    int size() const;
+    // Find the closest centroid of a document given by its token ids and frequencies.
+    // Return the id of the cluster and set the cosine similarity between the document and the centroid.
+    // Return -1 if the document does not share any token with the centroids.
+    int score(const int * attribute, const double * value, const int & size, double & similarity, Workspace & ws) const;
+    // Map the token ids and frequencies of a document to rows of the weights.
+    // Tokens unknown to the model only count in the norm of the document.
+    void prepare(const int * attribute, const double * value, const int & size, Document & doc, Workspace & ws) const;
+    // Score a block of prepared documents together. Each tile of centroids is applied to all documents
+    // of the block before the next tile is loaded, so that a tile is read from memory once per block.
+    // The cluster of a document is -1 if it does not share any token with the centroids.
+    void scoreBlock(const Document * const * docs, const int & n, int * cluster, double * similarity, Workspace & ws) const;
+
+private:
+    const char * _data = nullptr;
+    std::size_t _size = 0;
+    bool _mapped = false;
+    std::vector<char> _buffer;          // contents of the file when it cannot be memory mapped
+    const KMeans::ModelHeader * _header = nullptr;
+    const double * _weights = nullptr;
+    const double * _norms = nullptr;
+    std::vector<int> _feature_row;      // row of each feature id in the weights, -1 if not used by centroids
+};
+
+#endif /* CentroidModel_hpp */
@@ -0,0 +1,494 @@
+//
+//  ClusterServer.cpp
+//  K-means Clustering
+//
+
+#include "ClusterServer.hpp"
+
+#include <thread>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#if !defined(_WIN32)
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#if defined(MSG_NOSIGNAL)
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+ClusterServer::ClusterServer(ModelHolder * models, const Parser & parser) : _models(models), _parser(parser), _stopping(false), _reload_requested(false), _n_readers(0)
+{
+}
+
+ClusterServer::~ClusterServer()
+{
+    for (auto r : this->_queue)
+        delete r;
+}
+
+void ClusterServer::setBatching(const int & max_batch, const int & max_wait_us)
+{
+    this->_max_batch = max_batch < 1 ? 1 : max_batch;
+    this->_max_wait_us = max_wait_us < 0 ? 0 : max_wait_us;
+}
+
+void ClusterServer::setScoringThreads(const int & n_threads)
+{
+    this->_n_threads = std::min(std::max(n_threads, 1), ModelHolder::MAX_READERS);
+}
+
+void ClusterServer::setMaxConnections(const int & max_connections)
+{
+    this->_max_connections = max_connections < 1 ? 1 : max_connections;
+}
+
+void ClusterServer::setReportInterval(const int & seconds)
+{
+    this->_report_interval = seconds < 0 ? 0 : seconds;
+}
+
+void ClusterServer::setLogStream(std::ostream * log_stream)
+{
+    this->_log_stream = log_stream;
+}
+
+void ClusterServer::setModelFile(const std::string & file)
+{
+    this->_model_file = file;
+}
+
+void ClusterServer::stop()
+{
+    this->_stopping = true;
+}
+
+void ClusterServer::reload()
+{
+    this->_reload_requested = true;
+}
+
+double ClusterServer::percentile(std::vector<double> & samples, const double & p)
+{
+    if (samples.empty())
+        return 0;
+    std::size_t k = p*(samples.size()-1);
+    std::nth_element(samples.begin(), samples.begin() + k, samples.end());
+    return samples[k];
+}
+
+ClusterServer::_Connection::~_Connection()
+{
+#if !defined(_WIN32)
+    if (this->fd != -1)
+        ::close(this->fd);
+#endif
+}
+
+void ClusterServer::_Connection::write(const std::string & response)
+{
+    std::lock_guard<std::mutex> lock(this->write_mutex);
+    if (this->output != nullptr)
+    {
+        *this->output << response;
+        this->output->flush();
+        return;
+    }
+#if !defined(_WIN32)
+    const char * ptr = response.data();
+    std::size_t left = response.size();
+    while (left > 0)
+    {
+        ssize_t n = send(this->fd, ptr, left, SEND_FLAGS);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;     // The client has gone
+        ptr += n;
+        left -= n;
+    }
+#endif
+}
+
+int ClusterServer::serve(const std::string & socket_path)
+{
+#if defined(_WIN32)
+    return 1;           // Unix domain sockets are not supported
+#else
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path))
+        return 1;
+    std::strcpy(addr.sun_path, socket_path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return 1;
+    unlink(socket_path.c_str());
+    if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || listen(fd, 128) != 0)
+    {
+        ::close(fd);
+        return 1;
+    }
+
+    this->_stopping = false;
+    this->_last_report = _Clock::now();
+    std::vector<std::thread> scorers;
+    for (int i = 0; i < this->_n_threads; ++i)
+        scorers.emplace_back(&ClusterServer::_score, this);
+    std::thread watcher(&ClusterServer::_watch, this);
+
+    // Each connection is read by its own thread, and at most _max_connections are read at a time.
+    // Further clients wait in the backlog of the socket until a reader leaves. Readers that left
+    // are joined as the server goes, and the others once they see the stop flag.
+    std::vector<std::pair<std::thread, std::shared_ptr<_Connection> > > readers;
+    pollfd p;
+    p.fd = fd;
+    p.events = POLLIN;
+    while (!this->_stopping)
+    {
+        for (auto it = readers.begin(); it != readers.end(); )
+        {
+            if (it->second->finished)
+            {
+                it->first.join();
+                it = readers.erase(it);
+            }
+            else
+                ++it;
+        }
+        if ((int)readers.size() >= this->_max_connections)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            continue;
+        }
+        if (poll(&p, 1, 100) <= 0)
+            continue;
+        int conn = accept(fd, nullptr, nullptr);
+        if (conn < 0)
+            continue;
+        std::shared_ptr<_Connection> connection = std::make_shared<_Connection>();
+        connection->fd = conn;
+        this->_n_readers++;
+        readers.emplace_back(std::thread(&ClusterServer::_readSocket, this, connection), connection);
+    }
+    ::close(fd);
+    unlink(socket_path.c_str());
+
+    for (auto & r : readers)
+        r.first.join();
+    this->_queue_cv.notify_all();
+    for (auto & t : scorers)
+        t.join();
+    watcher.join();
+    this->_report(true);
+    return 0;
+#endif
+}
+
+int ClusterServer::serve(std::istream & input, std::ostream & output)
+{
+    this->_stopping = false;
+    this->_n_readers = 1;
+    this->_last_report = _Clock::now();
+    std::vector<std::thread> scorers;
+    for (int i = 0; i < this->_n_threads; ++i)
+        scorers.emplace_back(&ClusterServer::_score, this);
+    std::thread watcher(&ClusterServer::_watch, this);
+
+    std::shared_ptr<_Connection> connection = std::make_shared<_Connection>();
+    connection->output = &output;
+    this->_readStream(input, connection);
+
+    this->_stopping = true;
+    this->_queue_cv.notify_all();
+    for (auto & t : scorers)
+        t.join();
+    watcher.join();
+    this->_report(true);
+    return 0;
+}
+
+void ClusterServer::_readSocket(std::shared_ptr<_Connection> connection)
+{
+#if !defined(_WIN32)
+    char buffer[65536];
+    std::string pending, line;
+    std::size_t start, end;
+    pollfd p;
+    p.fd = connection->fd;
+    p.events = POLLIN;
+    while (!this->_stopping)
+    {
+        int r = poll(&p, 1, 100);
+        if (r == 0 || (r < 0 && errno == EINTR))
+            continue;
+        if (r < 0)
+            break;
+        ssize_t n = recv(connection->fd, buffer, sizeof(buffer), 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;      // The client closed the connection
+        pending.append(buffer, n);
+        start = 0;
+        while ((end = pending.find('\n', start)) != std::string::npos)
+        {
+            line.assign(pending, start, end - start);
+            this->_enqueue(connection, line);
+            start = end + 1;
+        }
+        pending.erase(0, start);
+    }
+    if (!pending.empty() && !this->_stopping)
+        this->_enqueue(connection, pending);
+#endif
+    connection->finished = true;
+    this->_n_readers--;
+    this->_queue_cv.notify_all();
+}
+
+void ClusterServer::_readStream(std::istream & input, std::shared_ptr<_Connection> connection)
+{
+    std::string line;
+    while (!this->_stopping && std::getline(input, line))
+        this->_enqueue(connection, line);
+    this->_n_readers--;
+    this->_queue_cv.notify_all();
+}
+
+void ClusterServer::_enqueue(const std::shared_ptr<_Connection> & connection, std::string & line)
+{
+    // Requests are parsed by the reading threads. They are mapped to the features of
+    // a model by the scorers, since the model may be swapped before they are scored.
+    _Request * request = new _Request;
+    request->received = _Clock::now();
+    request->id = -1;
+    int result = this->_parser(line, request->id, request->attribute, request->value);
+    if (result == -1)
+    {
+        delete request;     // Empty line
+        return;
+    }
+    request->connection = connection;
+    request->valid = result == 0 && !request->attribute.empty() && request->attribute.size() == request->value.size();
+    {
+        std::lock_guard<std::mutex> lock(this->_queue_mutex);
+        this->_queue.push_back(request);
+    }
+    this->_queue_cv.notify_all();
+}
+
+void ClusterServer::_score()
+{
+    CentroidModel::Workspace ws;
+    std::vector<CentroidModel::Document> documents(this->_max_batch);
+    CentroidModel::Document invalid;
+    std::vector<_Request *> batch;
+    std::vector<const CentroidModel::Document *> block;
+    std::vector<int> clusters;
+    std::vector<double> similarities, latencies;
+    char response[64];
+    const int slot = this->_models->registerReader();
+
+    while (true)
+    {
+        batch.clear();
+        {
+            std::unique_lock<std::mutex> lock(this->_queue_mutex);
+            if (this->_queue.empty())
+            {
+                if (this->_stopping && this->_n_readers == 0)
+                    break;
+                this->_queue_cv.wait_for(lock, std::chrono::milliseconds(100));
+                continue;
+            }
+            // Wait for the batch to fill up until the oldest request has waited long enough
+            _Clock::time_point deadline = this->_queue.front()->received + std::chrono::microseconds(this->_max_wait_us);
+            while (!this->_queue.empty() && (int)this->_queue.size() < this->_max_batch && !(this->_stopping && this->_n_readers == 0))
+            {
+                if (this->_queue_cv.wait_until(lock, deadline) == std::cv_status::timeout)
+                    break;
+            }
+            while (!this->_queue.empty() && (int)batch.size() < this->_max_batch)
+            {
+                batch.push_back(this->_queue.front());
+                this->_queue.pop_front();
+            }
+        }
+        if (batch.empty())
+            continue;       // Taken by another scorer
+
+        block.resize(batch.size());
+        clusters.resize(batch.size());
+        similarities.resize(batch.size());
+        const CentroidModel * model = this->_models->pin(slot);
+        if (model != nullptr)
+        {
+            for (std::size_t i = 0; i < batch.size(); ++i)
+            {
+                block[i] = &invalid;
+                if (!batch[i]->valid)
+                    continue;
+                model->prepare(batch[i]->attribute.data(), batch[i]->value.data(), batch[i]->attribute.size(), documents[i], ws);
+                block[i] = &documents[i];
+            }
+            model->scoreBlock(block.data(), block.size(), clusters.data(), similarities.data(), ws);
+        }
+        else
+        {
+            std::fill(clusters.begin(), clusters.end(), -1);
+            std::fill(similarities.begin(), similarities.end(), 0);
+        }
+        this->_models->unpin(slot);
+
+        latencies.clear();
+        for (std::size_t i = 0; i < batch.size(); ++i)
+        {
+            std::snprintf(response, sizeof(response), "%d,%d,%f\n", batch[i]->id, clusters[i], similarities[i]);
+            batch[i]->connection->write(response);
+            latencies.push_back(std::chrono::duration_cast<std::chrono::duration<double, std::micro> >(_Clock::now() - batch[i]->received).count());
+            delete batch[i];
+        }
+
+        std::lock_guard<std::mutex> lock(this->_stats_mutex);
+        this->_latencies.insert(this->_latencies.end(), latencies.begin(), latencies.end());
+        this->_n_served += batch.size();
+        this->_n_batches++;
+        if (this->_report_interval > 0 && _Clock::now() - this->_last_report >= std::chrono::seconds(this->_report_interval))
+            this->_report(false);
+    }
+    this->_models->unregisterReader(slot);
+}
+
+void ClusterServer::_watch()
+{
+    // Models are loaded by this thread, so that neither readers nor scorers wait for the file
+    while (!this->_stopping)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        if (!this->_reload_requested.exchange(false) || this->_model_file.empty())
+            continue;
+        if (this->_models->load(this->_model_file) == 0)
+        {
+            std::lock_guard<std::mutex> lock(this->_stats_mutex);
+            *this->_log_stream << "Model reloaded from " << this->_model_file << ". Version: " << this->_models->version() << "." << std::endl;
+        }
+        else
+        {
+            std::lock_guard<std::mutex> lock(this->_stats_mutex);
+            *this->_log_stream << "Unable to reload the model file " << this->_model_file << ". Keep serving version " << this->_models->version() << "." << std::endl;
+        }
+    }
+}
+
+void ClusterServer::_report(const bool & final)
+{
+    // Called with the statistics locked, or after the scorers have finished
+    _Clock::time_point now = _Clock::now();
+    double elapsed = std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1> > >(now - this->_last_report).count();
+    if (!this->_latencies.empty())
+    {
+        std::size_t n = this->_latencies.size();
+        double p50 = percentile(this->_latencies, 0.5);
+        double p90 = percentile(this->_latencies, 0.9);
+        double p99 = percentile(this->_latencies, 0.99);
+        double max = *std::max_element(this->_latencies.begin(), this->_latencies.end());
+        *this->_log_stream << std::fixed << n << " requests in the last " << elapsed << "s. "
+                           << "Latency p50: " << p50 << "us. p90: " << p90 << "us. p99: " << p99 << "us. max: " << max << "us." << std::endl;
+        this->_latencies.clear();
+    }
+    this->_last_report = now;
+    if (final)
+        *this->_log_stream << "Served " << this->_n_served << " requests in " << this->_n_batches << " batches. "
+                           << "Average batch size: " << (this->_n_batches > 0 ? (double)this->_n_served/this->_n_batches : 0.0) << "." << std::endl;
+}
+
+ClusterClient::ClusterClient()
+{
+}
+
+ClusterClient::~ClusterClient()
+{
+    this->close();
+}
+
+int ClusterClient::connect(const std::string & socket_path)
+{
+    this->close();
+#if defined(_WIN32)
+    return 1;
+#else
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path))
+        return 1;
+    std::strcpy(addr.sun_path, socket_path.c_str());
+    this->_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (this->_fd < 0)
+        return 1;
+    if (::connect(this->_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0)
+    {
+        this->close();
+        return 1;
+    }
+    return 0;
+#endif
+}
+
+void ClusterClient::close()
+{
+#if !defined(_WIN32)
+    if (this->_fd != -1)
+        ::close(this->_fd);
+#endif
+    this->_fd = -1;
+    this->_buffer.clear();
+}
+
+int ClusterClient::request(const std::string & line, std::string & response)
+{
+#if defined(_WIN32)
+    return 1;
+#else
+    if (this->_fd == -1)
+        return 1;
+    std::string message = line + "\n";
+    const char * ptr = message.data();
+    std::size_t left = message.size();
+    while (left > 0)
+    {
+        ssize_t n = send(this->_fd, ptr, left, SEND_FLAGS);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        ptr += n;
+        left -= n;
+    }
+
+    char buffer[4096];
+    std::size_t end;
+    while ((end = this->_buffer.find('\n')) == std::string::npos)
+    {
+        ssize_t n = recv(this->_fd, buffer, sizeof(buffer), 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        this->_buffer.append(buffer, n);
+    }
+    response.assign(this->_buffer, 0, end);
+    this->_buffer.erase(0, end + 1);
+    return 0;
+#endif
+}
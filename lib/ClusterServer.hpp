@@ -0,0 +1,139 @@
+//
+//  ClusterServer.hpp
+//  K-means Clustering
+//
+//  Long-running service assigning documents to the clusters of a model,
+//  and a simple client to talk to it.
+//
+//  Protocol: one request per line, in the same form as a line of the input file
+//      id,"token1,token2","frequency1,frequency2"
+//  One response per line, in the same form as a line of the output of 'predict'
+//      id,cluster,similarity
+//  Responses of a connection are not guaranteed to be in the order of its requests.
+//
+//  The model can be reloaded while serving. Each batch is scored by the model
+//  published when the batch starts, and requests never wait for a reload.
+//
+
+#ifndef ClusterServer_hpp
+#define ClusterServer_hpp
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <functional>
+
+#include "ModelHolder.hpp"
+
+class ClusterServer {
+
+public:
+    // Function parsing a request line into the document id, token ids and frequencies.
+    // Return 0 if the line is parsed.
+    typedef std::function<int(std::string &, int &, std::vector<int> &, std::vector<double> &)> Parser;
+
+    ClusterServer(ModelHolder * models, const Parser & parser);
+    ~ClusterServer();
+    // Requests are scored in batches of at most max_batch documents.
+    // A request waits at most max_wait_us microseconds for other requests to join its batch.
+    void setBatching(const int & max_batch, const int & max_wait_us);
+    // Number of threads scoring batches
+    void setScoringThreads(const int & n_threads);
+    // At most max_connections connections are read at a time. Further clients wait until one is closed.
+    void setMaxConnections(const int & max_connections);
+    // Latency percentiles are reported every interval seconds if any request was served, 0 to report only on stop
+    void setReportInterval(const int & seconds);
+    void setLogStream(std::ostream * log_stream);
+    // Set the model file loaded by reload()
+    void setModelFile(const std::string & file);
+    // Serve requests from a Unix domain socket until stop() is called
+    // Return 0 on success, 1 if unable to listen on the socket
+    int serve(const std::string & socket_path);
+    // Serve requests read from input and write responses into output until the end of input
+    int serve(std::istream & input, std::ostream & output);
+    // Ask the server to stop. Requests already received are answered.
+    // Only an atomic flag is set so that it can be called from a signal handler.
+    void stop();
+    // Ask the server to load the model file again and swap it in. The current model is kept if the file cannot be loaded.
+    // Only an atomic flag is set so that it can be called from a signal handler.
+    void reload();
+    // Get the p-th percentile (0 <= p <= 1) of samples. The samples are partially sorted.
+    static double percentile(std::vector<double> & samples, const double & p);
+
+private:
+    typedef std::chrono::steady_clock _Clock;
+    struct _Connection
+    {
+        int fd = -1;                    // socket of the connection, -1 for stream mode
+        std::ostream * output = nullptr;
+        std::mutex write_mutex;
+        std::atomic<bool> finished{false};  // set when its reader leaves
+        ~_Connection();
+        void write(const std::string & response);
+    };
+    struct _Request
+    {
+        std::shared_ptr<_Connection> connection;
+        int id;
+        bool valid;
+        std::vector<int> attribute;
+        std::vector<double> value;
+        _Clock::time_point received;
+    };
+
+    ModelHolder * _models;
+    std::string _model_file;
+    Parser _parser;
+    int _max_batch = 64;
+    int _max_wait_us = 200;
+    int _n_threads = 1;
+    int _max_connections = 256;
+    int _report_interval = 10;
+    std::ostream * _log_stream = &std::cout;
+
+    std::atomic<bool> _stopping;
+    std::atomic<bool> _reload_requested;
+    std::atomic<int> _n_readers;        // number of connections still reading requests
+    std::deque<_Request *> _queue;
+    std::mutex _queue_mutex;
+    std::condition_variable _queue_cv;
+
+    std::vector<double> _latencies;     // latencies in microseconds since the last report
+    long _n_served = 0;
+    long _n_batches = 0;
+    _Clock::time_point _last_report;
+    std::mutex _stats_mutex;
+
+    void _readSocket(std::shared_ptr<_Connection> connection);
+    void _readStream(std::istream & input, std::shared_ptr<_Connection> connection);
+    void _enqueue(const std::shared_ptr<_Connection> & connection, std::string & line);
+    void _score();
+    void _watch();
+    void _report(const bool & final);
+};
+
+class ClusterClient {
+
+public:
+    ClusterClient();
+    ~ClusterClient();
+    // Connect to a server listening on a Unix domain socket
+    // Return 0 on success, 1 on failure
+    int connect(const std::string & socket_path);
+    void close();
+    // Send a request line and wait for one response line
+    // Return 0 on success, 1 if the connection is broken
+    int request(const std::string & line, std::string & response);
+
+private:
+    int _fd = -1;
+    std::string _buffer;                // received data not yet returned
+};
+
+#endif /* ClusterServer_hpp */
@@ -0,0 +1,551 @@
+//
+//  Dataset.cpp
+//  K-means Clustering
+//
+
+#include "Dataset.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+const char Dataset::MAGIC[8] = {'S', 'P', 'H', 'K', 'M', 'D', 'A', 'T'};
+const std::uint32_t Dataset::VERSION;
+
+std::size_t Dataset::recordSize(const int & nnz)
+{
+    return (sizeof(std::int32_t)*(1 + nnz) + 7)/8*8 + nnz*sizeof(double);
+}
+
+std::size_t Dataset::record(const char * data, int & nnz, const int * & attribute, const double * & value)
+{
+    std::int32_t n;
+    std::memcpy(&n, data, sizeof(n));
+    nnz = n;
+    attribute = reinterpret_cast<const int *>(data + sizeof(std::int32_t));
+    value = reinterpret_cast<const double *>(data + (sizeof(std::int32_t)*(1 + nnz) + 7)/8*8);
+    return Dataset::recordSize(nnz);
+}
+
+Dataset::Writer::~Writer()
+{
+    if (this->_output.is_open())
+        this->close();
+}
+
+int Dataset::Writer::open(const std::string & file)
+{
+    this->_output.open(file, std::ios::binary | std::ios::trunc);
+    if (this->_output.fail())
+        return 1;       // Unable to open the file
+    std::memset(&this->_header, 0, sizeof(this->_header));
+    std::memcpy(this->_header.magic, Dataset::MAGIC, sizeof(this->_header.magic));
+    this->_header.version = Dataset::VERSION;
+    this->_header.max_attribute = -1;
+    this->_header.data_offset = (sizeof(Header) + 7)/8*8;
+    this->_ids.clear();
+    this->_offsets.clear();
+    this->_seen.clear();
+    // The header is written again by close()
+    std::vector<char> placeholder(this->_header.data_offset, 0);
+    this->_output.write(placeholder.data(), placeholder.size());
+    return this->_output.fail() ? 1 : 0;
+}
+
+int Dataset::Writer::add(const int & id, const int * attribute, const double * value, const int & size)
+{
+    if (size < 1)
+        return 1;       // Empty document
+    if (!this->_seen.insert(id).second)
+        return 3;       // Repeated document
+
+    this->_entries.clear();
+    for (int i = 0; i < size; ++i)
+        this->_entries.push_back(std::make_pair(attribute[i], value[i]));
+    std::sort(this->_entries.begin(), this->_entries.end());
+    double norm = 0;
+    for (auto e : this->_entries)
+        norm += e.second*e.second;
+    norm = std::sqrt(norm);
+
+    const std::size_t bytes = Dataset::recordSize(size);
+    this->_record.assign(bytes, 0);
+    std::int32_t nnz = size;
+    std::memcpy(this->_record.data(), &nnz, sizeof(nnz));
+    int * attr = reinterpret_cast<int *>(this->_record.data() + sizeof(std::int32_t));
+    double * val = reinterpret_cast<double *>(this->_record.data() + bytes - size*sizeof(double));
+    for (int i = 0; i < size; ++i)
+    {
+        attr[i] = this->_entries[i].first;
+        val[i] = this->_entries[i].second/norm;
+    }
+    if (this->_entries.back().first > this->_header.max_attribute)
+        this->_header.max_attribute = this->_entries.back().first;
+
+    this->_output.write(this->_record.data(), bytes);
+    this->_ids.push_back(id);
+    this->_offsets.push_back(this->_header.data_size);
+    this->_header.data_size += bytes;
+    this->_header.nnz += size;
+    this->_header.n_points++;
+    return 0;
+}
+
+int Dataset::Writer::close()
+{
+    Header & h = this->_header;
+    h.id_offset = h.data_offset + h.data_size;
+    h.record_offset = (h.id_offset + this->_ids.size()*sizeof(std::int32_t) + 7)/8*8;
+    h.file_size = h.record_offset + this->_offsets.size()*sizeof(std::uint64_t);
+    this->_output.write(reinterpret_cast<const char *>(this->_ids.data()), this->_ids.size()*sizeof(std::int32_t));
+    const char padding[8] = {0};
+    this->_output.write(padding, h.record_offset - h.id_offset - this->_ids.size()*sizeof(std::int32_t));
+    this->_output.write(reinterpret_cast<const char *>(this->_offsets.data()), this->_offsets.size()*sizeof(std::uint64_t));
+    this->_output.seekp(0);
+    this->_output.write(reinterpret_cast<const char *>(&h), sizeof(h));
+    this->_output.close();
+    return this->_output.fail() ? 1 : 0;
+}
+
+std::int64_t Dataset::Writer::size() const
+{
+    return this->_header.n_points;
+}
+
+Dataset::Dataset()
+{
+    std::memset(&this->_header, 0, sizeof(this->_header));
+    this->_filled[0] = this->_filled[1] = false;
+}
+
+Dataset::~Dataset()
+{
+    this->close();
+}
+
+int Dataset::readHeader(const std::string & file, Header & h)
+{
+    std::ifstream input(file, std::ios::binary);
+    if (input.fail())
+        return 1;       // Unable to open the file
+    const std::uint64_t size = input.seekg(0, std::ios::end).tellg();
+    input.seekg(0, std::ios::beg);
+    if (size < sizeof(h) || !input.read(reinterpret_cast<char *>(&h), sizeof(h)))
+        return 2;       // Invalid dataset file
+    if (std::memcmp(h.magic, Dataset::MAGIC, sizeof(h.magic)) != 0 || h.version != Dataset::VERSION || h.file_size != size
+        || h.n_points < 0 || h.nnz < h.n_points || h.max_attribute < -1 || h.data_offset < sizeof(h) || h.data_offset % 8 != 0
+        || h.data_offset + h.data_size > h.id_offset || h.id_offset + h.n_points*sizeof(std::int32_t) > h.record_offset
+        || h.record_offset % 8 != 0 || h.record_offset + h.n_points*sizeof(std::uint64_t) != h.file_size)
+        return 2;
+    return 0;
+}
+
+void Dataset::shardRange(const std::int64_t & n_points, const int & shard, const int & shards, std::int64_t & first, std::int64_t & last)
+{
+    first = n_points*shard/shards;
+    last = n_points*(shard+1)/shards;
+}
+
+int Dataset::open(const std::string & file, const std::size_t & block_bytes, const int & shard, const int & shards)
+{
+    this->close();
+    int result = Dataset::readHeader(file, this->_header);
+    if (result != 0 || shards < 1 || shard < 0 || shard >= shards)
+    {
+        std::memset(&this->_header, 0, sizeof(this->_header));
+        return result == 0 ? 2 : result;
+    }
+    if (block_bytes == 0)
+    {
+        if (this->_mapFile(file) != 0)
+        {
+            this->close();
+            return 1;   // Unable to map the file
+        }
+    }
+    else
+    {
+        this->_input.open(file, std::ios::binary);
+        this->_random.open(file, std::ios::binary);
+        if (this->_input.fail() || this->_random.fail())
+        {
+            this->close();
+            return 1;   // Unable to open the file
+        }
+    }
+
+    // The records of a shard are contiguous, from the offset of its first record to the offset of the next shard
+    std::int64_t last;
+    Dataset::shardRange(this->_header.n_points, shard, shards, this->_first, last);
+    this->_size = last - this->_first;
+    this->_begin = this->_end = this->_header.data_size;
+    if (this->_size > 0)
+    {
+        if (!this->_readAt(this->_header.record_offset + this->_first*sizeof(std::uint64_t), &this->_begin, sizeof(this->_begin))
+            || (last < this->_header.n_points && !this->_readAt(this->_header.record_offset + last*sizeof(std::uint64_t), &this->_end, sizeof(this->_end)))
+            || this->_begin > this->_end || this->_end > this->_header.data_size)
+        {
+            this->close();
+            return 2;
+        }
+    }
+
+    if (this->_map != nullptr)
+    {
+        // The records are checked once, and every pass is the same block over them
+        Block & block = this->_blocks[0];
+        block.first = 0;
+        block.size = this->_size;
+        block.data = this->_map + this->_header.data_offset + this->_begin;
+        block.bytes = this->_end - this->_begin;
+        if (this->_checkRecords(block.data, block.bytes) != this->_size)
+        {
+            this->close();
+            return 2;
+        }
+        this->_file = file;
+        this->_taken = -1;
+        this->_active = this->_failed = false;
+        return 0;
+    }
+
+    // Records are read into buffers of at least the block size, and the buffers are only
+    // reallocated by records larger than them
+    this->_file = file;
+    this->_block_bytes = std::max<std::size_t>(block_bytes, 4096)/8*8;
+    this->_buffers[0].assign(this->_block_bytes, 0);
+    this->_buffers[1].assign(this->_block_bytes, 0);
+    this->_record.reserve(65536);
+    this->_filled[0] = this->_filled[1] = false;
+    this->_next_fill = this->_next_take = 0;
+    this->_taken = -1;
+    this->_pass = this->_restart = this->_active = this->_stopping = this->_failed = false;
+    this->_worker = std::thread(&Dataset::_work, this);
+    return 0;
+}
+
+void Dataset::close()
+{
+    if (this->_worker.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(this->_mutex);
+            this->_stopping = true;
+        }
+        this->_cv.notify_all();
+        this->_worker.join();
+    }
+    this->_input.close();
+    this->_random.close();
+#if !defined(_WIN32)
+    if (this->_map != nullptr)
+        munmap(const_cast<char *>(this->_map), this->_map_size);
+#endif
+    this->_map = nullptr;
+    this->_map_size = 0;
+    this->_active = false;
+    this->_taken = -1;
+    std::vector<char>().swap(this->_buffers[0]);
+    std::vector<char>().swap(this->_buffers[1]);
+    std::memset(&this->_header, 0, sizeof(this->_header));
+    this->_first = this->_size = 0;
+    this->_begin = this->_end = 0;
+}
+
+const Dataset::Header & Dataset::header() const
+{
+    return this->_header;
+}
+
+std::int64_t Dataset::first() const
+{
+    return this->_first;
+}
+
+std::int64_t Dataset::size() const
+{
+    return this->_size;
+}
+
+bool Dataset::mapped() const
+{
+    return this->_map != nullptr;
+}
+
+int Dataset::readIds(std::vector<int> & ids)
+{
+    ids.resize(this->_size);
+    return this->_readAt(this->_header.id_offset + this->_first*sizeof(std::int32_t), ids.data(), ids.size()*sizeof(std::int32_t)) ? 0 : 1;
+}
+
+int Dataset::readRecord(const std::int64_t & index, int & nnz, const int * & attribute, const double * & value)
+{
+    if (index < 0 || index >= this->_size)
+        return 1;
+    std::uint64_t offset;
+    std::int32_t n;
+    if (!this->_readAt(this->_header.record_offset + (this->_first + index)*sizeof(std::uint64_t), &offset, sizeof(offset))
+        || !this->_readAt(this->_header.data_offset + offset, &n, sizeof(n))
+        || n < 1 || offset + Dataset::recordSize(n) > this->_header.data_size)
+        return 1;
+    // A mapped record is used in place
+    if (this->_map != nullptr)
+    {
+        Dataset::record(this->_map + this->_header.data_offset + offset, nnz, attribute, value);
+    }
+    else
+    {
+        if (this->_record.size() < Dataset::recordSize(n))
+            this->_record.resize(Dataset::recordSize(n));
+        if (!this->_readAt(this->_header.data_offset + offset, this->_record.data(), Dataset::recordSize(n)))
+            return 1;
+        Dataset::record(this->_record.data(), nnz, attribute, value);
+    }
+    for (int i = 0; i < nnz; ++i)
+        if (attribute[i] < 0 || attribute[i] > this->_header.max_attribute)
+            return 1;
+    return 0;
+}
+
+void Dataset::rewind()
+{
+    while (this->_active && this->next() != nullptr)
+        continue;
+    {
+        std::lock_guard<std::mutex> lock(this->_mutex);
+        this->_pass = true;
+        this->_restart = true;
+        this->_active = true;
+        this->_read_time = 0;
+        this->_wait_time = 0;
+    }
+    this->_cv.notify_all();
+}
+
+const Dataset::Block * Dataset::next()
+{
+    if (this->_map != nullptr)
+    {
+        // The whole shard is a single block
+        if (!this->_active || this->_taken == 0)
+        {
+            this->_active = false;
+            this->_taken = -1;
+            return nullptr;
+        }
+        this->_taken = 0;
+        return &this->_blocks[0];
+    }
+    std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(this->_mutex);
+    if (this->_taken >= 0)
+    {
+        this->_filled[this->_taken] = false;
+        this->_taken = -1;
+        this->_cv.notify_all();
+    }
+    if (!this->_active)
+        return nullptr;
+    this->_cv.wait(lock, [this]{ return this->_filled[this->_next_take]; });
+    this->_wait_time += std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1> > >(std::chrono::steady_clock::now() - start).count();
+    const int b = this->_next_take;
+    this->_next_take ^= 1;
+    if (this->_blocks[b].size == 0)
+    {
+        // End of the pass
+        this->_filled[b] = false;
+        this->_active = false;
+        this->_cv.notify_all();
+        return nullptr;
+    }
+    this->_taken = b;
+    return &this->_blocks[b];
+}
+
+bool Dataset::failed()
+{
+    std::lock_guard<std::mutex> lock(this->_mutex);
+    return this->_failed;
+}
+
+double Dataset::readTime()
+{
+    std::lock_guard<std::mutex> lock(this->_mutex);
+    return this->_read_time;
+}
+
+double Dataset::waitTime()
+{
+    std::lock_guard<std::mutex> lock(this->_mutex);
+    return this->_wait_time;
+}
+
+void Dataset::_work()
+{
+    std::uint64_t pos = 0;      // offset of the next record to read from data_offset
+    std::int64_t first = 0;     // index of the next document to read in the shard
+    int b;
+    bool ok;
+    std::chrono::time_point<std::chrono::steady_clock> start;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(this->_mutex);
+            this->_cv.wait(lock, [this]{ return this->_stopping || (this->_pass && !this->_filled[this->_next_fill]); });
+            if (this->_stopping)
+                return;
+            b = this->_next_fill;
+            if (this->_restart)
+            {
+                pos = this->_begin;
+                first = 0;
+                this->_restart = false;
+                this->_failed = false;
+            }
+        }
+        start = std::chrono::steady_clock::now();
+        ok = this->_readBlock(b, pos, first);
+        {
+            std::lock_guard<std::mutex> lock(this->_mutex);
+            this->_read_time += std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1> > >(std::chrono::steady_clock::now() - start).count();
+            if (!ok)
+            {
+                this->_failed = true;
+                this->_blocks[b].size = 0;
+            }
+            // An empty block marks the end of the pass
+            if (this->_blocks[b].size == 0)
+                this->_pass = false;
+            this->_filled[b] = true;
+            this->_next_fill ^= 1;
+        }
+        this->_cv.notify_all();
+    }
+}
+
+bool Dataset::_readBlock(const int & b, std::uint64_t & pos, std::int64_t & first)
+{
+    std::vector<char> & buffer = this->_buffers[b];
+    Block & block = this->_blocks[b];
+    block.first = first;
+    block.size = 0;
+    block.bytes = 0;
+    block.data = buffer.data();
+    std::size_t bytes = std::min<std::uint64_t>(buffer.size(), this->_end - pos);
+    if (bytes == 0)
+        return true;
+
+    // The last record in the buffer may be incomplete; it is read again as the first record of the next block
+    this->_input.clear();
+    this->_input.seekg(this->_header.data_offset + pos);
+    if (!this->_input.read(buffer.data(), bytes))
+        return false;
+    std::int32_t nnz;
+    std::size_t size = 0;
+    std::size_t offset = 0;
+    while (offset + sizeof(nnz) <= bytes)
+    {
+        std::memcpy(&nnz, buffer.data() + offset, sizeof(nnz));
+        if (nnz < 1 || pos + offset + Dataset::recordSize(nnz) > this->_end)
+            return false;
+        size = Dataset::recordSize(nnz);
+        if (offset + size > bytes)
+            break;
+        offset += size;
+        block.size++;
+    }
+    if (block.size == 0)
+    {
+        if (size == 0)
+            return false;
+        // A record larger than the buffer gets a larger buffer
+        buffer.resize((size + 7)/8*8);
+        block.data = buffer.data();
+        this->_input.seekg(this->_header.data_offset + pos);
+        if (!this->_input.read(buffer.data(), size))
+            return false;
+        offset = size;
+        block.size = 1;
+    }
+    block.bytes = offset;
+
+    // Token ids index the centroids, so that they are checked before the block is used
+    if (this->_checkRecords(block.data, block.bytes) < 0)
+        return false;
+    pos += offset;
+    first += block.size;
+    return true;
+}
+
+int Dataset::_mapFile(const std::string & file)
+{
+#if defined(_WIN32)
+    return 1;           // Mapping is not supported
+#else
+    int fd = ::open(file.c_str(), O_RDONLY);
+    if (fd < 0)
+        return 1;
+    struct stat st;
+    void * map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (std::uint64_t)st.st_size == this->_header.file_size)
+        map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED)
+        return 1;
+    // The file may have been replaced since its header was read
+    if (std::memcmp(map, &this->_header, sizeof(this->_header)) != 0)
+    {
+        munmap(map, st.st_size);
+        return 1;
+    }
+    this->_map = static_cast<const char *>(map);
+    this->_map_size = st.st_size;
+    return 0;
+#endif
+}
+
+bool Dataset::_readAt(const std::uint64_t & pos, void * data, const std::size_t & bytes)
+{
+    if (this->_map != nullptr)
+    {
+        if (pos + bytes > this->_map_size)
+            return false;
+        std::memcpy(data, this->_map + pos, bytes);
+        return true;
+    }
+    this->_random.clear();
+    this->_random.seekg(pos);
+    this->_random.read(static_cast<char *>(data), bytes);
+    return !this->_random.fail();
+}
+
+std::int64_t Dataset::_checkRecords(const char * data, const std::size_t & bytes) const
+{
+    const int * attribute;
+    const double * value;
+    std::int32_t n;
+    std::int64_t count = 0;
+    std::size_t offset = 0;
+    while (offset < bytes)
+    {
+        if (bytes - offset < sizeof(n))
+            return -1;
+        std::memcpy(&n, data + offset, sizeof(n));
+        if (n < 1 || bytes - offset < Dataset::recordSize(n))
+            return -1;
+        offset += Dataset::record(data + offset, n, attribute, value);
+        for (int i = 0; i < n; ++i)
+            if (attribute[i] < 0 || attribute[i] > this->_header.max_attribute)
+                return -1;
+        count++;
+    }
+    return count;
+}
@@ -0,0 +1,170 @@
+//
+//  Dataset.hpp
+//  K-means Clustering
+//
+//  Binary file of vectorized documents, for clustering datasets that do not fit in memory.
+//  The documents are read sequentially in large blocks on each pass, while a background
+//  thread reads the next block ahead, so that only two blocks are held in memory at a time.
+//  A dataset file can also be mapped into memory read-only, so that processes using the same
+//  file, e.g. one in /dev/shm, share a single physical copy of it.
+//
+
+#ifndef Dataset_hpp
+#define Dataset_hpp
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <unordered_set>
+#include <utility>
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+class Dataset {
+
+public:
+    // Header of the binary dataset file written by Dataset::Writer.
+    // The file is in native byte order. It begins with this header, followed by
+    //   records of documents in the order they were added, each starting at an 8-byte boundary:
+    //     int32 nnz, int32 token ids in ascending order [nnz], padding to an 8-byte boundary,
+    //     double values normalized to a unit l2-norm [nnz]
+    //   int32   ids of documents [n_points]
+    //   uint64  offset of the record of each document from data_offset [n_points], starting at an 8-byte boundary
+    struct Header
+    {
+        char magic[8];              // MAGIC
+        std::uint32_t version;      // VERSION
+        std::uint32_t reserved;
+        std::int64_t n_points;
+        std::int64_t nnz;           // total number of tokens of all documents
+        std::int64_t max_attribute; // largest token id
+        std::uint64_t data_offset;
+        std::uint64_t data_size;
+        std::uint64_t id_offset;
+        std::uint64_t record_offset;
+        std::uint64_t file_size;
+    };
+    static const char MAGIC[8];
+    static const std::uint32_t VERSION = 1;
+
+    // Whole records of consecutive documents read in one block
+    struct Block
+    {
+        std::int64_t first;         // index of the first document of the block
+        int size;                   // number of documents, 0 at the end of a pass
+        const char * data;
+        std::size_t bytes;
+    };
+
+    // Writer of a dataset file, adding documents one by one so that the dataset never needs to be in memory
+    class Writer
+    {
+    public:
+        ~Writer();
+        // Return 0 on success, 1 if the file cannot be opened
+        int open(const std::string & file);
+        // Add a document. Its tokens are sorted and its values are normalized in the same way KMeans vectorizes points.
+        // Return 0 on success, 1 if the document has no tokens, 3 if a document with the same id was added
+        int add(const int & id, const int * attribute, const double * value, const int & size);
+        // Write the ids and offsets of documents and the header
+        // Return 0 on success, 1 if the file cannot be written
+        int close();
+        // Number of documents added
+        std::int64_t size() const;
+    private:
+        std::ofstream _output;
+        Header _header;
+        std::vector<int> _ids;
+        std::vector<std::uint64_t> _offsets;
+        std::unordered_set<int> _seen;
+        std::vector<std::pair<int, double> > _entries;
+        std::vector<char> _record;
+    };
+
+    // Read and validate the header of a dataset file
+    // Return 0 on success, 1 if the file cannot be opened, 2 if it is not a valid dataset file
+    static int readHeader(const std::string & file, Header & header);
+    // Documents first to last-1 of the n_points documents form the given shard out of shards contiguous shards
+    static void shardRange(const std::int64_t & n_points, const int & shard, const int & shards, std::int64_t & first, std::int64_t & last);
+    // Number of bytes taken by the record of a document with nnz tokens
+    static std::size_t recordSize(const int & nnz);
+    // Get the tokens and values of the record at data. Return the size of the record.
+    static std::size_t record(const char * data, int & nnz, const int * & attribute, const double * & value);
+
+    Dataset();
+    ~Dataset();
+    // Open a dataset file to be read in blocks of about block_bytes bytes.
+    // If block_bytes is 0, the file is mapped into memory instead, and a pass is a single block over the mapping.
+    // Only the documents of the given shard are read, and documents are indexed from the first one of the shard.
+    // Return 0 on success, 1 if the file cannot be opened, 2 if it is not a valid dataset file or shard
+    int open(const std::string & file, const std::size_t & block_bytes, const int & shard = 0, const int & shards = 1);
+    void close();
+    // Header of the whole file
+    const Header & header() const;
+    // Index of the first document of the shard in the file, and the number of documents of the shard
+    std::int64_t first() const;
+    std::int64_t size() const;
+    // Whether the file is mapped into memory rather than read in blocks
+    bool mapped() const;
+    // Read the ids of the documents of the shard
+    // Return 0 on success, 1 if the file cannot be read
+    int readIds(std::vector<int> & ids);
+    // Read the record of one document into an internal buffer, valid until the next call
+    // Return 0 on success, 1 if the record cannot be read
+    int readRecord(const std::int64_t & index, int & nnz, const int * & attribute, const double * & value);
+    // Start a pass over the documents of the shard. Blocks are read ahead from now on.
+    // A pass not finished yet is drained first.
+    void rewind();
+    // Get the next block of the pass, or nullptr at the end of the pass.
+    // The block returned by the previous call is released, and its buffer is filled with a later block.
+    const Block * next();
+    // Whether a block could not be read. The pass where it happened ends early.
+    bool failed();
+    // Seconds spent on reading the file by the background thread and seconds next() waited for it in the last pass
+    double readTime();
+    double waitTime();
+
+private:
+    std::string _file;
+    Header _header;
+    std::int64_t _first = 0;
+    std::int64_t _size = 0;
+    std::uint64_t _begin = 0;           // offsets of the records of the shard from data_offset
+    std::uint64_t _end = 0;
+    const char * _map = nullptr;        // the whole file when it is mapped
+    std::size_t _map_size = 0;
+    std::size_t _block_bytes = 0;
+    std::ifstream _input;               // read by the background thread
+    std::ifstream _random;              // read by readRecord()
+    std::vector<char> _record;
+    std::vector<char> _buffers[2];
+    Block _blocks[2];
+    bool _filled[2];                    // block ready or held by the caller of next()
+    int _next_fill = 0;                 // buffer filled next by the background thread
+    int _next_take = 0;                 // buffer returned next by next()
+    int _taken = -1;                    // buffer held by the caller of next()
+    bool _pass = false;                 // a pass is being read by the background thread
+    bool _restart = false;              // the background thread starts the pass from the first document
+    bool _active = false;               // a pass is being consumed by next()
+    bool _stopping = false;
+    bool _failed = false;
+    double _read_time = 0;
+    double _wait_time = 0;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::thread _worker;
+
+    void _work();
+    // Map the file into memory read-only. Return 0 on success, 1 on failure.
+    int _mapFile(const std::string & file);
+    // Read bytes at pos of the file. Return false if the file cannot be read.
+    bool _readAt(const std::uint64_t & pos, void * data, const std::size_t & bytes);
+    // Count the records in data, or return -1 if a record is invalid or crosses the end of data
+    std::int64_t _checkRecords(const char * data, const std::size_t & bytes) const;
+    // Read the block after pos into a buffer. Return false if the file cannot be read.
+    bool _readBlock(const int & b, std::uint64_t & pos, std::int64_t & first);
+};
+
+#endif /* Dataset_hpp */
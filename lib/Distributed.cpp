@@ -0,0 +1,834 @@
+//
+//  Distributed.cpp
+//  K-means Clustering
+//
+
+#include "Distributed.hpp"
+
+#include <set>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <limits>
+#include <cerrno>
+
+#if !defined(_WIN32)
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#if defined(MSG_NOSIGNAL)
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+// An address is "host:port" for TCP, or otherwise the path of a Unix domain socket
+static bool split_address(const std::string & address, std::string & host, std::string & port)
+{
+    std::size_t colon = address.find_last_of(':');
+    if (colon == std::string::npos || address.find('/') != std::string::npos || colon + 1 == address.size()
+        || address.find_first_not_of("0123456789", colon + 1) != std::string::npos)
+        return false;
+    host = address.substr(0, colon);
+    port = address.substr(colon + 1);
+    return true;
+}
+
+const std::uint64_t Channel::MAX_MESSAGE_SIZE;
+
+Channel::~Channel()
+{
+    this->close();
+}
+
+int Channel::listen(const std::string & address)
+{
+#if defined(_WIN32)
+    return -1;          // Sockets are not supported
+#else
+    int fd = -1;
+    std::string host, port;
+    if (split_address(address, host, port))
+    {
+        addrinfo hints;
+        std::memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        addrinfo * result;
+        if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result) != 0)
+            return -1;
+        int one = 1;
+        for (addrinfo * ai = result; ai != nullptr; ai = ai->ai_next)
+        {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0)
+                continue;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+                break;
+            ::close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(result);
+    }
+    else
+    {
+        sockaddr_un addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (address.size() >= sizeof(addr.sun_path))
+            return -1;
+        std::strcpy(addr.sun_path, address.c_str());
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        unlink(address.c_str());
+        if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0)
+        {
+            ::close(fd);
+            return -1;
+        }
+    }
+    if (fd < 0)
+        return -1;
+    if (::listen(fd, 64) != 0)
+    {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+#endif
+}
+
+void Channel::closeListener(const int & listener, const std::string & address)
+{
+#if !defined(_WIN32)
+    ::close(listener);
+    std::string host, port;
+    if (!split_address(address, host, port))
+        unlink(address.c_str());
+#endif
+}
+
+int Channel::accept(const int & listener)
+{
+    this->close();
+#if defined(_WIN32)
+    return 1;
+#else
+    do
+        this->_fd = ::accept(listener, nullptr, nullptr);
+    while (this->_fd < 0 && errno == EINTR);
+    if (this->_fd < 0)
+        return 1;
+    // Messages are small and answered at once; this fails harmlessly on Unix domain sockets
+    int one = 1;
+    setsockopt(this->_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return 0;
+#endif
+}
+
+int Channel::connect(const std::string & address, const double & timeout)
+{
+    this->close();
+#if defined(_WIN32)
+    return 1;
+#else
+    std::chrono::time_point<std::chrono::steady_clock> deadline = std::chrono::steady_clock::now()
+        + std::chrono::microseconds((long long)(timeout*1e6));
+    std::string host, port;
+    const bool tcp = split_address(address, host, port);
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (!tcp)
+    {
+        if (address.size() >= sizeof(addr.sun_path))
+            return 1;
+        std::strcpy(addr.sun_path, address.c_str());
+    }
+    int one = 1;
+    for (;;)
+    {
+        if (tcp)
+        {
+            addrinfo hints;
+            std::memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            addrinfo * result;
+            if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result) != 0)
+                return 1;
+            for (addrinfo * ai = result; ai != nullptr && this->_fd < 0; ai = ai->ai_next)
+            {
+                this->_fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+                if (this->_fd >= 0 && ::connect(this->_fd, ai->ai_addr, ai->ai_addrlen) != 0)
+                    this->close();
+            }
+            freeaddrinfo(result);
+        }
+        else
+        {
+            this->_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (this->_fd >= 0 && ::connect(this->_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0)
+                this->close();
+        }
+        if (this->_fd >= 0)
+            break;
+        // The coordinator may not be listening yet
+        if (std::chrono::steady_clock::now() >= deadline)
+            return 1;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    setsockopt(this->_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return 0;
+#endif
+}
+
+void Channel::close()
+{
+#if !defined(_WIN32)
+    if (this->_fd != -1)
+        ::close(this->_fd);
+#endif
+    this->_fd = -1;
+}
+
+int Channel::send(const int & type, const Message & message)
+{
+    _Frame frame;
+    frame.type = type;
+    frame.reserved = 0;
+    frame.size = message.data.size();
+    if (frame.size > Channel::MAX_MESSAGE_SIZE)
+        return 1;
+    if (this->_write(reinterpret_cast<const char *>(&frame), sizeof(frame)) != 0
+        || this->_write(message.data.data(), message.data.size()) != 0)
+        return 1;
+    this->_sent += sizeof(frame) + message.data.size();
+    return 0;
+}
+
+int Channel::receive(int & type, Message & message)
+{
+    _Frame frame;
+    if (this->_read(reinterpret_cast<char *>(&frame), sizeof(frame)) != 0)
+        return 1;
+    if (frame.size > Channel::MAX_MESSAGE_SIZE)
+        return 1;       // Not a frame of ours
+    message.data.resize(frame.size);
+    message.rewind();
+    if (this->_read(message.data.data(), frame.size) != 0)
+        return 1;
+    type = frame.type;
+    this->_received += sizeof(frame) + frame.size;
+    return 0;
+}
+
+std::uint64_t Channel::bytesSent() const
+{
+    return this->_sent;
+}
+
+std::uint64_t Channel::bytesReceived() const
+{
+    return this->_received;
+}
+
+int Channel::_write(const char * data, std::size_t size)
+{
+#if defined(_WIN32)
+    return 1;
+#else
+    while (size > 0)
+    {
+        ssize_t n = ::send(this->_fd, data, size, SEND_FLAGS);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        data += n;
+        size -= n;
+    }
+    return 0;
+#endif
+}
+
+int Channel::_read(char * data, std::size_t size)
+{
+#if defined(_WIN32)
+    return 1;
+#else
+    while (size > 0)
+    {
+        ssize_t n = recv(this->_fd, data, size, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        data += n;
+        size -= n;
+    }
+    return 0;
+#endif
+}
+
+// Append the nonzeros of a dense vector to a message as nnz, dims and values
+static void put_sparse(const Eigen::VectorXd & vec, Message & message, std::vector<int> & dims, std::vector<double> & values)
+{
+    dims.clear();
+    values.clear();
+    for (Eigen::Index d = 0; d < vec.size(); ++d)
+    {
+        if (vec[d] != 0)
+        {
+            dims.push_back(d);
+            values.push_back(vec[d]);
+        }
+    }
+    message.put<std::int32_t>(dims.size());
+    message.put(dims.data(), dims.size());
+    message.put(values.data(), values.size());
+}
+
+// Read nnz, dims and values from a message. Return false if the message is too short.
+static bool get_sparse(Message & message, std::vector<int> & dims, std::vector<double> & values)
+{
+    std::int32_t nnz;
+    if (!message.get(nnz) || nnz < 0)
+        return false;
+    dims.resize(nnz);
+    values.resize(nnz);
+    return message.get(dims.data(), nnz) && message.get(values.data(), nnz);
+}
+
+ShardCoordinator::ShardCoordinator() : _log_stream(&std::cout)
+{
+}
+
+ShardCoordinator::~ShardCoordinator()
+{
+}
+
+void ShardCoordinator::setLogStream(std::ostream * log_stream)
+{
+    this->_log_stream = log_stream;
+}
+
+void ShardCoordinator::setTolerance(const double & tolerance)
+{
+    this->_tolerance = tolerance < 0 ? 0 : tolerance;
+}
+
+std::int64_t ShardCoordinator::getNumberOfPoints() const
+{
+    return this->_n_points;
+}
+
+const double & ShardCoordinator::getObjValue() const
+{
+    return this->_obj_value;
+}
+
+const double & ShardCoordinator::getTimeElapse() const
+{
+    return this->_time_taken;
+}
+
+int ShardCoordinator::accept(const std::string & address, const int & n_workers)
+{
+    int listener = Channel::listen(address);
+    if (listener < 0)
+        return 1;       // Unable to listen
+    *this->_log_stream << "Waiting for " << n_workers << " workers at " << address << "..." << std::endl;
+    this->_workers.clear();
+    for (int w = 0; w < n_workers; ++w)
+    {
+        std::unique_ptr<Channel> channel(new Channel);
+        if (channel->accept(listener) != 0)
+        {
+            Channel::closeListener(listener, address);
+            return 2;
+        }
+        this->_workers.push_back(std::move(channel));
+    }
+    Channel::closeListener(listener, address);
+
+    // Shards are assigned in the order workers connected
+    for (int w = 0; w < n_workers; ++w)
+    {
+        this->_out.clear();
+        this->_out.put<std::int32_t>(w);
+        this->_out.put<std::int32_t>(n_workers);
+        if (this->_workers[w]->send(Channel::SHARD, this->_out) != 0)
+            return 2;
+    }
+    this->_first.resize(n_workers);
+    this->_size.resize(n_workers);
+    int type;
+    std::int32_t result;
+    std::int64_t n_points, max_attribute, next = 0;
+    for (int w = 0; w < n_workers; ++w)
+    {
+        if (this->_workers[w]->receive(type, this->_in) != 0 || type != Channel::READY || !this->_in.get(result) || result != 0
+            || !this->_in.get(n_points) || !this->_in.get(max_attribute) || !this->_in.get(this->_first[w]) || !this->_in.get(this->_size[w]))
+            return 2;   // The worker is unable to open its shard
+        if (w == 0)
+        {
+            this->_n_points = n_points;
+            this->_dim = max_attribute;
+        }
+        if (n_points != this->_n_points || max_attribute != this->_dim || this->_first[w] != next)
+            return 2;   // Different datasets
+        next += this->_size[w];
+        *this->_log_stream << "  Worker " << w << ": " << this->_size[w] << " data objects from " << this->_first[w] << std::endl;
+    }
+    return next == this->_n_points ? 0 : 2;
+}
+
+int ShardCoordinator::run(const int & n_clusters, const int & seed)
+{
+    std::chrono::time_point<std::chrono::high_resolution_clock> start_time = std::chrono::high_resolution_clock::now();
+    const int n_workers = this->_workers.size();
+    this->_n_clusters = std::min<std::int64_t>(n_clusters, this->_n_points);
+    const int K = this->_n_clusters;
+    this->_vec.assign(K, Eigen::VectorXd::Zero(this->_dim+1));
+    this->_sum.assign(K, Eigen::VectorXd::Zero(this->_dim+1));
+    this->_l2norm.assign(K, 1);
+    this->_sizes.assign(K, 0);
+    this->_counts.assign((std::size_t)n_workers*K, 0);
+    this->_changed.assign(K, 0);
+    this->_outdated.assign(K, 1);
+    this->_out.clear();
+    this->_out.put<std::int32_t>(K);
+    for (auto & worker : this->_workers)
+        if (worker->send(Channel::START, this->_out) != 0)
+            return -1;
+
+    // Initial centroids are drawn in the same way as KMeans::_initializeCentroids()
+    this->_log_stream->flush();
+    *this->_log_stream << "Initialize centroids..." << std::endl;
+    std::mt19937 sd;
+    if (seed == KMeans::UNASSIGNED_RANDOM_SEED_FLAG)
+        sd.seed(std::random_device()());
+    else
+        sd.seed(seed);
+    std::uniform_int_distribution<int> random_gen(0, this->_n_points);
+    std::set<int> random_num_generated;
+    int rand_num;
+    for (int i = K; --i >= 0;)
+    {
+        rand_num = random_gen(sd);
+        if (rand_num < this->_n_points && random_num_generated.find(rand_num) == random_num_generated.end())
+        {
+            random_num_generated.insert(rand_num);
+            if (this->_getPoint(rand_num, this->_vec[i]) != 0)
+                return -1;
+            this->_l2norm[i] = 1;
+            continue;
+        }
+        ++i;
+    }
+
+    *this->_log_stream << "Begin clustering..." << std::endl;
+    int iter = 0;
+    int updated, moved;
+    double slowest, time_elapse, exchange_time;
+    double last_obj_value = std::numeric_limits<double>::infinity();
+    bool converged = false;
+    std::uint64_t sent, received;
+    std::chrono::time_point<std::chrono::high_resolution_clock> time;
+    do
+    {
+        time = std::chrono::high_resolution_clock::now();
+        sent = received = 0;
+        for (auto & worker : this->_workers)
+        {
+            sent -= worker->bytesSent();
+            received -= worker->bytesReceived();
+        }
+        iter++;
+        moved = this->_exchange(slowest);
+        if (moved < 0)
+            return -1;
+        exchange_time = std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1> > > (std::chrono::high_resolution_clock::now() - time).count();
+        updated = this->_update();
+        if (updated < 0)
+            return -1;
+        for (auto & worker : this->_workers)
+        {
+            sent += worker->bytesSent();
+            received += worker->bytesReceived();
+        }
+        time_elapse = std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1> > > (std::chrono::high_resolution_clock::now() - time).count();
+        *this->_log_stream << "  Iteration: "  << iter
+            << ". Updated Centroids: " << updated
+            << ". Obj. Value: " << std::fixed << this->_obj_value
+            << ". Time Taken: " << time_elapse << "s"
+            << ". Slowest Worker: " << slowest << "s"
+            << ". Communication: " << std::max(0.0, exchange_time - slowest) << "s"
+            << ". Sent: " << sent/1024 << "KB. Received: " << received/1024 << "KB" << std::endl;
+        converged = this->_tolerance > 0 && last_obj_value - this->_obj_value < this->_tolerance*this->_obj_value;
+        last_obj_value = this->_obj_value;
+    } while (updated > 0 && !converged);
+
+    this->_time_taken = std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1> > > (std::chrono::high_resolution_clock::now() - start_time).count();
+    *this->_log_stream << "Clustering completed. Total time taken: " << this->_time_taken << "s." << std::endl;
+    return iter;
+}
+
+int ShardCoordinator::_exchange(double & slowest)
+{
+    const int K = this->_n_clusters;
+    std::vector<int> dims;
+    std::vector<double> values;
+
+    // Only centroids changed by the last update are sent
+    std::int32_t count = 0;
+    for (int c = 0; c < K; ++c)
+        count += this->_outdated[c];
+    this->_out.clear();
+    this->_out.put(count);
+    for (std::int32_t c = 0; c < K; ++c)
+    {
+        if (this->_outdated[c] == 0)
+            continue;
+        this->_out.put(c);
+        this->_out.put(this->_l2norm[c]);
+        put_sparse(this->_vec[c], this->_out, dims, values);
+        this->_outdated[c] = 0;
+    }
+    // Every worker gets its request before any answer is read, so that workers run at the same time
+    Message assign;
+    for (auto & worker : this->_workers)
+        if (worker->send(Channel::CENTROIDS, this->_out) != 0 || worker->send(Channel::ASSIGN, assign) != 0)
+            return -1;
+
+    this->_obj_value = 0;
+    slowest = 0;
+    std::fill(this->_sizes.begin(), this->_sizes.end(), 0);
+    std::fill(this->_changed.begin(), this->_changed.end(), 0);
+    std::int64_t moved = 0, m;
+    double obj_value, seconds;
+    std::int32_t cid;
+    int type;
+    for (std::size_t w = 0; w < this->_workers.size(); ++w)
+    {
+        std::int64_t * counts = this->_counts.data() + w*K;
+        if (this->_workers[w]->receive(type, this->_in) != 0 || type != Channel::PARTIAL || !this->_in.get(m) || m < 0
+            || !this->_in.get(obj_value) || !this->_in.get(seconds) || !this->_in.get(counts, K) || !this->_in.get(count))
+            return -1;
+        moved += m;
+        this->_obj_value += obj_value;
+        slowest = std::max(slowest, seconds);
+        for (int c = 0; c < K; ++c)
+            this->_sizes[c] += counts[c];
+        // The running sums take the changes of the partial sums of the shard
+        for (std::int32_t i = 0; i < count; ++i)
+        {
+            if (!this->_in.get(cid) || cid < 0 || cid >= K || !get_sparse(this->_in, dims, values))
+                return -1;
+            this->_changed[cid] = 1;
+            for (std::size_t k = 0; k < dims.size(); ++k)
+            {
+                if (dims[k] < 0 || dims[k] > this->_dim)
+                    return -1;
+                this->_sum[cid][dims[k]] += values[k];
+            }
+        }
+    }
+    return moved > std::numeric_limits<int>::max() ? std::numeric_limits<int>::max() : moved;
+}
+
+int ShardCoordinator::_update()
+{
+    // Same as KMeans::_updateCentroids(), with the reseeding done by the workers holding the donors
+    const int K = this->_n_clusters;
+    std::vector<int> empty_clusters, nonempty_clusters;
+    for (int cid = K; --cid > -1;)
+    {
+        if (this->_changed[cid] == 0)
+            continue;
+        if (this->_sizes[cid] == 0)
+            empty_clusters.push_back(cid);
+        else
+            nonempty_clusters.push_back(cid);
+    }
+    std::size_t next_empty = 0;
+    if (!empty_clusters.empty())
+    {
+        for (std::size_t i = 0; i < nonempty_clusters.size() && next_empty < empty_clusters.size(); ++i)
+        {
+            while (next_empty < empty_clusters.size() && this->_sizes[nonempty_clusters[i]] > 1)
+                if (this->_reseed(empty_clusters[next_empty++], nonempty_clusters[i]) != 0)
+                    return -1;
+        }
+        for (; next_empty < empty_clusters.size(); ++next_empty)
+        {
+            for (int c = 0; c < K; ++c)
+            {
+                if (this->_sizes[c] > 1)
+                {
+                    if (this->_reseed(empty_clusters[next_empty], c) != 0)
+                        return -1;
+                    nonempty_clusters.push_back(c);
+                    break;
+                }
+            }
+        }
+    }
+
+    for (auto cid : nonempty_clusters)
+    {
+        this->_vec[cid] = this->_sum[cid]/this->_sizes[cid];
+        this->_l2norm[cid] = this->_vec[cid].norm();
+        this->_outdated[cid] = 1;
+    }
+    return nonempty_clusters.size();
+}
+
+int ShardCoordinator::_getPoint(const std::int64_t & index, Eigen::VectorXd & vec)
+{
+    std::size_t w = 0;
+    while (w + 1 < this->_workers.size() && index >= this->_first[w+1])
+        ++w;
+    int type;
+    this->_out.clear();
+    this->_out.put<std::int64_t>(index - this->_first[w]);
+    if (this->_workers[w]->send(Channel::GET_POINT, this->_out) != 0
+        || this->_workers[w]->receive(type, this->_in) != 0 || type != Channel::POINT)
+        return 1;
+    return this->_readPoint(vec);
+}
+
+int ShardCoordinator::_reseed(const int & cid, const int & donor)
+{
+    // The last point of the donor is in the last shard holding points of it
+    const int K = this->_n_clusters;
+    int w = this->_workers.size();
+    while (--w >= 0 && this->_counts[(std::size_t)w*K + donor] == 0);
+    if (w < 0)
+        return 1;
+    int type;
+    this->_out.clear();
+    this->_out.put<std::int32_t>(donor);
+    this->_out.put<std::int32_t>(cid);
+    Eigen::VectorXd & row = this->_vec[cid];
+    if (this->_workers[w]->send(Channel::RESEED, this->_out) != 0
+        || this->_workers[w]->receive(type, this->_in) != 0 || type != Channel::POINT || this->_readPoint(row) != 0)
+        return 1;
+    this->_counts[(std::size_t)w*K + donor]--;
+    this->_counts[(std::size_t)w*K + cid]++;
+    this->_sizes[donor]--;
+    this->_sum[donor] -= row;
+    this->_sizes[cid] = 1;
+    this->_sum[cid] = row;
+    this->_l2norm[cid] = 1;
+    this->_outdated[cid] = 1;
+    return 0;
+}
+
+int ShardCoordinator::_readPoint(Eigen::VectorXd & vec)
+{
+    std::int64_t index;
+    std::vector<int> dims;
+    std::vector<double> values;
+    if (!this->_in.get(index) || index < 0 || !get_sparse(this->_in, dims, values))
+        return 1;
+    vec.setZero();
+    for (std::size_t k = 0; k < dims.size(); ++k)
+    {
+        if (dims[k] < 0 || dims[k] > this->_dim)
+            return 1;
+        vec[dims[k]] = values[k];
+    }
+    return 0;
+}
+
+int ShardCoordinator::collect(std::vector<int> & ids, std::vector<int> & clusters)
+{
+    ids.clear();
+    clusters.clear();
+    Message request;
+    int type;
+    std::int64_t n;
+    for (auto & worker : this->_workers)
+    {
+        if (worker->send(Channel::COLLECT, request) != 0 || worker->receive(type, this->_in) != 0 || type != Channel::ASSIGNMENTS
+            || !this->_in.get(n) || n < 0)
+            return 1;
+        ids.resize(ids.size() + n);
+        clusters.resize(clusters.size() + n);
+        if (!this->_in.get(ids.data() + ids.size() - n, n) || !this->_in.get(clusters.data() + clusters.size() - n, n))
+            return 1;
+    }
+    return 0;
+}
+
+void ShardCoordinator::stop()
+{
+    Message request;
+    for (auto & worker : this->_workers)
+        worker->send(Channel::STOP, request);
+    this->_workers.clear();
+}
+
+ShardWorker::ShardWorker() : _log_stream(&std::cout)
+{
+}
+
+void ShardWorker::setLogStream(std::ostream * log_stream)
+{
+    this->_log_stream = log_stream;
+}
+
+void ShardWorker::_putPoint(KMeans & cluster, const int & index, Message & message)
+{
+    int nnz;
+    const int * dims;
+    const double * values;
+    if (index < 0 || cluster.getPointVector(index, nnz, dims, values) != 0)
+    {
+        message.put<std::int64_t>(-1);
+        message.put<std::int32_t>(0);
+        return;
+    }
+    message.put<std::int64_t>(index);
+    message.put<std::int32_t>(nnz);
+    message.put(dims, nnz);
+    message.put(values, nnz);
+}
+
+int ShardWorker::serve(const std::string & dataset_file, const std::size_t & block_bytes, const std::string & address)
+{
+    Channel channel;
+    if (channel.connect(address, 60) != 0)
+        return 1;       // Unable to connect
+    *this->_log_stream << "Connected to " << address << "." << std::endl;
+
+    std::unique_ptr<KMeans> cluster;
+    Message in, out;
+    int type;
+    std::vector<int> dims;
+    std::vector<double> values;
+    std::int32_t shard, shards, n_clusters = 0, count, cid, donor;
+    std::int64_t index;
+    double l2norm;
+    std::chrono::time_point<std::chrono::high_resolution_clock> time;
+    while (channel.receive(type, in) == 0)
+    {
+        out.clear();
+        if (!cluster && type != Channel::SHARD && type != Channel::STOP)
+            return 3;
+        switch (type)
+        {
+            case Channel::SHARD:
+            {
+                if (!in.get(shard) || !in.get(shards))
+                    return 3;
+                cluster.reset(new KMeans(2));
+                cluster->setLogStream(this->_log_stream);
+                Dataset::Header header;
+                std::int64_t first, last;
+                std::int32_t result = cluster->openDataset(dataset_file, block_bytes, shard, shards);
+                if (result == 0)
+                    result = Dataset::readHeader(dataset_file, header);
+                if (result == 0)
+                    Dataset::shardRange(header.n_points, shard, shards, first, last);
+                else
+                    header.n_points = header.max_attribute = first = last = 0;
+                out.put(result);
+                out.put<std::int64_t>(header.n_points);
+                out.put<std::int64_t>(header.max_attribute);
+                out.put(first);
+                out.put<std::int64_t>(last - first);
+                if (channel.send(Channel::READY, out) != 0)
+                    return 3;
+                if (result != 0)
+                    return 2;
+                *this->_log_stream << "Shard " << shard << " of " << shards << ": " << last - first << " data objects from " << first << "." << std::endl;
+                break;
+            }
+            case Channel::START:
+                if (!in.get(n_clusters) || n_clusters < 1)
+                    return 3;
+                cluster->setNumberOfClusters(n_clusters);
+                cluster->prepareSteps();
+                break;
+            case Channel::GET_POINT:
+                if (!in.get(index))
+                    return 3;
+                ShardWorker::_putPoint(*cluster, index, out);
+                if (channel.send(Channel::POINT, out) != 0)
+                    return 3;
+                break;
+            case Channel::CENTROIDS:
+                if (!in.get(count))
+                    return 3;
+                for (std::int32_t i = 0; i < count; ++i)
+                {
+                    if (!in.get(cid) || cid < 0 || cid >= n_clusters || !in.get(l2norm) || !get_sparse(in, dims, values))
+                        return 3;
+                    cluster->setCentroid(cid, dims.data(), values.data(), dims.size(), l2norm);
+                }
+                break;
+            case Channel::ASSIGN:
+            {
+                time = std::chrono::high_resolution_clock::now();
+                std::int64_t moved = cluster->assignStep();
+                double seconds = std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1> > > (std::chrono::high_resolution_clock::now() - time).count();
+                out.put(moved);
+                out.put(cluster->getObjValue());
+                out.put(seconds);
+                for (int c = 0; c < n_clusters; ++c)
+                    out.put<std::int64_t>(cluster->getClusterSize(c));
+                count = 0;
+                for (int c = 0; c < n_clusters; ++c)
+                    count += cluster->isClusterChanged(c) ? 1 : 0;
+                out.put(count);
+                // The running sums restart from zero, so that they hold the changes made by the next step
+                for (std::int32_t c = 0; c < n_clusters; ++c)
+                {
+                    if (!cluster->isClusterChanged(c))
+                        continue;
+                    out.put(c);
+                    put_sparse(cluster->getRunningSum(c), out, dims, values);
+                    cluster->clearRunningSum(c);
+                }
+                if (channel.send(Channel::PARTIAL, out) != 0)
+                    return 3;
+                break;
+            }
+            case Channel::RESEED:
+                if (!in.get(donor) || !in.get(cid) || donor < 0 || donor >= n_clusters || cid < 0 || cid >= n_clusters)
+                    return 3;
+                ShardWorker::_putPoint(*cluster, cluster->movePoint(donor, cid), out);
+                if (channel.send(Channel::POINT, out) != 0)
+                    return 3;
+                break;
+            case Channel::COLLECT:
+            {
+                cluster->finishSteps();
+                const std::vector<int> & ids = cluster->getPointIds();
+                const std::vector<int> & clusters = cluster->getEachPointCluster();
+                out.put<std::int64_t>(ids.size());
+                out.put(ids.data(), ids.size());
+                out.put(clusters.data(), clusters.size());
+                if (channel.send(Channel::ASSIGNMENTS, out) != 0)
+                    return 3;
+                break;
+            }
+            case Channel::STOP:
+                return 0;
+            default:
+                return 3;
+        }
+    }
+    return 3;           // Connection lost
+}
@@ -0,0 +1,211 @@
+//
+//  Distributed.hpp
+//  K-means Clustering
+//
+//  Data-parallel clustering by processes that each hold a shard of a dataset file.
+//  A coordinator keeps the centroids and their running sums, and each worker streams its shard
+//  through a KMeans object that only runs the assignment step. Per iteration, the coordinator sends
+//  the centroids that changed, and each worker answers with the objective value and the sizes of
+//  clusters over its shard and with the changes of its partial running sums; documents never travel,
+//  except the few ones becoming initial or reseeded centroids.
+//
+//  Processes talk over TCP ("host:port") or Unix domain sockets (a path), in native byte order,
+//  so that all processes must run on machines with the same byte order.
+//
+
+#ifndef Distributed_hpp
+#define Distributed_hpp
+
+#include <vector>
+#include <string>
+#include <ostream>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#include "KMeans.hpp"
+
+// Payload of a message, written and read in order
+class Message {
+
+public:
+    std::vector<char> data;
+
+    void clear()
+    {
+        this->data.clear();
+        this->_pos = 0;
+    }
+    // Read again from the beginning
+    void rewind()
+    {
+        this->_pos = 0;
+    }
+    template <typename T> void put(const T & value)
+    {
+        this->put(&value, 1);
+    }
+    template <typename T> void put(const T * values, const std::size_t & n)
+    {
+        const char * ptr = reinterpret_cast<const char *>(values);
+        this->data.insert(this->data.end(), ptr, ptr + n*sizeof(T));
+    }
+    // Return false if the payload is too short
+    template <typename T> bool get(T & value)
+    {
+        return this->get(&value, 1);
+    }
+    template <typename T> bool get(T * values, const std::size_t & n)
+    {
+        if (this->_pos + n*sizeof(T) > this->data.size())
+            return false;
+        std::memcpy(values, this->data.data() + this->_pos, n*sizeof(T));
+        this->_pos += n*sizeof(T);
+        return true;
+    }
+
+private:
+    std::size_t _pos = 0;
+};
+
+// Connection exchanging framed messages over a stream socket
+class Channel {
+
+public:
+    enum Type
+    {
+        SHARD = 1,      // coordinator -> worker: shard, shards
+        READY,          // worker -> coordinator: result of opening the shard, n_points, max_attribute, first, size
+        START,          // coordinator -> worker: n_clusters
+        GET_POINT,      // coordinator -> worker: index in the shard
+        POINT,          // worker -> coordinator: index in the shard (-1 if none), nnz, dims, values
+        CENTROIDS,      // coordinator -> worker: count, then per centroid: id, l2-norm, nnz, dims, weights
+        ASSIGN,         // coordinator -> worker
+        PARTIAL,        // worker -> coordinator: moved points (-1 on failure), objective value, seconds taken,
+                        //                        sizes [n_clusters], count, then per changed cluster: id, nnz, dims, sum changes
+        RESEED,         // coordinator -> worker: donor, cid
+        COLLECT,        // coordinator -> worker
+        ASSIGNMENTS,    // worker -> coordinator: n, ids [n], clusters [n]
+        STOP            // coordinator -> worker
+    };
+
+    // Largest message accepted. A frame announcing a larger one is taken as a broken connection.
+    static const std::uint64_t MAX_MESSAGE_SIZE = 1ULL << 30;
+
+    ~Channel();
+    // Listen on an address, either "host:port" or the path of a Unix domain socket
+    // Return the listening socket, or -1 on failure
+    static int listen(const std::string & address);
+    static void closeListener(const int & listener, const std::string & address);
+    // Accept a connection from a listening socket
+    // Return 0 on success, 1 on failure
+    int accept(const int & listener);
+    // Connect to an address, retrying for at most the given seconds while nobody listens on it
+    // Return 0 on success, 1 on failure
+    int connect(const std::string & address, const double & timeout);
+    void close();
+    // Return 0 on success, 1 if the connection is broken
+    int send(const int & type, const Message & message);
+    int receive(int & type, Message & message);
+    // Bytes sent and received so far
+    std::uint64_t bytesSent() const;
+    std::uint64_t bytesReceived() const;
+
+private:
+    struct _Frame
+    {
+        std::uint32_t type;
+        std::uint32_t reserved;
+        std::uint64_t size;
+    };
+    int _fd = -1;
+    std::uint64_t _sent = 0;
+    std::uint64_t _received = 0;
+
+    int _write(const char * data, std::size_t size);
+    int _read(char * data, std::size_t size);
+};
+
+// Coordinator of workers holding shards of a dataset file
+class ShardCoordinator {
+
+public:
+    ShardCoordinator();
+    ~ShardCoordinator();
+    void setLogStream(std::ostream * log_stream);
+    // Stop iterating once an iteration improves the objective by less than the given fraction of it (0 disables)
+    void setTolerance(const double & tolerance);
+    // Wait for the given number of workers to connect, assign shard i to the i-th worker, and wait for them to open their shards.
+    // Return 0 on success, 1 if unable to listen on the address, 2 if a worker fails or the workers hold different datasets
+    int accept(const std::string & address, const int & n_workers);
+    // Run a clustering over all shards with the given random seed for the initial centroids.
+    // Initial centroids are picked in the same way as KMeans::run() picks them from the whole dataset.
+    // Return the number of iterations, or -1 if a worker fails
+    int run(const int & n_clusters, const int & seed);
+    // Collect the ids and the clusters of all data objects of the last run, in the order of the dataset file
+    // Return 0 on success, 1 if a worker fails
+    int collect(std::vector<int> & ids, std::vector<int> & clusters);
+    // Ask the workers to exit
+    void stop();
+    std::int64_t getNumberOfPoints() const;
+    const double & getObjValue() const;
+    const double & getTimeElapse() const;
+
+private:
+    std::ostream * _log_stream;
+    double _tolerance = 0;
+    std::vector<std::unique_ptr<Channel> > _workers;
+    std::vector<std::int64_t> _first;           // index of the first data object of each shard
+    std::vector<std::int64_t> _size;            // number of data objects of each shard
+    std::int64_t _n_points = 0;
+    int _dim = -1;
+    int _n_clusters = 0;
+    // Centroids, their running sums and sizes over all shards
+    std::vector<Eigen::VectorXd> _vec;
+    std::vector<Eigen::VectorXd> _sum;
+    std::vector<double> _l2norm;
+    std::vector<std::int64_t> _sizes;
+    // Size of each cluster in each shard, _counts[w*n_clusters + c]
+    std::vector<std::int64_t> _counts;
+    // Clusters whose points changed in the last iteration, and centroids to be sent to workers
+    std::vector<char> _changed;
+    std::vector<char> _outdated;
+    double _obj_value = 0;
+    double _time_taken = 0;
+    Message _out;
+    Message _in;
+
+    // Get the vector of a data object from the worker holding it
+    // Return 0 on success, 1 if the worker fails
+    int _getPoint(const std::int64_t & index, Eigen::VectorXd & vec);
+    // Ask a worker holding points of the donor to move its last one into the empty cluster cid
+    // Return 0 on success, 1 if the worker fails
+    int _reseed(const int & cid, const int & donor);
+    // Read a point from a POINT message into vec. Return 1 if the message is invalid or holds no point.
+    int _readPoint(Eigen::VectorXd & vec);
+    // Exchange of an iteration: send outdated centroids and collect partial results
+    // Return the number of points moved, or -1 if a worker fails
+    int _exchange(double & slowest);
+    // Update the centroids of changed clusters. Return the number of centroids updated.
+    int _update();
+};
+
+// Worker holding a shard of a dataset file for a coordinator
+class ShardWorker {
+
+public:
+    ShardWorker();
+    void setLogStream(std::ostream * log_stream);
+    // Connect to the coordinator at address, open the shard it assigns from the dataset file, with blocks of
+    // block_bytes bytes, and answer its requests until it asks to stop.
+    // Return 0 when asked to stop, 1 if unable to connect, 2 if the shard cannot be opened, 3 if the connection is lost
+    int serve(const std::string & dataset_file, const std::size_t & block_bytes, const std::string & address);
+
+private:
+    std::ostream * _log_stream;
+
+    // Append the vector of a point of the shard to a message, or -1 if index is -1
+    static void _putPoint(KMeans & cluster, const int & index, Message & message);
+};
+
+#endif /* Distributed_hpp */
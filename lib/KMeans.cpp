@@ -8,7 +8,63 @@
 
 #include "KMeans.hpp"
 
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
 int KMeans::UNASSIGNED_RANDOM_SEED_FLAG = 0;
+const int KMeans::CENTROID_TILE;
+const char KMeans::MODEL_MAGIC[8] = {'S', 'P', 'H', 'K', 'M', 'M', 'O', 'D'};
+const std::uint32_t KMeans::MODEL_VERSION;
+const int KMeans::_REMOVED;
+const int KMeans::_BISECT_ITERATIONS;
+const char KMeans::CHECKPOINT_MAGIC[8] = {'S', 'P', 'H', 'K', 'M', 'C', 'K', 'P'};
+const std::uint32_t KMeans::CHECKPOINT_VERSION;
+
+// Number of allocations made through operator new by each thread, so that clusterings
+// running in parallel threads do not count the allocations of one another.
+// Define KMEANS_ALLOCATION_COUNTER to replace the global operator new and count them;
+// otherwise no allocation is counted.
+static thread_local std::size_t allocation_count = 0;
+
+#ifdef KMEANS_ALLOCATION_COUNTER
+#if defined(__GNUC__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+// free() is the matching deallocation of the replaced operator new
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void * operator new(std::size_t size)
+{
+    allocation_count++;
+    void * ptr = std::malloc(size == 0 ? 1 : size);
+    if (ptr == nullptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void * operator new[](std::size_t size)
+{
+    return ::operator new(size);
+}
+
+void operator delete(void * ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void * ptr) noexcept
+{
+    std::free(ptr);
+}
+#if defined(__GNUC__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+#endif
+
+std::size_t KMeans::getAllocationCount()
+{
+    return allocation_count;
+}
 
 KMeans::KMeans(const int & n_clusters)
 {
@@ -18,12 +74,47 @@ KMeans::KMeans(const int & n_clusters)
 
 KMeans::~KMeans()
 {
-    for(auto p: this->_pts)
-        delete p.second;
-    for(auto p: this->_s_pts)
-        delete p;
     for(auto c: this->_centroids)
         delete c;
+    this->_releaseTrails();
+}
+
+const std::size_t KMeans::_Arena::CHUNK_SIZE;
+
+KMeans::_Arena::~_Arena()
+{
+    this->release();
+}
+
+void * KMeans::_Arena::allocate(const std::size_t & bytes)
+{
+    std::size_t size = (bytes + alignof(double) - 1)/alignof(double)*alignof(double);
+    if (this->_chunks.empty() || this->_used + size > this->_last_size)
+    {
+        // Larger requests get a chunk of their own
+        this->_last_size = std::max(size, KMeans::_Arena::CHUNK_SIZE);
+        this->_chunks.push_back(static_cast<char *>(::operator new(this->_last_size)));
+        this->_capacity += this->_last_size;
+        this->_used = 0;
+    }
+    void * ptr = this->_chunks.back() + this->_used;
+    this->_used += size;
+    return ptr;
+}
+
+void KMeans::_Arena::release()
+{
+    for (auto c : this->_chunks)
+        ::operator delete(c);
+    std::vector<char *>().swap(this->_chunks);
+    this->_used = 0;
+    this->_last_size = 0;
+    this->_capacity = 0;
+}
+
+std::size_t KMeans::_Arena::capacity() const
+{
+    return this->_capacity;
 }
 
 void KMeans::setNumberOfClusters(const int & n_clusters)
@@ -41,6 +132,52 @@ void KMeans::setRandomSeed(const int & seed)
     this->seed = seed;
 }
 
+void KMeans::setAssignKernel(const AssignKernel & kernel)
+{
+    this->_requested_kernel = kernel;
+}
+
+void KMeans::setCacheBlocking(const int & point_block, const int & centroid_block)
+{
+    this->_point_block_size = point_block < 0 ? 0 : point_block;
+    this->_tile_block_size = centroid_block < 1 ? 0 : (centroid_block + KMeans::CENTROID_TILE - 1)/KMeans::CENTROID_TILE;
+}
+
+void KMeans::setReleaseRawData(const bool & release)
+{
+    this->_release_raw_data = release;
+}
+
+void KMeans::setCollapseDuplicates(const bool & collapse)
+{
+    this->_collapse_duplicates = collapse;
+}
+
+void KMeans::setReorderInterval(const int & iterations)
+{
+    this->_reorder_interval = iterations < 0 ? 0 : iterations;
+}
+
+void KMeans::setTolerance(const double & tolerance)
+{
+    this->_tolerance = tolerance < 0 ? 0 : tolerance;
+}
+
+void KMeans::setRaceBounds(const std::vector<double> & bounds)
+{
+    this->_race_bounds = bounds;
+}
+
+bool KMeans::isAbandoned() const
+{
+    return this->_abandoned;
+}
+
+void KMeans::setWarmStart(const bool & warm_start)
+{
+    this->_warm_start = warm_start;
+}
+
 void KMeans::setCentroidUpdateThreshold(const int & threshold)
 {
     this->_update_threshold = threshold < 0 ? 0 : threshold;
@@ -56,11 +193,21 @@ const double & KMeans::getObjValue()
     return this->_obj_value;
 }
 
-const std::unordered_map<int, int> & KMeans::getEachPointCluster()
+const std::vector<int> & KMeans::getEachPointCluster()
 {
     return this->_point_clustering;
 }
 
+const std::vector<int> & KMeans::getPointIds()
+{
+    return this->_ids;
+}
+
+const std::vector<std::pair<int, int> > & KMeans::getCollapsedPoints()
+{
+    return this->_collapsed;
+}
+
 const std::deque<std::deque<int> > & KMeans::getClusters()
 {
     return this->_clustering;
@@ -71,25 +218,337 @@ const std::vector<std::tuple<int, double, double> > & KMeans::getIterationInfo()
     return this->_iter_info;
 }
 
+const std::vector<std::size_t> & KMeans::getIterationAllocations()
+{
+    return this->_iter_allocations;
+}
+
 int KMeans::addDataPoint(const int & id, const std::deque<int> & attribute, const std::deque<double> & value)
 {
-    this->_completed = false;
-    if (attribute.empty())
-        return 1;       // Empty point
-    if (attribute.size() != value.size())
+    if (!attribute.empty() && attribute.size() != value.size())
         return 2;       // Different number of attributes and values
-    if (this->_pts.find(id) != this->_pts.end())
+    std::vector<int> attr(attribute.begin(), attribute.end());
+    std::vector<double> val(value.begin(), value.end());
+    return this->addDataPoint(id, attr.data(), val.data(), attr.size());
+}
+
+int KMeans::addDataPoint(const int & id, const int * attribute, const double * value, const int & size)
+{
+    if (size < 1)
+        return 1;       // Empty point
+    if (this->_dataset)
+        return 4;       // Points are streamed from a dataset file
+    if (this->_id_index.find(id) != this->_id_index.end() || this->_collapsed_index.find(id) != this->_collapsed_index.end())
         return 3;       // Repeated point
+    if (this->_collapse_duplicates)
+    {
+        // FNV-1a hash of the normalized vector. Points with the same hash are compared entry by entry,
+        // from their rows if they were vectorized, or else from their raw data.
+        std::vector<std::pair<int, double> > entries, other;
+        KMeans::_normalize(attribute, value, size, entries);
+        const std::uint64_t hash = KMeans::_hashEntries(entries);
+        auto range = this->_vector_ids.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it)
+        {
+            auto index = this->_id_index.find(it->second);
+            if (index == this->_id_index.end())
+                continue;       // removed since
+            const int p = index->second;
+            this->_pointEntries(p, other);
+            if (other != entries)
+                continue;
+            this->_collapsed_index[id] = this->_collapsed.size();
+            this->_collapsed.push_back(std::make_pair(id, it->second));
+            this->_arrivals.push_back(id);
+            this->setPointWeight(it->second, this->_weights.empty() ? 2 : this->_weights[p] + 1);
+            return 5;
+        }
+        this->_vector_ids.insert(std::make_pair(hash, id));
+    }
     // Update the max dimension if needed
-    int max_dim = *std::max_element(attribute.begin(), attribute.end());
+    int max_dim = *std::max_element(attribute, attribute + size);
     if (max_dim > this->_dim)
         this->_dim = max_dim;
     // Record the new point
-    this->_pts[id] = new Point(id, attribute, value);
+    Point * p = static_cast<Point *>(this->_arena.allocate(sizeof(Point) + size*(sizeof(double) + sizeof(int))));
+    p->id = id;
+    p->size = size;
+    p->value = reinterpret_cast<double *>(p + 1);
+    p->attribute = reinterpret_cast<int *>(p->value + p->size);
+    std::copy(attribute, attribute + size, p->attribute);
+    std::copy(value, value + size, p->value);
+    this->_id_index[id] = this->_n_points;
+    this->_ids.push_back(id);
+    this->_pts.push_back(p);
+    this->_removed.push_back(false);
+    if (!this->_weights.empty())
+        this->_weights.push_back(1);
+    this->_arrivals.push_back(id);
     this->_n_points++;
     return 0;
 }
 
+int KMeans::removeDataPoint(const int & id)
+{
+    if (this->_removeDocument(id) != 0)
+        return 1;       // No such point
+    // The entry of the data object in the arrival order is skipped when it comes up
+    this->_departed[id]++;
+    return 0;
+}
+
+int KMeans::_removeDocument(const int & id)
+{
+    if (this->_dataset)
+        return 1;
+    // A collapsed data object only takes its share of the weight of the data object it was collapsed into
+    auto collapsed = this->_collapsed_index.find(id);
+    if (collapsed != this->_collapsed_index.end())
+    {
+        const int target = this->_collapsed[collapsed->second].second;
+        this->_eraseCollapsed(collapsed->second);
+        const int p = this->_id_index[target];
+        this->setPointWeight(target, this->_weights[p] - 1);
+        return 0;
+    }
+    auto index = this->_id_index.find(id);
+    if (index == this->_id_index.end())
+        return 1;       // No such point
+    const int p = index->second;
+    // A data object with collapsed duplicates hands its point over to one of them, one weight lighter
+    for (std::size_t i = 0; i < this->_collapsed.size(); ++i)
+    {
+        if (this->_collapsed[i].second != id)
+            continue;
+        const int heir = this->_collapsed[i].first;
+        this->_eraseCollapsed(i);
+        for (auto & c : this->_collapsed)
+        {
+            if (c.second == id)
+                c.second = heir;
+        }
+        std::vector<std::pair<int, double> > entries;
+        this->_pointEntries(p, entries);
+        this->_vector_ids.insert(std::make_pair(KMeans::_hashEntries(entries), heir));
+        this->_id_index.erase(index);
+        this->_id_index[heir] = p;
+        this->_ids[p] = heir;
+        if (this->_pts[p] != nullptr)
+            this->_pts[p]->id = heir;
+        this->setPointWeight(heir, this->_weights[p] - 1);
+        return 0;
+    }
+    this->_id_index.erase(index);
+    this->_removed[p] = true;
+    this->_n_removed++;
+    // Points not vectorized yet are marked removed when vectorized
+    if (p < (int)this->_row_doc.size())
+    {
+        const int row = this->_doc_row[p];
+        const int c = this->_row_cen[row];
+        if (c >= 0)
+        {
+            this->_subtractWeightedRow(row, this->_centroids[c]->sum);
+            this->_centroids[c]->size--;
+            this->_centroids[c]->weight -= this->_rowWeight(row);
+            this->_dirty[c] = 1;
+        }
+        this->_row_cen[row] = KMeans::_REMOVED;
+    }
+    return 0;
+}
+
+int KMeans::setPointWeight(const int & id, const double & weight)
+{
+    auto index = this->_id_index.find(id);
+    if (index == this->_id_index.end() || this->_dataset)
+        return 1;       // No such point
+    if (!(weight > 0))
+        return 2;
+    const int p = index->second;
+    if (this->_weights.empty())
+    {
+        if (weight == 1)
+            return 0;
+        this->_weights.assign(this->_n_points, 1);
+    }
+    // An assigned point changes the running sum of its cluster at once
+    if (p < (int)this->_row_doc.size())
+    {
+        const int row = this->_doc_row[p];
+        const int c = this->_row_cen[row];
+        if (c >= 0)
+        {
+            this->_subtractWeightedRow(row, this->_centroids[c]->sum);
+            this->_centroids[c]->weight += weight - this->_weights[p];
+            this->_weights[p] = weight;
+            this->_addWeightedRow(row, this->_centroids[c]->sum);
+            this->_dirty[c] = 1;
+        }
+    }
+    this->_weights[p] = weight;
+    return 0;
+}
+
+void KMeans::setWindowSize(const int & size)
+{
+    this->_window_size = size < 0 ? 0 : size;
+}
+
+int KMeans::getNumberOfPoints()
+{
+    return this->_n_points - this->_n_removed;
+}
+
+int KMeans::getNumberOfClusters()
+{
+    return this->_n_clusters;
+}
+
+int KMeans::openDataset(const std::string & file, const std::size_t & block_bytes, const int & shard, const int & shards)
+{
+    if (this->_n_points > 0)
+        return 3;       // Points already added
+    std::unique_ptr<Dataset> dataset(new Dataset);
+    int result = dataset->open(file, block_bytes, shard, shards);
+    if (result != 0)
+        return result;
+    if (dataset->readIds(this->_ids) != 0)
+        return 1;
+
+    // Only the ids and the assignment of points are kept; a point's row is its record in the file
+    const Dataset::Header & header = dataset->header();
+    this->_n_points = dataset->size();
+    this->_dim = header.max_attribute;
+    this->_removed.assign(this->_n_points, false);
+    this->_row_cen.assign(this->_n_points, -1);
+    this->_row_doc.resize(this->_n_points);
+    this->_doc_row.resize(this->_n_points);
+    for (int p = 0; p < this->_n_points; ++p)
+    {
+        this->_row_doc[p] = p;
+        this->_doc_row[p] = p;
+        this->_id_index[this->_ids[p]] = p;
+    }
+    this->_dataset.swap(dataset);
+    return 0;
+}
+
+void KMeans::_expireWindow()
+{
+    if (this->_window_size == 0 || this->_dataset)
+        return;
+    // Collapsed data objects count and expire in their turn, each lowering the weight of the point it was collapsed into
+    int expired = 0;
+    while (this->_n_points - this->_n_removed + (int)this->_collapsed.size() > this->_window_size)
+    {
+        const int id = this->_arrivals.front();
+        this->_arrivals.pop_front();
+        auto departed = this->_departed.find(id);
+        if (departed != this->_departed.end())
+        {
+            if (--departed->second == 0)
+                this->_departed.erase(departed);
+            continue;
+        }
+        this->_removeDocument(id);
+        expired++;
+    }
+    if (expired > 0)
+        *this->log_stream << "  Expire " << expired << " data objects out of the window" << std::endl;
+}
+
+void KMeans::_compact()
+{
+    // New index of each point
+    std::vector<int> new_index(this->_n_points, -1);
+    int n = 0;
+    for (int p = 0; p < this->_n_points; ++p)
+    {
+        if (!this->_removed[p])
+            new_index[p] = n++;
+    }
+
+    // Rows are compacted in place, keeping their order.
+    // A row is only moved towards the front, after the rows before it have been moved.
+    const int n_rows = this->_row_doc.size();
+    int r2 = 0;
+    std::int64_t start, end, pos = 0;
+    for (int r = 0; r < n_rows; ++r)
+    {
+        start = this->_row_ptr[r];
+        end = this->_row_ptr[r+1];
+        if (this->_row_cen[r] == KMeans::_REMOVED)
+            continue;
+        std::copy(this->_col.begin() + start, this->_col.begin() + end, this->_col.begin() + pos);
+        std::copy(this->_val.begin() + start, this->_val.begin() + end, this->_val.begin() + pos);
+        pos += end - start;
+        this->_row_ptr[r2+1] = pos;
+        this->_row_doc[r2] = new_index[this->_row_doc[r]];
+        this->_row_cen[r2] = this->_row_cen[r];
+        r2++;
+    }
+    this->_row_ptr.resize(r2+1);
+    this->_col.resize(pos);
+    this->_val.resize(pos);
+    this->_row_doc.resize(r2);
+    this->_row_cen.resize(r2);
+
+    // Points
+    this->_id_index.clear();
+    for (int p = 0; p < this->_n_points; ++p)
+    {
+        if (new_index[p] == -1)
+            continue;
+        this->_pts[new_index[p]] = this->_pts[p];
+        this->_ids[new_index[p]] = this->_ids[p];
+        if (!this->_weights.empty())
+            this->_weights[new_index[p]] = this->_weights[p];
+        if (p < (int)this->_point_clustering.size())
+            this->_point_clustering[new_index[p]] = this->_point_clustering[p];
+        this->_id_index[this->_ids[new_index[p]]] = new_index[p];
+    }
+    this->_pts.resize(n);
+    this->_ids.resize(n);
+    if (!this->_weights.empty())
+        this->_weights.resize(n);
+    if ((int)this->_point_clustering.size() > n)
+        this->_point_clustering.resize(n);
+    this->_removed.assign(n, false);
+    this->_doc_row.resize(r2);
+    for (int r = 0; r < r2; ++r)
+        this->_doc_row[this->_row_doc[r]] = r;
+    *this->log_stream << "  Reclaim " << this->_n_removed << " removed data objects" << std::endl;
+    this->_n_points = n;
+    this->_n_removed = 0;
+}
+
+void KMeans::_resetSums()
+{
+    for (auto c : this->_centroids)
+    {
+        c->sum.setZero();
+        c->size = 0;
+        c->weight = 0;
+    }
+    for (int r = 0; r < (int)this->_row_cen.size(); ++r)
+    {
+        if (this->_row_cen[r] < 0)
+            continue;
+        this->_addWeightedRow(r, this->_centroids[this->_row_cen[r]]->sum);
+        this->_centroids[this->_row_cen[r]]->size++;
+        this->_centroids[this->_row_cen[r]]->weight += this->_rowWeight(r);
+    }
+    for (auto c : this->_centroids)
+    {
+        if (c->size == 0)
+            continue;
+        c->vec = c->sum/c->weight;
+        c->l2norm = c->vec.norm();
+    }
+    std::fill(this->_dirty.begin(), this->_dirty.end(), 0);
+}
+
 void KMeans::log(const std::string & message)
 {
     *this->log_stream << message << std::endl;
@@ -97,39 +556,55 @@ void KMeans::log(const std::string & message)
 
 int KMeans::run()
 {
-    if (this->_n_points < 1)
+    this->_releaseTrails();
+    this->_expireWindow();
+    if (this->_n_points - this->_n_removed < 1)
         return 0;
 
-    if (this->_n_clusters > this->_n_points)
-        this->_n_clusters = this->_n_points;
+    if (this->_n_clusters > this->_n_points - this->_n_removed)
+        this->_n_clusters = this->_n_points - this->_n_removed;
 
     std::chrono::time_point<std::chrono::high_resolution_clock> start_time = std::chrono::high_resolution_clock::now();
 
     // Clear old clustering information
+    // Buffers keep their capacity so that later runs do not allocate them again
     if (this->_completed == true)
     {
-        for(auto c: this->_centroids)
-            delete c;
-        this->_centroids.clear();
-        this->_point_clustering.clear();
         this->_clustering.clear();
         this->_iter_info.clear();
+        this->_iter_allocations.clear();
         this->_total_time_taken = 0;
         this->_completed = false;
+        std::fill(this->_row_cen.begin(), this->_row_cen.end(), -1);
     }
-    else
+    if ((int)this->_row_doc.size() < this->_n_points)
     {
         // Vectorize each point
         this->log("Processing raw data...");
         this->_vectorizeData();
     }
+    // Every point is assigned again, so removed points are reclaimed now
+    if (this->_n_removed > 0)
+        this->_compact();
 
-    if (this->_n_clusters > this->_n_points)
-        this->_n_clusters = this->_n_points;
-
-    // Generate initial centriods
-    this->log("Initialize centroids...");
-    this->_initializeCentroids();
+    int iter = 0;
+    if (!this->_resume.empty())
+    {
+        iter = this->_applyCheckpoint();
+        std::vector<char>().swap(this->_resume);
+        if (iter > 0)
+            *this->log_stream << "Resume from the checkpoint at iteration " << iter << "..." << std::endl;
+        else
+            this->log("The checkpoint does not match the data. Start over.");
+    }
+    if (iter == 0)
+    {
+        // Generate initial centriods
+        this->log("Initialize centroids...");
+        this->_initializeCentroids();
+    }
+    this->_selectKernel();
+    this->_allocateBuffers();
 //    std::deque<int> inital_centroids = this->_initializeCentroids();
 //    std::string init_cens = "  ";
 //    for (int i = this->_n_clusters; --i > 0;)
@@ -138,222 +613,2261 @@ int KMeans::run()
 
     // Start clustering
     this->log("Begin clustering...");
-    int iter = 0;
-    int updated_cens = 0;
-    std::chrono::time_point<std::chrono::high_resolution_clock> time;
-    double time_elapse;
-    do
-    {
-        time = std::chrono::high_resolution_clock::now();
-        iter++;
-        updated_cens = this->_assignPoints();
-        time_elapse = std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1> > > (std::chrono::high_resolution_clock::now() - time).count();
-        *this->log_stream << "  Iteration: "  << iter
-            << ". Updated Centroids: " << updated_cens
-            << ". Obj. Value: " << std::fixed << this->_obj_value
-            << ". Time Taken: " << time_elapse << "s" << std::endl;
-        this->_iter_info.push_back(std::make_tuple(updated_cens, this->_obj_value, time_elapse));
-
-
-    } while (updated_cens > this->_update_threshold);
+    iter = this->_iterate(iter);
 
     // Collect clustering solution
     this->log("Collect clustering solution...");
-    std::deque<int> cluster_collection;
-    for (auto c : this->_centroids)
-    {
-        cluster_collection.clear();
-        for (auto p : c->pts)
-        {
-            cluster_collection.push_front(p->id);
-            this->_point_clustering[p->id] = c->id;
-        }
-        this->_clustering.push_front(std::move(cluster_collection));
-    }
+    this->_collectSolution();
 
     // Clustering complete
-    this->_total_time_taken = std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1> > > (std::chrono::high_resolution_clock::now() - start_time).count();
+    this->_total_time_taken += std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1> > > (std::chrono::high_resolution_clock::now() - start_time).count();
     // this->log("Clustering completed. Total time taken: " + std::to_string(this->_total_time_taken) + "s.");
     *this->log_stream << "Clustering completed. Total time taken: " << this->_total_time_taken << "s.";
     this->_completed = true;
     return iter;
 }
 
-void KMeans::_vectorizeData()
+int KMeans::runIncremental()
 {
-    int i;
-    _S_Point * sp;
-    for (auto p : this->_pts)
+    this->_releaseTrails();
+    if (this->_completed == false || (int)this->_centroids.size() != this->_n_clusters)
+        return this->run();
+
+    std::chrono::time_point<std::chrono::high_resolution_clock> start_time = std::chrono::high_resolution_clock::now();
+    this->_expireWindow();
+    if (this->_n_points - this->_n_removed < this->_n_clusters)
+        return this->run();
+    this->_clustering.clear();
+    this->_iter_info.clear();
+    this->_iter_allocations.clear();
+    this->_completed = false;
+
+    // Only new points are vectorized; their rows are appended and unassigned
+    const int n_old = this->_row_doc.size();
+    if (n_old < this->_n_points)
+    {
+        *this->log_stream << "Processing " << this->_n_points - n_old << " new data objects..." << std::endl;
+        this->_vectorizeData();
+    }
+    // Removed points stay in storage until they are a quarter of all points.
+    // Compaction also recomputes the running sums, which drift as points come and go.
+    if (this->_n_removed > 0 && 4*this->_n_removed >= this->_n_points)
+    {
+        this->_compact();
+        this->_resetSums();
+    }
+    else
+    {
+        for (auto c : this->_centroids)
+        {
+            if (this->_dirty[c->id] == 0 || c->size == 0)
+                continue;
+            c->vec = c->sum/c->weight;
+            c->l2norm = c->vec.norm();
+        }
+        std::fill(this->_dirty.begin(), this->_dirty.end(), 0);
+    }
+    // New tokens extend the centroids with zero weights
+    if (this->_centroids[0]->vec.size() != this->_dim+1)
     {
-        sp = new _S_Point(p.first);
-        this->_s_pts.push_front(sp);
+        Eigen::Index old_size;
+        for (auto c : this->_centroids)
+        {
+            old_size = c->vec.size();
+            c->vec.conservativeResize(this->_dim+1);
+            c->vec.tail(this->_dim+1 - old_size).setZero();
+            c->sum.conservativeResize(this->_dim+1);
+            c->sum.tail(this->_dim+1 - old_size).setZero();
+        }
+    }
+    this->_packCentroids();
+    this->_selectKernel();
+    this->_allocateBuffers();
+
+    this->log("Continue clustering...");
+    int iter = this->_iterate();
 
-        sp->vec = Eigen::SparseVector<double>(this->_dim+1);
-        i = p.second->attribute.size();
-        for (; --i > -1;)
-            sp->vec.insert(p.second->attribute[i]) = p.second->value[i];
-	sp->vec /= sp->vec.norm();
+    this->log("Collect clustering solution...");
+    this->_collectSolution();
+
+    double time_taken = std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1> > > (std::chrono::high_resolution_clock::now() - start_time).count();
+    this->_total_time_taken += time_taken;
+    *this->log_stream << "Clustering completed. Time taken: " << time_taken << "s.";
+    this->_completed = true;
+    return iter;
+}
+
+int KMeans::growClusters(const int & n_clusters)
+{
+    if (this->_completed == false || n_clusters <= this->_n_clusters || (int)this->_centroids.size() != this->_n_clusters)
+    {
+        this->setNumberOfClusters(n_clusters);
+        return this->run();
     }
+    // Points added since the last run get their rows first, unassigned, so that every point has a row to split by
+    const int n_rows = this->_row_doc.size();
+    if (!this->_dataset && n_rows < this->_n_points)
+    {
+        *this->log_stream << "Processing " << this->_n_points - n_rows << " new data objects..." << std::endl;
+        this->_vectorizeData();
+    }
+    const int n_old = this->_n_clusters;
+    const int added = this->_splitClusters(std::min(n_clusters, this->_n_points - this->_n_removed));
+    if (added < 0)
+        return 0;
+    *this->log_stream << "Split clusters into " << added << " new clusters: " << n_old << " -> " << this->_n_clusters << "..." << std::endl;
+    return this->runIncremental();
 }
 
-std::deque<int> KMeans::_initializeCentroids()
+int KMeans::_splitClusters(const int & n_clusters)
 {
-    std::deque<int> inital_centroids;
+    const int n_old = this->_n_clusters;
+    std::vector<double> dissim;
+    std::vector<double> totals(n_old, 0);
+    int c;
+    if (this->_pointDissimilarities(dissim) != 0)
+    {
+        this->log("  Unable to read the dataset file. No clusters are split.");
+        return -1;
+    }
+    for (int row = 0; row < this->_n_points; ++row)
+    {
+        if (this->_row_cen[row] >= 0)
+            totals[this->_row_cen[row]] += this->_rowWeight(row)*dissim[row];
+    }
+
+    // The cluster with the largest sum is split, one new cluster at a time
+    std::vector<int> splits(n_old, 0);
+    std::priority_queue<std::pair<double, int> > queue;
+    for (c = 0; c < n_old; ++c)
+    {
+        if (this->_centroids[c]->size > 1)
+            queue.push(std::make_pair(totals[c], c));
+    }
+    for (int k = n_old; k < n_clusters && !queue.empty(); ++k)
+    {
+        std::pair<double, int> top = queue.top();
+        queue.pop();
+        c = top.second;
+        if (++splits[c] + 1 < this->_centroids[c]->size)
+            queue.push(std::make_pair(top.first/2, c));
+    }
+
+    // New centroids are random points of the split clusters. The farthest points of a cluster are mostly outliers,
+    // which would become clusters of their own.
     std::mt19937 sd;
     if (this->seed == KMeans::UNASSIGNED_RANDOM_SEED_FLAG)
         sd.seed(std::random_device()());
     else
         sd.seed(this->seed);
-    std::uniform_int_distribution<int> random_gen(0, this->_s_pts.size());
-    int rand_num;
-    std::set<int> random_num_generated;
-    for (int i = this->_n_clusters; --i>-1;)
+    std::vector<std::vector<int> > rows(n_old);
+    for (int row = 0; row < this->_n_points; ++row)
     {
-        rand_num = random_gen(sd);
-        if (random_num_generated.find(rand_num) == random_num_generated.end())
+        c = this->_row_cen[row];
+        if (c >= 0 && splits[c] > 0)
+            rows[c].push_back(row);
+    }
+    for (c = 0; c < n_old; ++c)
+    {
+        for (int k = 0; k < splits[c]; ++k)
         {
-            random_num_generated.insert(rand_num);
-            this->_centroids.push_front(new _Centroid(
-                                                      i, this->_s_pts[rand_num]->vec, 1)
-                                        );
-            inital_centroids.push_front(this->_s_pts[rand_num]->id);
-            continue;
+            std::uniform_int_distribution<int> random_gen(0, rows[c].size() - 1);
+            int p = random_gen(sd);
+            _Centroid * cen = new _Centroid(this->_centroids.size(), Eigen::VectorXd::Zero(this->_dim+1), 1);
+            this->_addRow(rows[c][p], cen->vec);
+            this->_centroids.push_back(cen);
+            std::swap(rows[c][p], rows[c].back());
+            rows[c].pop_back();
         }
-        ++i;
     }
-    return inital_centroids;
+    // New clusters start empty; their points leave the old clusters in the next assignment
+    this->_n_clusters = this->_centroids.size();
+    this->_dirty.resize(this->_n_clusters, 0);
+    return this->_n_clusters - n_old;
 }
 
-int KMeans::_assignPoints()
+int KMeans::_pointDissimilarities(std::vector<double> & dissim)
 {
-    double dissim;
-    double min_dissim;
-    std::set<int> updated_centroids;
-    int updated = 0;
-    _Centroid * tar_centroid = nullptr;
-    this->_obj_value = 0;
-
-    for (auto c : this->_centroids)
-        c->pts.clear();
-
-    for (auto p : this->_s_pts)
+    int nnz, c;
+    const int * col;
+    const double * val;
+    const char * data;
+    const Dataset::Block * block;
+    double dot;
+    dissim.assign(this->_n_points, 0);
+    if (!this->_dataset)
     {
-        // Looking for the closest centroid
-        // Now only cosine dissimilarity is supported
-        // cosine dissimilarity is in the range [0, 2] or [0, 1] if tf-idf is used
-        min_dissim = 3;
-        for (auto c : this->_centroids)
+        for (int row = 0; row < this->_n_points; ++row)
         {
-            dissim = 1 - p->vec.dot(c->vec)/c->l2norm;
+            c = this->_row_cen[row];
+            if (c >= 0)
+                dissim[row] = 1 - this->_dotRow(row, this->_centroids[c]->vec)/this->_centroids[c]->l2norm;
+        }
+        return 0;
+    }
+    this->_dataset->rewind();
+    while ((block = this->_dataset->next()) != nullptr)
+    {
+        data = block->data;
+        for (int row = block->first; row < block->first + block->size; ++row)
+        {
+            data += Dataset::record(data, nnz, col, val);
+            c = this->_row_cen[row];
+            if (c < 0)
+                continue;
+            dot = 0;
+            for (int k = 0; k < nnz; ++k)
+                dot += val[k]*this->_centroids[c]->vec[col[k]];
+            dissim[row] = 1 - dot/this->_centroids[c]->l2norm;
+        }
+    }
+    return this->_dataset->failed() ? 1 : 0;
+}
+
+int KMeans::runBisecting(const int & n_threads)
+{
+    this->_releaseTrails();
+    this->_expireWindow();
+    if (this->_n_points - this->_n_removed < 1)
+        return 0;
+
+    if (this->_n_clusters > this->_n_points - this->_n_removed)
+        this->_n_clusters = this->_n_points - this->_n_removed;
+
+    std::chrono::time_point<std::chrono::high_resolution_clock> start_time = std::chrono::high_resolution_clock::now();
+    std::chrono::time_point<std::chrono::high_resolution_clock> time;
+    this->_clustering.clear();
+    this->_iter_info.clear();
+    this->_iter_allocations.clear();
+    this->_total_time_taken = 0;
+    this->_completed = false;
+    this->_abandoned = false;
+    if ((int)this->_row_doc.size() < this->_n_points)
+    {
+        this->log("Processing raw data...");
+        this->_vectorizeData();
+    }
+    if (this->_n_removed > 0)
+        this->_compact();
+
+    // The root cluster holds all points. The sum of dissimilarities of a cluster whose centroid is
+    // the mean of its points is its weight minus the norm of its running sum.
+    this->log("Initialize the root cluster...");
+    for (auto c : this->_centroids)
+        delete c;
+    this->_centroids.clear();
+    this->_centroids.push_back(new _Centroid(0, Eigen::VectorXd::Zero(this->_dim+1), 1));
+    std::vector<std::vector<int> > rows(1);
+    rows[0].reserve(this->_n_points);
+    for (int row = 0; row < this->_n_points; ++row)
+    {
+        this->_row_cen[row] = 0;
+        rows[0].push_back(row);
+        this->_addWeightedRow(row, this->_centroids[0]->sum);
+        this->_centroids[0]->weight += this->_rowWeight(row);
+    }
+    this->_centroids[0]->size = this->_n_points;
+    this->_centroids[0]->vec = this->_centroids[0]->sum/this->_centroids[0]->weight;
+    this->_centroids[0]->l2norm = this->_centroids[0]->vec.norm();
+    std::vector<double> totals(1, this->_centroids[0]->weight - this->_centroids[0]->sum.norm());
+    std::vector<int> leaf(1, 0);        // node of each cluster in the hierarchy
+    this->_hierarchy.assign(1, HierarchyNode{-1, -1, -1, 0, this->_n_points, totals[0]});
+
+    // Rows read one by one from a file share a buffer, so that they cannot be read by several threads
+    const int width = n_threads > 0 ? n_threads : std::max<int>(1, std::thread::hardware_concurrency());
+    ThreadPool pool(this->_dataset && !this->_dataset->mapped() ? 1 : width);
+    const unsigned int seed = this->seed == KMeans::UNASSIGNED_RANDOM_SEED_FLAG ? std::random_device()() : this->seed;
+    std::vector<int> order;
+    double obj_value = totals[0];
+    double time_elapse;
+    std::size_t allocations;
+    int round = 0;
+    this->log("Begin bisecting...");
+    while ((int)this->_centroids.size() < this->_n_clusters)
+    {
+        time = std::chrono::high_resolution_clock::now();
+        allocations = KMeans::getAllocationCount();
+        // The worst clusters that can be split are split at once, each into itself and a new cluster
+        order.clear();
+        for (int c = 0; c < (int)this->_centroids.size(); ++c)
+        {
+            if (rows[c].size() > 1)
+                order.push_back(c);
+        }
+        if (order.empty())
+            break;
+        std::stable_sort(order.begin(), order.end(), [&](const int & a, const int & b) { return totals[a] > totals[b]; });
+        order.resize(std::min<std::size_t>(order.size(), std::min<std::size_t>(width, this->_n_clusters - this->_centroids.size())));
+        const int n_old = this->_centroids.size();
+        rows.resize(n_old + order.size());
+        totals.resize(n_old + order.size());
+        for (std::size_t k = 0; k < order.size(); ++k)
+            this->_centroids.push_back(new _Centroid(n_old + k, Eigen::VectorXd::Zero(this->_dim+1), 1));
+        for (std::size_t k = 0; k < order.size(); ++k)
+        {
+            const int cid = order[k];
+            const int nid = n_old + k;
+            pool.submit([this, cid, nid, seed, &rows, &totals]() {
+                this->_bisectCluster(cid, nid, rows[cid], rows[nid], totals[cid], totals[nid], seed + nid);
+            });
+        }
+        pool.wait();
+
+        for (std::size_t k = 0; k < order.size(); ++k)
+        {
+            const int cid = order[k];
+            const int nid = n_old + k;
+            const int node = leaf[cid];
+            this->_hierarchy[node].cluster = -1;
+            this->_hierarchy[node].left = this->_hierarchy.size();
+            leaf[cid] = this->_hierarchy.size();
+            this->_hierarchy.push_back(HierarchyNode{node, -1, -1, cid, (int)rows[cid].size(), totals[cid]});
+            this->_hierarchy[node].right = this->_hierarchy.size();
+            leaf.push_back(this->_hierarchy.size());
+            this->_hierarchy.push_back(HierarchyNode{node, -1, -1, nid, (int)rows[nid].size(), totals[nid]});
+        }
+        obj_value = 0;
+        for (auto total : totals)
+            obj_value += total;
+        round++;
+        allocations = KMeans::getAllocationCount() - allocations;
+        time_elapse = std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1> > > (std::chrono::high_resolution_clock::now() - time).count();
+        *this->log_stream << "  Round: " << round
+            << ". Split Clusters: " << order.size()
+            << ". Clusters: " << this->_centroids.size()
+            << ". Obj. Value: " << std::fixed << obj_value
+            << ". Time Taken: " << time_elapse << "s" << std::endl;
+        this->_iter_info.push_back(std::make_tuple(order.size(), obj_value, time_elapse));
+        this->_iter_allocations.push_back(allocations);
+    }
+    this->_n_clusters = this->_centroids.size();
+    this->_obj_value = obj_value;
+    this->_dirty.assign(this->_n_clusters, 0);
+    this->_packCentroids();
+
+    this->log("Collect clustering solution...");
+    this->_collectSolution();
+
+    this->_total_time_taken = std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1> > > (std::chrono::high_resolution_clock::now() - start_time).count();
+    *this->log_stream << "Clustering completed. Total time taken: " << this->_total_time_taken << "s.";
+    this->_completed = true;
+    return round;
+}
+
+const std::vector<KMeans::HierarchyNode> & KMeans::getHierarchy()
+{
+    return this->_hierarchy;
+}
+
+int KMeans::runAutoK(const int & max_clusters, const double & penalty, const int & n_threads)
+{
+    int iter = this->run();
+    if (this->_completed == false)
+        return iter;
+
+    const int width = n_threads > 0 ? n_threads : std::max<int>(1, std::thread::hardware_concurrency());
+    ThreadPool pool(this->_dataset && !this->_dataset->mapped() ? 1 : width);
+    const unsigned int seed = this->seed == KMeans::UNASSIGNED_RANDOM_SEED_FLAG ? std::random_device()() : this->seed;
+    const int limit = std::min(max_clusters, this->_n_points - this->_n_removed);
+    std::vector<std::vector<int> > rows;
+    std::vector<std::vector<char> > sides;
+    std::vector<_Centroid *> halves;
+    std::vector<double> scores;
+    std::vector<int> order;
+    int round = 0;
+    while (this->_n_clusters < limit)
+    {
+        *this->log_stream << std::endl;
+        std::chrono::time_point<std::chrono::high_resolution_clock> time = std::chrono::high_resolution_clock::now();
+        const int n_old = this->_n_clusters;
+        rows.assign(n_old, std::vector<int>());
+        for (int row = 0; row < (int)this->_row_cen.size(); ++row)
+        {
+            if (this->_row_cen[row] >= 0)
+                rows[this->_row_cen[row]].push_back(row);
+        }
+
+        // Every cluster is split on trial at once. The score of a split compares the gain of the log-likelihood
+        // of points with the log of the number of points, both per dimension, as BIC does for isotropic Gaussian clusters
+        // of as many dimensions as tokens: n log(parent sum / children sums) - penalty log(n). A penalty of 1 is BIC itself,
+        // which keeps splitting sparse documents, whose tokens are far from independent dimensions.
+        sides.assign(n_old, std::vector<char>());
+        halves.assign(2*n_old, nullptr);
+        scores.assign(n_old, 0);
+        const unsigned int round_seed = seed + round*limit;
+        for (int c = 0; c < n_old; ++c)
+        {
+            if (rows[c].size() < 2)
+                continue;
+            halves[2*c] = new _Centroid(c, Eigen::VectorXd::Zero(this->_dim+1), 1);
+            halves[2*c+1] = new _Centroid(n_old, Eigen::VectorXd::Zero(this->_dim+1), 1);
+            pool.submit([this, c, round_seed, penalty, &rows, &sides, &halves, &scores]() {
+                _Centroid * a = halves[2*c];
+                _Centroid * b = halves[2*c+1];
+                double total_a, total_b;
+                this->_bisectRows(rows[c], a, b, sides[c], total_a, total_b, round_seed + c);
+                const double n = rows[c].size();
+                const double total = total_a + a->sum.norm() + total_b + b->sum.norm() - this->_centroids[c]->sum.norm();
+                const double split = total_a + total_b;
+                scores[c] = total > 0 && split > 0 ? n*std::log(total/split) - penalty*std::log(n) : 0;
+            });
+        }
+        pool.wait();
+
+        // Splits paying off are taken best first, as many as clusters may still be added
+        order.clear();
+        for (int c = 0; c < n_old; ++c)
+        {
+            if (scores[c] > 0)
+                order.push_back(c);
+        }
+        std::stable_sort(order.begin(), order.end(), [&](const int & a, const int & b) { return scores[a] > scores[b]; });
+        order.resize(std::min<std::size_t>(order.size(), limit - n_old));
+        for (auto c : order)
+        {
+            const int nid = this->_centroids.size();
+            _Centroid * a = halves[2*c];
+            _Centroid * b = halves[2*c+1];
+            std::swap(this->_centroids[c], a);
+            b->id = nid;
+            this->_centroids.push_back(b);
+            halves[2*c] = a;
+            halves[2*c+1] = nullptr;
+            for (std::size_t i = 0; i < rows[c].size(); ++i)
+            {
+                if (sides[c][i])
+                    this->_row_cen[rows[c][i]] = nid;
+            }
+        }
+        for (auto h : halves)
+            delete h;
+        round++;
+        double time_elapse = std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1> > > (std::chrono::high_resolution_clock::now() - time).count();
+        *this->log_stream << "  Round: " << round
+            << ". Split Clusters: " << order.size()
+            << ". Clusters: " << this->_centroids.size()
+            << ". Time Taken: " << time_elapse << "s" << std::endl;
+        if (order.empty())
+            break;
+
+        // Halves are the means of their points, so that only the assignment of other points to them is left
+        this->_n_clusters = this->_centroids.size();
+        this->_dirty.assign(this->_n_clusters, 0);
+        iter += this->runIncremental();
+        if (this->_completed == false)
+            break;
+    }
+    return iter;
+}
+
+void KMeans::_bisectCluster(const int & cid, const int & nid, std::vector<int> & rows, std::vector<int> & new_rows,
+                            double & total, double & new_total, const unsigned int & seed)
+{
+    _Centroid * a = this->_centroids[cid];
+    _Centroid * b = this->_centroids[nid];
+    std::vector<char> side;
+    this->_bisectRows(rows, a, b, side, total, new_total, seed);
+    new_rows.clear();
+    std::size_t n = 0;
+    for (std::size_t i = 0; i < rows.size(); ++i)
+    {
+        if (side[i])
+        {
+            new_rows.push_back(rows[i]);
+            this->_row_cen[rows[i]] = nid;
+        }
+        else
+        {
+            rows[n++] = rows[i];
+        }
+    }
+    rows.resize(n);
+}
+
+void KMeans::_bisectRows(const std::vector<int> & rows, _Centroid * a, _Centroid * b, std::vector<char> & side,
+                         double & total_a, double & total_b, const unsigned int & seed) const
+{
+    std::mt19937 sd(seed);
+    std::uniform_int_distribution<int> random_gen(0, rows.size() - 1);
+    const int first = random_gen(sd);
+    int second;
+    while ((second = random_gen(sd)) == first);
+    a->vec.setZero();
+    this->_addRow(rows[first], a->vec);
+    a->l2norm = 1;
+    b->vec.setZero();
+    this->_addRow(rows[second], b->vec);
+    b->l2norm = 1;
+
+    side.assign(rows.size(), 0);
+    int nnz, moved = 1;
+    const int * col;
+    const double * val;
+    double dot_a, dot_b, weight;
+    char s;
+    for (int iter = 0; iter < KMeans::_BISECT_ITERATIONS && moved > 0; ++iter)
+    {
+        moved = 0;
+        a->sum.setZero();
+        b->sum.setZero();
+        a->size = 0;
+        b->size = 0;
+        a->weight = 0;
+        b->weight = 0;
+        for (std::size_t i = 0; i < rows.size(); ++i)
+        {
+            this->_rowEntries(rows[i], nnz, col, val);
+            dot_a = 0;
+            dot_b = 0;
+            for (int k = 0; k < nnz; ++k)
+            {
+                dot_a += val[k]*a->vec[col[k]];
+                dot_b += val[k]*b->vec[col[k]];
+            }
+            s = dot_b/b->l2norm > dot_a/a->l2norm;
+            if (s != side[i])
+            {
+                side[i] = s;
+                moved++;
+            }
+            _Centroid * c = s ? b : a;
+            c->size++;
+            weight = this->_rowWeight(rows[i]);
+            c->weight += weight;
+            for (int k = 0; k < nnz; ++k)
+                c->sum[col[k]] += weight*val[k];
+        }
+        // A side left empty, e.g. by duplicated rows, gets the row that seeded it
+        if (a->size == 0 || b->size == 0)
+        {
+            const int seeded = a->size == 0 ? first : second;
+            side[seeded] = a->size == 0 ? 0 : 1;
+            _Centroid * from = a->size == 0 ? b : a;
+            _Centroid * to = a->size == 0 ? a : b;
+            this->_subtractWeightedRow(rows[seeded], from->sum);
+            this->_addWeightedRow(rows[seeded], to->sum);
+            from->size--;
+            to->size++;
+            weight = this->_rowWeight(rows[seeded]);
+            from->weight -= weight;
+            to->weight += weight;
+        }
+        a->vec = a->sum/a->weight;
+        a->l2norm = a->vec.norm();
+        b->vec = b->sum/b->weight;
+        b->l2norm = b->vec.norm();
+    }
+    total_a = a->weight - a->sum.norm();
+    total_b = b->weight - b->sum.norm();
+}
+
+int KMeans::runCoreset(const int & coreset_size)
+{
+    this->_releaseTrails();
+    this->_expireWindow();
+    if (this->_n_points - this->_n_removed < 1)
+        return 0;
+
+    if (this->_n_clusters > this->_n_points - this->_n_removed)
+        this->_n_clusters = this->_n_points - this->_n_removed;
+
+    std::chrono::time_point<std::chrono::high_resolution_clock> start_time = std::chrono::high_resolution_clock::now();
+    this->_clustering.clear();
+    this->_iter_info.clear();
+    this->_iter_allocations.clear();
+    this->_total_time_taken = 0;
+    this->_completed = false;
+    this->_abandoned = false;
+    if ((int)this->_row_doc.size() < this->_n_points)
+    {
+        this->log("Processing raw data...");
+        this->_vectorizeData();
+    }
+    if (this->_n_removed > 0)
+        this->_compact();
+
+    // A rough clustering: one assignment to random initial centroids
+    this->log("Initialize centroids...");
+    std::fill(this->_row_cen.begin(), this->_row_cen.end(), -1);
+    this->_initializeCentroids();
+    this->_selectKernel();
+    this->_allocateBuffers();
+    this->log("Rough clustering...");
+    std::vector<double> dissim;
+    if (this->assignStep() < 0 || this->_pointDissimilarities(dissim) != 0)
+    {
+        this->log("  Unable to read the dataset file.");
+        return 0;
+    }
+
+    // Sensitivity of a point: its share of the objective value plus its share of its cluster, both by weight.
+    // Points are drawn with probabilities proportional to their sensitivities, and a point drawn weighs its weight
+    // divided by the expected number of times it is drawn, so that the coreset estimates sums over all points.
+    std::vector<double> sensitivity(this->_n_points, 0);
+    double weight, total = 0;
+    for (int row = 0; row < this->_n_points; ++row)
+    {
+        if (this->_row_cen[row] >= 0)
+            total += this->_rowWeight(row)*dissim[row];
+    }
+    for (int row = 0; row < this->_n_points; ++row)
+    {
+        if (this->_row_cen[row] < 0)
+            continue;
+        weight = this->_rowWeight(row);
+        sensitivity[row] = weight/this->_centroids[this->_row_cen[row]]->weight + (total > 0 ? weight*dissim[row]/total : 0);
+    }
+    double sum = 0;
+    for (auto s : sensitivity)
+        sum += s;
+    std::mt19937 sd;
+    if (this->seed == KMeans::UNASSIGNED_RANDOM_SEED_FLAG)
+        sd.seed(std::random_device()());
+    else
+        sd.seed(this->seed);
+    std::discrete_distribution<int> draw(sensitivity.begin(), sensitivity.end());
+    std::unordered_map<int, double> sample;
+    for (int i = 0; i < coreset_size; ++i)
+    {
+        const int row = draw(sd);
+        sample[row] += this->_rowWeight(row)*sum/(sensitivity[row]*coreset_size);
+    }
+    // Drawn rows join the coreset in the order of rows, so that the coreset does not depend on the hash map
+    std::vector<int> rows;
+    rows.reserve(sample.size());
+    for (auto & s : sample)
+        rows.push_back(s.first);
+    std::sort(rows.begin(), rows.end());
+    *this->log_stream << "Build a coreset of " << rows.size() << " data objects drawn " << coreset_size << " times..." << std::endl;
+
+    KMeans coreset(this->_n_clusters);
+    coreset.setLogStream(this->log_stream);
+    coreset.setRandomSeed(this->seed);
+    coreset.setCentroidUpdateThreshold(this->_update_threshold);
+    coreset.setTolerance(this->_tolerance);
+    coreset.setAssignKernel(this->_requested_kernel);
+    coreset._point_block_size = this->_point_block_size;
+    coreset._tile_block_size = this->_tile_block_size;
+    int nnz, id;
+    const int * col;
+    const double * val;
+    for (auto row : rows)
+    {
+        this->_rowEntries(row, nnz, col, val);
+        id = this->_ids[this->_dataset ? row : this->_row_doc[row]];
+        coreset.addDataPoint(id, col, val, nnz);
+        coreset.setPointWeight(id, sample[row]);
+    }
+    int iter = coreset.run();
+    *this->log_stream << std::endl;
+
+    // A single pass assigns all points to the centroids of the coreset
+    std::chrono::time_point<std::chrono::high_resolution_clock> time = std::chrono::high_resolution_clock::now();
+    this->log("Assign all data objects...");
+    // The coreset has fewer clusters if fewer distinct data objects were drawn. The other centroids
+    // start from random data objects left out of the coreset, as initial centroids do.
+    const int n_coreset = coreset.getNumberOfClusters();
+    std::uniform_int_distribution<int> random_gen(0, this->_n_points - 1);
+    std::set<int> reseeded;
+    int row;
+    for (int c = 0; c < this->_n_clusters; ++c)
+    {
+        _Centroid * cen = this->_centroids[c];
+        cen->vec.setZero();
+        if (c < n_coreset)
+        {
+            cen->vec.head(coreset._centroids[c]->vec.size()) = coreset._centroids[c]->vec;
+            cen->l2norm = coreset._centroids[c]->l2norm;
+        }
+        else
+        {
+            while (sample.count(row = random_gen(sd)) > 0 || !reseeded.insert(row).second);
+            this->_addRow(row, cen->vec);
+            cen->l2norm = 1;
+        }
+        cen->sum.setZero();
+        cen->size = 0;
+        cen->weight = 0;
+    }
+    this->_dirty.assign(this->_n_clusters, 0);
+    this->_packCentroids();
+    std::fill(this->_row_cen.begin(), this->_row_cen.end(), -1);
+    if (this->assignStep() < 0)
+    {
+        this->log("  Unable to read the dataset file.");
+        return 0;
+    }
+    double time_elapse = std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1> > > (std::chrono::high_resolution_clock::now() - time).count();
+    *this->log_stream << "  Obj. Value: " << std::fixed << this->_obj_value << ". Time Taken: " << time_elapse << "s" << std::endl;
+    this->_iter_info = coreset._iter_info;
+    this->_iter_allocations = coreset._iter_allocations;
+    this->_iter_info.push_back(std::make_tuple(0, this->_obj_value, time_elapse));
+    this->_iter_allocations.push_back(0);
+
+    this->log("Collect clustering solution...");
+    this->_collectSolution();
+
+    this->_total_time_taken = std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1> > > (std::chrono::high_resolution_clock::now() - start_time).count();
+    *this->log_stream << "Clustering completed. Total time taken: " << this->_total_time_taken << "s.";
+    this->_completed = true;
+    return iter;
+}
+
+int KMeans::runTrails(const std::vector<int> & seeds)
+{
+    this->_releaseTrails();
+    this->_expireWindow();
+    if (seeds.empty() || this->_n_points - this->_n_removed < 1)
+        return 0;
+
+    if (this->_n_clusters > this->_n_points - this->_n_removed)
+        this->_n_clusters = this->_n_points - this->_n_removed;
+
+    std::chrono::time_point<std::chrono::high_resolution_clock> start_time = std::chrono::high_resolution_clock::now();
+    std::chrono::time_point<std::chrono::high_resolution_clock> time;
+    this->_total_time_taken = 0;
+    this->_completed = false;
+    this->_abandoned = false;
+    if ((int)this->_row_doc.size() < this->_n_points)
+    {
+        this->log("Processing raw data...");
+        this->_vectorizeData();
+    }
+    if (this->_n_removed > 0)
+        this->_compact();
+
+    // Each trail is initialized in the members, as by run(), and then swapped into its slot
+    this->log("Initialize centroids...");
+    this->_trails.resize(seeds.size());
+    for (std::size_t t = 0; t < seeds.size(); ++t)
+    {
+        this->seed = seeds[t];
+        this->_initializeCentroids();
+        this->_row_cen.assign(this->_n_points, -1);
+        this->_changed.assign((this->_n_clusters+63)/64, 0);
+        this->_obj_value = 0;
+        this->_iter_info.clear();
+        this->_iter_allocations.clear();
+        this->_clustering.clear();
+        this->_point_clustering.clear();
+        this->_trails[t].active = true;
+        this->_swapTrail(this->_trails[t]);
+    }
+    this->_allocateBuffers();
+    // Points are scored in blocks of a quarter of L2, so that a block stays in cache while it is scored
+    // against the centroids of each trail in turn
+    const std::size_t point_nnz = this->_dataset ? this->_dataset->header().nnz/std::max<std::int64_t>(1, this->_dataset->header().n_points)
+                                                 : this->_col.size()/this->_n_points;
+    this->_point_block = this->_point_block_size > 0 ? this->_point_block_size
+                                                     : std::max<std::size_t>(16, KMeans::_cacheSize(2)/4/(std::max<std::size_t>(1, point_nnz)*(sizeof(int) + sizeof(double))));
+    if ((int)this->_closest.size() < this->_point_block)
+    {
+        this->_closest.resize(this->_point_block);
+        this->_min_dissim.resize(this->_point_block);
+    }
+
+    *this->log_stream << "Begin clustering " << seeds.size() << " trails in lockstep..." << std::endl;
+    std::vector<_Trail *> active;
+    int iter = 0;
+    int updated_cens;
+    bool failed, converged;
+    double pass_time, time_elapse, last_obj_value;
+    std::size_t allocations;
+    do
+    {
+        active.clear();
+        for (auto & trail : this->_trails)
+        {
+            if (trail.active)
+                active.push_back(&trail);
+        }
+        time = std::chrono::high_resolution_clock::now();
+        allocations = KMeans::getAllocationCount();
+        iter++;
+        failed = this->_assignTrails(active) != 0;
+        pass_time = std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1> > > (std::chrono::high_resolution_clock::now() - time).count();
+        *this->log_stream << "  Iteration: " << iter
+            << ". Trails: " << active.size()
+            << ". Pass Time: " << std::fixed << pass_time << "s";
+        if (this->_dataset && !this->_dataset->mapped())
+            *this->log_stream << ". Read: " << this->_dataset->readTime() << "s"
+                << ". Waited for Reads: " << this->_dataset->waitTime() << "s";
+        *this->log_stream << std::endl;
+
+        // Centroids are updated trail by trail as run() updates them, sharing the time of the pass
+        for (auto trail : active)
+        {
+            time = std::chrono::high_resolution_clock::now();
+            this->_swapTrail(*trail);
+            if (!this->_dataset)
+                this->_groupMembers();
+            if (failed)
+                updated_cens = 0;
+            else if (trail->moved < this->_update_threshold)
+                updated_cens = trail->moved;
+            else
+                updated_cens = this->_updateCentroids();
+            time_elapse = pass_time/active.size() + std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1> > > (std::chrono::high_resolution_clock::now() - time).count();
+            *this->log_stream << "    Trail: " << trail - this->_trails.data() + 1
+                << ". Updated Centroids: " << updated_cens
+                << ". Obj. Value: " << this->_obj_value << std::endl;
+            last_obj_value = this->_iter_info.empty() ? std::numeric_limits<double>::infinity() : std::get<1>(this->_iter_info.back());
+            this->_iter_info.push_back(std::make_tuple(updated_cens, this->_obj_value, time_elapse));
+            converged = this->_tolerance > 0 && last_obj_value - this->_obj_value < this->_tolerance*this->_obj_value;
+            trail->active = updated_cens > this->_update_threshold && !converged;
+            this->_swapTrail(*trail);
+        }
+        allocations = KMeans::getAllocationCount() - allocations;
+        for (auto trail : active)
+            trail->iter_allocations.push_back(allocations);
+    } while (std::any_of(this->_trails.begin(), this->_trails.end(), [](const _Trail & trail) { return trail.active; }));
+
+    this->log("Collect clustering solutions...");
+    int best = 0;
+    for (std::size_t t = 0; t < this->_trails.size(); ++t)
+    {
+        this->_swapTrail(this->_trails[t]);
+        this->_collectSolution();
+        this->_swapTrail(this->_trails[t]);
+        if (this->_trails[t].obj_value < this->_trails[best].obj_value)
+            best = t;
+    }
+    this->selectTrail(best);
+
+    this->_total_time_taken = std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1> > > (std::chrono::high_resolution_clock::now() - start_time).count();
+    *this->log_stream << "Clustering completed. Total time taken: " << this->_total_time_taken << "s.";
+    this->_completed = true;
+    return iter;
+}
+
+int KMeans::getNumberOfTrails() const
+{
+    return this->_trails.size();
+}
+
+void KMeans::selectTrail(const int & trail)
+{
+    if (trail < 0 || trail >= (int)this->_trails.size() || trail == this->_selected_trail)
+        return;
+    if (this->_selected_trail != -1)
+        this->_swapTrail(this->_trails[this->_selected_trail]);
+    this->_swapTrail(this->_trails[trail]);
+    this->_selected_trail = trail;
+}
+
+void KMeans::_swapTrail(_Trail & trail)
+{
+    std::swap(this->seed, trail.seed);
+    this->_centroids.swap(trail.centroids);
+    this->_row_cen.swap(trail.row_cen);
+    // The tiles move with the storage of their vector
+    this->_centroid_tiles.swap(trail.centroid_tiles);
+    std::swap(this->_tiles, trail.tiles);
+    this->_changed.swap(trail.changed);
+    this->_dirty.swap(trail.dirty);
+    std::swap(this->_obj_value, trail.obj_value);
+    this->_iter_info.swap(trail.iter_info);
+    this->_iter_allocations.swap(trail.iter_allocations);
+    this->_clustering.swap(trail.clustering);
+    this->_point_clustering.swap(trail.point_clustering);
+}
+
+void KMeans::_releaseTrails()
+{
+    // The selected trail stays as the current clustering, and its slot holds no centroids
+    for (auto & trail : this->_trails)
+    {
+        for (auto c : trail.centroids)
+            delete c;
+    }
+    this->_trails.clear();
+    this->_selected_trail = -1;
+}
+
+int KMeans::_iterate(const int & done)
+{
+    int iter = done;
+    int updated_cens = 0;
+    std::chrono::time_point<std::chrono::high_resolution_clock> time;
+    std::chrono::time_point<std::chrono::high_resolution_clock> start_time = std::chrono::high_resolution_clock::now();
+    std::chrono::time_point<std::chrono::high_resolution_clock> last_checkpoint = start_time;
+    int last_checkpoint_iter = done;
+    double time_elapse;
+    double last_obj_value = this->_iter_info.empty() ? std::numeric_limits<double>::infinity() : std::get<1>(this->_iter_info.back());
+    bool converged = false;
+    std::size_t allocations;
+    this->_abandoned = false;
+    do
+    {
+        time = std::chrono::high_resolution_clock::now();
+        allocations = KMeans::getAllocationCount();
+        iter++;
+        if (this->_reorder_interval > 0 && iter % this->_reorder_interval == 0 && !this->_dataset)
+            this->_reorderPoints();
+        updated_cens = this->_assignPoints();
+        allocations = KMeans::getAllocationCount() - allocations;
+        time_elapse = std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1> > > (std::chrono::high_resolution_clock::now() - time).count();
+        *this->log_stream << "  Iteration: "  << iter
+            << ". Updated Centroids: " << updated_cens
+            << ". Obj. Value: " << std::fixed << this->_obj_value
+            << ". Time Taken: " << time_elapse << "s"
+            << ". Allocations: " << allocations;
+        if (this->_dataset && !this->_dataset->mapped())
+            *this->log_stream << ". Read: " << this->_dataset->readTime() << "s"
+                << ". Waited for Reads: " << this->_dataset->waitTime() << "s"
+                << ". Compute: " << time_elapse - this->_dataset->waitTime() << "s";
+        *this->log_stream << std::endl;
+        this->_iter_info.push_back(std::make_tuple(updated_cens, this->_obj_value, time_elapse));
+        this->_iter_allocations.push_back(allocations);
+        converged = this->_tolerance > 0 && last_obj_value - this->_obj_value < this->_tolerance*this->_obj_value;
+        last_obj_value = this->_obj_value;
+        if (!this->_race_bounds.empty() && updated_cens > this->_update_threshold && !converged
+            && this->_obj_value > this->_race_bounds[std::min<std::size_t>(iter, this->_race_bounds.size()) - 1])
+        {
+            this->_abandoned = true;
+            this->log("  Abandoned: the objective value is not expected to beat the best one any more.");
+        }
+
+        if (this->_checkpoint_writer && updated_cens > this->_update_threshold && !converged && !this->_abandoned
+            && ((this->_checkpoint_iterations > 0 && iter - last_checkpoint_iter >= this->_checkpoint_iterations)
+                || (this->_checkpoint_seconds > 0 && std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1> > > (std::chrono::high_resolution_clock::now() - last_checkpoint).count() >= this->_checkpoint_seconds)))
+        {
+            this->_writeCheckpoint(iter, this->_total_time_taken + std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1> > > (std::chrono::high_resolution_clock::now() - start_time).count());
+            last_checkpoint = std::chrono::high_resolution_clock::now();
+            last_checkpoint_iter = iter;
+        }
+    } while (updated_cens > this->_update_threshold && !converged && !this->_abandoned);
+    return iter;
+}
+
+void KMeans::_collectSolution()
+{
+    this->_clustering.assign(this->_n_clusters, std::deque<int>());
+    this->_point_clustering.resize(this->_n_points);
+    for (int i = 0; i < this->_n_points; ++i)
+    {
+        this->_point_clustering[i] = this->_removed[i] ? -1 : this->_row_cen[this->_doc_row[i]];
+        if (this->_point_clustering[i] != -1)
+            this->_clustering[this->_point_clustering[i]].push_back(this->_ids[i]);
+    }
+}
+
+void KMeans::prepareSteps()
+{
+    this->_releaseTrails();
+    this->_clustering.clear();
+    this->_iter_info.clear();
+    this->_iter_allocations.clear();
+    this->_completed = false;
+    if ((int)this->_row_doc.size() < this->_n_points)
+        this->_vectorizeData();
+    if (this->_n_removed > 0)
+        this->_compact();
+    std::fill(this->_row_cen.begin(), this->_row_cen.end(), -1);
+    for (auto c : this->_centroids)
+        delete c;
+    this->_centroids.clear();
+    for (int i = 0; i < this->_n_clusters; ++i)
+        this->_centroids.push_back(new _Centroid(i, Eigen::VectorXd::Zero(this->_dim+1), 1));
+    this->_dirty.assign(this->_n_clusters, 0);
+    this->_packCentroids();
+    this->_selectKernel();
+    this->_allocateBuffers();
+}
+
+void KMeans::setCentroid(const int & cid, const int * dims, const double * weights, const int & nnz, const double & l2norm)
+{
+    _Centroid * c = this->_centroids[cid];
+    c->vec.setZero();
+    for (int k = 0; k < nnz; ++k)
+    {
+        if (dims[k] >= 0 && dims[k] <= this->_dim)
+            c->vec[dims[k]] = weights[k];
+    }
+    c->l2norm = l2norm;
+    this->_packCentroid(cid);
+}
+
+bool KMeans::isClusterChanged(const int & cid) const
+{
+    return (this->_changed[cid/64] & (std::uint64_t(1) << (cid%64))) != 0;
+}
+
+int KMeans::getClusterSize(const int & cid) const
+{
+    return this->_centroids[cid]->size;
+}
+
+const Eigen::VectorXd & KMeans::getRunningSum(const int & cid) const
+{
+    return this->_centroids[cid]->sum;
+}
+
+void KMeans::clearRunningSum(const int & cid)
+{
+    this->_centroids[cid]->sum.setZero();
+}
+
+int KMeans::movePoint(const int & donor, const int & cid)
+{
+    // Same choice as reseeding: the last row of the donor
+    int row = this->_row_cen.size();
+    while (--row >= 0 && this->_row_cen[row] != donor);
+    if (row < 0)
+        return -1;
+    this->_row_cen[row] = cid;
+    this->_centroids[donor]->size--;
+    this->_centroids[cid]->size++;
+    this->_centroids[donor]->weight -= this->_rowWeight(row);
+    this->_centroids[cid]->weight += this->_rowWeight(row);
+    return this->_row_doc[row];
+}
+
+int KMeans::getPointVector(const int & index, int & nnz, const int * & dims, const double * & values) const
+{
+    if (index < 0 || index >= (int)this->_doc_row.size() || this->_removed[index])
+        return 1;
+    this->_rowEntries(this->_doc_row[index], nnz, dims, values);
+    return 0;
+}
+
+void KMeans::finishSteps()
+{
+    this->_collectSolution();
+    this->_completed = true;
+}
+
+void KMeans::_vectorizeData()
+{
+    const int first = this->_row_doc.size();
+    std::size_t nnz = 0;
+    for (int p = first; p < this->_n_points; ++p)
+        nnz += this->_pts[p]->size;
+    if (first == 0)
+        this->_row_ptr.assign(1, 0);
+    this->_row_ptr.reserve(this->_n_points+1);
+    this->_col.reserve(this->_col.size() + nnz);
+    this->_val.reserve(this->_val.size() + nnz);
+    this->_row_doc.reserve(this->_n_points);
+    this->_row_cen.reserve(this->_n_points);
+    this->_doc_row.reserve(this->_n_points);
+
+    // New points are appended as rows in the order of points
+    std::vector<std::pair<int, double> > entries;
+    for (int p = first; p < this->_n_points; ++p)
+    {
+        const Point * pt = this->_pts[p];
+        KMeans::_normalize(pt->attribute, pt->value, pt->size, entries);
+        for (auto e : entries)
+        {
+            this->_col.push_back(e.first);
+            this->_val.push_back(e.second);
+        }
+        this->_row_ptr.push_back(this->_col.size());
+        this->_doc_row.push_back(this->_row_doc.size());
+        this->_row_doc.push_back(p);
+        this->_row_cen.push_back(this->_removed[p] ? KMeans::_REMOVED : -1);
+    }
+
+    if (this->_release_raw_data)
+    {
+        *this->log_stream << "  Release " << this->_arena.capacity()/1024 << "KB of raw data" << std::endl;
+        std::fill(this->_pts.begin(), this->_pts.end(), nullptr);
+        this->_arena.release();
+    }
+}
+
+void KMeans::_normalize(const int * attribute, const double * value, const int & size, std::vector<std::pair<int, double> > & entries)
+{
+    entries.clear();
+    for (int i = 0; i < size; ++i)
+        entries.push_back(std::make_pair(attribute[i], value[i]));
+    std::sort(entries.begin(), entries.end());
+    double norm = 0;
+    for (auto e : entries)
+        norm += e.second*e.second;
+    norm = std::sqrt(norm);
+    for (auto & e : entries)
+        e.second /= norm;
+}
+
+std::uint64_t KMeans::_hashEntries(const std::vector<std::pair<int, double> > & entries)
+{
+    // FNV-1a
+    std::uint64_t hash = 14695981039346656037ULL;
+    for (auto & e : entries)
+    {
+        const unsigned char * bytes = reinterpret_cast<const unsigned char *>(&e.first);
+        for (std::size_t b = 0; b < sizeof(int); ++b)
+            hash = (hash ^ bytes[b])*1099511628211ULL;
+        bytes = reinterpret_cast<const unsigned char *>(&e.second);
+        for (std::size_t b = 0; b < sizeof(double); ++b)
+            hash = (hash ^ bytes[b])*1099511628211ULL;
+    }
+    return hash;
+}
+
+void KMeans::_pointEntries(const int & p, std::vector<std::pair<int, double> > & entries) const
+{
+    // From the row of the point if it was vectorized, or else from its raw data
+    if (p < (int)this->_row_doc.size())
+    {
+        int nnz;
+        const int * col;
+        const double * val;
+        this->_rowEntries(this->_doc_row[p], nnz, col, val);
+        entries.clear();
+        for (int k = 0; k < nnz; ++k)
+            entries.push_back(std::make_pair(col[k], val[k]));
+    }
+    else
+    {
+        KMeans::_normalize(this->_pts[p]->attribute, this->_pts[p]->value, this->_pts[p]->size, entries);
+    }
+}
+
+void KMeans::_eraseCollapsed(const std::size_t & i)
+{
+    // Later collapsed data objects move up by one, keeping the order they were added
+    this->_collapsed_index.erase(this->_collapsed[i].first);
+    this->_collapsed.erase(this->_collapsed.begin() + i);
+    for (std::size_t k = i; k < this->_collapsed.size(); ++k)
+        this->_collapsed_index[this->_collapsed[k].first] = k;
+}
+
+void KMeans::_reorderPoints()
+{
+    // Stable counting sort of the rows by their clusters; unassigned rows go last.
+    // The permuted copy is built in buffers that are kept for the next reordering.
+    std::fill(this->_member_offset.begin(), this->_member_offset.end(), 0);
+    for (auto c : this->_row_cen)
+        this->_member_offset[(c < 0 ? this->_n_clusters : c) + 1]++;
+    for (int c = 0; c <= this->_n_clusters; ++c)
+        this->_member_offset[c+1] += this->_member_offset[c];
+    this->_members.resize(this->_n_points);     // new row of each row
+    for (int r = 0; r < this->_n_points; ++r)
+    {
+        int c = this->_row_cen[r];
+        this->_members[r] = this->_member_offset[c < 0 ? this->_n_clusters : c]++;
+    }
+    this->_permuteRows(this->_members);
+}
+
+void KMeans::_permuteRows(const std::vector<int> & new_row)
+{
+    this->_row_ptr_buf.resize(this->_n_points+1);
+    this->_col_buf.resize(this->_col.size());
+    this->_val_buf.resize(this->_val.size());
+    this->_row_doc_buf.resize(this->_n_points);
+    this->_row_cen_buf.resize(this->_n_points);
+    for (int r = 0; r < this->_n_points; ++r)
+        this->_row_ptr_buf[new_row[r]+1] = this->_row_ptr[r+1] - this->_row_ptr[r];
+    this->_row_ptr_buf[0] = 0;
+    for (int r = 0; r < this->_n_points; ++r)
+        this->_row_ptr_buf[r+1] += this->_row_ptr_buf[r];
+    for (int r = 0; r < this->_n_points; ++r)
+    {
+        std::copy(this->_col.begin() + this->_row_ptr[r], this->_col.begin() + this->_row_ptr[r+1], this->_col_buf.begin() + this->_row_ptr_buf[new_row[r]]);
+        std::copy(this->_val.begin() + this->_row_ptr[r], this->_val.begin() + this->_row_ptr[r+1], this->_val_buf.begin() + this->_row_ptr_buf[new_row[r]]);
+        this->_row_doc_buf[new_row[r]] = this->_row_doc[r];
+        this->_row_cen_buf[new_row[r]] = this->_row_cen[r];
+    }
+    for (auto & r : this->_doc_row)
+        r = new_row[r];
+    this->_row_ptr.swap(this->_row_ptr_buf);
+    this->_col.swap(this->_col_buf);
+    this->_val.swap(this->_val_buf);
+    this->_row_doc.swap(this->_row_doc_buf);
+    this->_row_cen.swap(this->_row_cen_buf);
+}
+
+std::deque<int> KMeans::_initializeCentroids()
+{
+    std::deque<int> inital_centroids;
+    std::mt19937 sd;
+    if (this->seed == KMeans::UNASSIGNED_RANDOM_SEED_FLAG)
+        sd.seed(std::random_device()());
+    else
+        sd.seed(this->seed);
+    std::uniform_int_distribution<int> random_gen(0, this->_n_points);
+    int rand_num, row;
+    std::set<int> random_num_generated;
+    // Centroids are kept across runs with the same number of clusters and dimension
+    if ((int)this->_centroids.size() != this->_n_clusters || this->_centroids[0]->vec.size() != this->_dim+1)
+    {
+        for (auto c : this->_centroids)
+            delete c;
+        this->_centroids.clear();
+        for (int i = 0; i < this->_n_clusters; ++i)
+            this->_centroids.push_back(new _Centroid(i, Eigen::VectorXd::Zero(this->_dim+1), 1));
+    }
+    for (auto c : this->_centroids)
+    {
+        c->sum.setZero();
+        c->size = 0;
+        c->weight = 0;
+    }
+    this->_dirty.assign(this->_n_clusters, 0);
+    int seeded = 0;
+    if (this->_warm_start && !this->_model.norms.empty())
+        seeded = this->_warmStartCentroids();
+    for (int i = this->_n_clusters; --i >= seeded;)
+    {
+        rand_num = random_gen(sd);
+        // Points are picked by their indices, regardless of the current order of rows
+        if (rand_num < this->_n_points && !this->_removed[rand_num] && random_num_generated.find(rand_num) == random_num_generated.end())
+        {
+            random_num_generated.insert(rand_num);
+            row = this->_doc_row[rand_num];
+            this->_centroids[i]->vec.setZero();
+            this->_addRow(row, this->_centroids[i]->vec);
+            this->_centroids[i]->l2norm = 1;
+            inital_centroids.push_front(this->_ids[rand_num]);
+            continue;
+        }
+        ++i;
+    }
+    this->_packCentroids();
+    return inital_centroids;
+}
+
+int KMeans::_warmStartCentroids()
+{
+    const Model & model = this->_model;
+    const int n_features = model.features.size();
+    const int n_model = model.norms.size();
+    const int n = std::min(n_model, this->_n_clusters);
+
+    // The largest clusters of the model, in the order of their ids
+    std::vector<int> order(n_model);
+    for (int c = 0; c < n_model; ++c)
+        order[c] = c;
+    std::stable_sort(order.begin(), order.end(), [&](const int & a, const int & b) { return model.sizes[a] > model.sizes[b]; });
+    std::sort(order.begin(), order.begin() + n);
+
+    int seeded = 0;
+    int dropped = 0;
+    for (int f = 0; f < n_features; ++f)
+        if (model.features[f] > this->_dim)
+            dropped++;
+    for (int k = 0; k < n; ++k)
+    {
+        _Centroid * cen = this->_centroids[seeded];
+        cen->vec.setZero();
+        for (int f = 0; f < n_features; ++f)
+        {
+            if (model.features[f] <= this->_dim)
+                cen->vec[model.features[f]] = model.weights[(std::size_t)order[k]*n_features + f];
+        }
+        cen->l2norm = cen->vec.norm();
+        if (cen->l2norm > 0)        // Centroids left without any feature of the data are seeded randomly
+            seeded++;
+    }
+    *this->log_stream << "  Warm start: " << seeded << " centroids from the model, "
+                      << this->_n_clusters - seeded << " from random points. "
+                      << dropped << " features of the model are not in the data." << std::endl;
+    return seeded;
+}
+
+void KMeans::_packCentroids()
+{
+    int n_tiles = (this->_n_clusters + KMeans::CENTROID_TILE - 1)/KMeans::CENTROID_TILE;
+    // 7 extra elements so that the tiles can start at a cache line boundary
+    this->_centroid_tiles.assign((std::size_t)n_tiles*(this->_dim+1)*KMeans::CENTROID_TILE + 7, 0);
+    this->_tiles = this->_centroid_tiles.data();
+    while (reinterpret_cast<std::uintptr_t>(this->_tiles) % 64 != 0)
+        ++this->_tiles;
+    this->_similarities.assign(n_tiles*KMeans::CENTROID_TILE, 0);
+    for (auto c : this->_centroids)
+        this->_packCentroid(c->id);
+}
+
+void KMeans::_packCentroid(const int & cid)
+{
+    const _Centroid * c = this->_centroids[cid];
+    double * tile = this->_tiles + (std::size_t)(cid/KMeans::CENTROID_TILE)*(this->_dim+1)*KMeans::CENTROID_TILE + cid%KMeans::CENTROID_TILE;
+    for (int d = 0; d <= this->_dim; ++d)
+        tile[d*KMeans::CENTROID_TILE] = c->vec[d]/c->l2norm;
+}
+
+void KMeans::scoreTile(const int * index, const double * value, const int & nnz, const double * tile, double * similarity)
+{
+    // Fixed-size accumulators so that the compiler keeps them in registers
+    double acc[KMeans::CENTROID_TILE] = {0};
+    const double * row;
+    for (int i = 0; i < nnz; ++i)
+    {
+        row = tile + index[i]*KMeans::CENTROID_TILE;
+        for (int w = 0; w < KMeans::CENTROID_TILE; ++w)
+            acc[w] += value[i]*row[w];
+    }
+    for (int w = 0; w < KMeans::CENTROID_TILE; ++w)
+        similarity[w] = acc[w];
+}
+
+void KMeans::_scorePairwise()
+{
+    double dissim;
+    for (int i = 0; i < this->_n_points; ++i)
+    {
+        this->_min_dissim[i] = 3;
+        for (auto c : this->_centroids)
+        {
+            dissim = 1 - this->_dotRow(i, c->vec)/c->l2norm;
+
+            if (dissim < this->_min_dissim[i])
+            {
+                this->_min_dissim[i] = dissim;
+                this->_closest[i] = c->id;
+            }
+            if (dissim <= 3e-16)
+                break;
+        }
+    }
+}
+
+void KMeans::_scoreTiled()
+{
+    const int n_tiles = (this->_n_clusters + KMeans::CENTROID_TILE - 1)/KMeans::CENTROID_TILE;
+    const std::size_t tile_size = (std::size_t)(this->_dim+1)*KMeans::CENTROID_TILE;
+    double * sims = this->_similarities.data();
+    double dissim;
+    for (int i = 0; i < this->_n_points; ++i)
+    {
+        // The point's indices and values are loaded once per tile instead of once per centroid
+        for (int t = 0; t < n_tiles; ++t)
+            KMeans::scoreTile(&this->_col[this->_row_ptr[i]], &this->_val[this->_row_ptr[i]], this->_row_ptr[i+1] - this->_row_ptr[i],
+                               this->_tiles + t*tile_size, sims + t*KMeans::CENTROID_TILE);
+        this->_min_dissim[i] = 3;
+        for (int c = 0; c < this->_n_clusters; ++c)
+        {
+            dissim = 1 - sims[c];
+            if (dissim < this->_min_dissim[i])
+            {
+                this->_min_dissim[i] = dissim;
+                this->_closest[i] = c;
+            }
+        }
+    }
+}
+
+void KMeans::_scoreBlocked()
+{
+    const int n_tiles = (this->_n_clusters + KMeans::CENTROID_TILE - 1)/KMeans::CENTROID_TILE;
+    const std::size_t tile_size = (std::size_t)(this->_dim+1)*KMeans::CENTROID_TILE;
+    double * sims = this->_similarities.data();
+    double dissim;
+    int last_tile, n_cens;
+
+    std::fill(this->_min_dissim.begin(), this->_min_dissim.end(), 3);
+
+    // A block of points is scored against a block of centroid tiles that stays in cache,
+    // then against the next block of centroid tiles, while the closest centroid of each point
+    // is kept across the centroid blocks.
+    for (int pb = 0; pb < this->_n_points; pb += this->_point_block)
+    {
+        int pb_end = std::min(pb + this->_point_block, this->_n_points);
+        for (int tb = 0; tb < n_tiles; tb += this->_tile_block)
+        {
+            last_tile = std::min(tb + this->_tile_block, n_tiles);
+            n_cens = std::min(last_tile*KMeans::CENTROID_TILE, this->_n_clusters);
+            for (int i = pb; i < pb_end; ++i)
+            {
+                for (int t = tb; t < last_tile; ++t)
+                    KMeans::scoreTile(&this->_col[this->_row_ptr[i]], &this->_val[this->_row_ptr[i]], this->_row_ptr[i+1] - this->_row_ptr[i],
+                                       this->_tiles + t*tile_size, sims + t*KMeans::CENTROID_TILE);
+                for (int c = tb*KMeans::CENTROID_TILE; c < n_cens; ++c)
+                {
+                    dissim = 1 - sims[c];
+                    if (dissim < this->_min_dissim[i])
+                    {
+                        this->_min_dissim[i] = dissim;
+                        this->_closest[i] = c;
+                    }
+                }
+            }
+        }
+    }
+}
+
+void KMeans::_allocateBuffers()
+{
+    // Sizes only change when data points or the number of clusters change,
+    // so that these buffers are allocated once and reused by every iteration and every run
+    // Streamed points are scored and moved one block at a time, without buffers per point
+    const int n_rows = this->_dataset ? 0 : this->_n_points;
+    this->_closest.resize(n_rows);
+    this->_min_dissim.resize(n_rows);
+    this->_members.resize(n_rows);
+    this->_member_offset.resize(this->_n_clusters+2);   // one more slot for unassigned rows when reordering
+    this->_member_end.resize(this->_n_clusters);
+    this->_changed.resize((this->_n_clusters+63)/64);
+    this->_empty_clusters.reserve(this->_n_clusters);
+    this->_nonempty_clusters.reserve(2*this->_n_clusters);
+    if (this->_reorder_interval > 0 && !this->_dataset)
+    {
+        this->_row_ptr_buf.resize(this->_n_points+1);
+        this->_col_buf.resize(this->_col.size());
+        this->_val_buf.resize(this->_val.size());
+        this->_row_doc_buf.resize(this->_n_points);
+        this->_row_cen_buf.resize(this->_n_points);
+    }
+    this->_iter_info.reserve(256);
+    this->_iter_allocations.reserve(256);
+}
+
+void KMeans::_selectKernel()
+{
+    // Cache sizes are detected once
+    static const std::size_t l2_size = KMeans::_cacheSize(2);
+
+    // Streamed points are scored by the tiled kernel as their blocks arrive
+    if (this->_dataset)
+        this->_kernel = KMeans::TILED_KERNEL;
+    else if (this->_requested_kernel != KMeans::AUTO_KERNEL)
+        this->_kernel = this->_requested_kernel;
+    else
+        this->_kernel = this->_centroid_tiles.size()*sizeof(double) > l2_size/2 ? KMeans::BLOCKED_KERNEL : KMeans::TILED_KERNEL;
+    if (this->_kernel != KMeans::BLOCKED_KERNEL)
+        return;
+
+    // Half of L2 holds a block of centroid tiles, a quarter of L2 holds a block of points
+    const std::size_t tile_bytes = (std::size_t)(this->_dim+1)*KMeans::CENTROID_TILE*sizeof(double);
+    const std::size_t point_bytes = std::max<std::size_t>(1, this->_n_points > 0 ? this->_col.size()/this->_n_points : 0)*(sizeof(int) + sizeof(double));
+    this->_tile_block = this->_tile_block_size > 0 ? this->_tile_block_size : std::max<std::size_t>(1, l2_size/2/tile_bytes);
+    this->_point_block = this->_point_block_size > 0 ? this->_point_block_size : std::max<std::size_t>(16, l2_size/4/point_bytes);
+    *this->log_stream << "  Cache-blocked assignment: " << this->_point_block << " points x "
+        << this->_tile_block*KMeans::CENTROID_TILE << " centroids per block (L2: " << l2_size/1024 << "KB)" << std::endl;
+}
+
+std::size_t KMeans::_cacheSize(const int & level)
+{
+    long size = 0;
+#if defined(__APPLE__)
+    std::size_t len = sizeof(size);
+    if (sysctlbyname(level == 1 ? "hw.l1dcachesize" : "hw.l2cachesize", &size, &len, nullptr, 0) != 0)
+        size = 0;
+#elif defined(__linux__)
+# if defined(_SC_LEVEL1_DCACHE_SIZE)
+    size = sysconf(level == 1 ? _SC_LEVEL1_DCACHE_SIZE : _SC_LEVEL2_CACHE_SIZE);
+# endif
+    // sysconf reports 0 on some platforms; fall back to sysfs
+    for (int i = 0; size <= 0 && i < 8; ++i)
+    {
+        std::string dir = "/sys/devices/system/cpu/cpu0/cache/index" + std::to_string(i) + "/";
+        std::ifstream level_file(dir + "level"), type_file(dir + "type"), size_file(dir + "size");
+        int lv;
+        std::string type, sz;
+        if (!(level_file >> lv) || !(type_file >> type) || !(size_file >> sz))
+            break;
+        if (lv != level || type == "Instruction")
+            continue;
+        size = std::atol(sz.c_str());
+        if (sz.back() == 'K')
+            size *= 1024;
+        else if (sz.back() == 'M')
+            size *= 1024*1024;
+    }
+#endif
+    if (size <= 0)
+        size = level == 1 ? 32*1024 : 256*1024;
+    return size;
+}
+
+void KMeans::_rowEntries(const int & row, int & nnz, const int * & col, const double * & val) const
+{
+    if (this->_dataset)
+    {
+        // Only a few rows are read this way, e.g. for initial centroids and reseeding
+        if (this->_dataset->readRecord(row, nnz, col, val) != 0)
+        {
+            *this->log_stream << "  Unable to read the data object " << this->_ids[row] << " from the dataset file" << std::endl;
+            nnz = 0;
+        }
+        return;
+    }
+    nnz = this->_row_ptr[row+1] - this->_row_ptr[row];
+    col = this->_col.data() + this->_row_ptr[row];
+    val = this->_val.data() + this->_row_ptr[row];
+}
+
+double KMeans::_dotRow(const int & row, const Eigen::VectorXd & vec) const
+{
+    int nnz;
+    const int * col;
+    const double * val;
+    this->_rowEntries(row, nnz, col, val);
+    double dot = 0;
+    for (int k = 0; k < nnz; ++k)
+        dot += val[k]*vec[col[k]];
+    return dot;
+}
 
-            if (dissim < min_dissim)
+void KMeans::_addRow(const int & row, Eigen::VectorXd & vec) const
+{
+    int nnz;
+    const int * col;
+    const double * val;
+    this->_rowEntries(row, nnz, col, val);
+    for (int k = 0; k < nnz; ++k)
+        vec[col[k]] += val[k];
+}
+
+void KMeans::_subtractRow(const int & row, Eigen::VectorXd & vec) const
+{
+    int nnz;
+    const int * col;
+    const double * val;
+    this->_rowEntries(row, nnz, col, val);
+    for (int k = 0; k < nnz; ++k)
+        vec[col[k]] -= val[k];
+}
+
+double KMeans::_rowWeight(const int & row) const
+{
+    return this->_weights.empty() ? 1 : this->_weights[this->_row_doc[row]];
+}
+
+void KMeans::_addWeightedRow(const int & row, Eigen::VectorXd & sum) const
+{
+    if (this->_weights.empty())
+        return this->_addRow(row, sum);
+    int nnz;
+    const int * col;
+    const double * val;
+    const double weight = this->_weights[this->_row_doc[row]];
+    this->_rowEntries(row, nnz, col, val);
+    for (int k = 0; k < nnz; ++k)
+        sum[col[k]] += weight*val[k];
+}
+
+void KMeans::_subtractWeightedRow(const int & row, Eigen::VectorXd & sum) const
+{
+    if (this->_weights.empty())
+        return this->_subtractRow(row, sum);
+    int nnz;
+    const int * col;
+    const double * val;
+    const double weight = this->_weights[this->_row_doc[row]];
+    this->_rowEntries(row, nnz, col, val);
+    for (int k = 0; k < nnz; ++k)
+        sum[col[k]] -= weight*val[k];
+}
+
+int KMeans::_assignPoints()
+{
+    int updated = this->assignStep();
+    if (updated < 0)
+        return 0;
+    if (updated < this->_update_threshold)
+        return updated;
+    else
+        return this->_updateCentroids();
+}
+
+int KMeans::assignStep()
+{
+    int updated = 0;
+    int c;
+    this->_obj_value = 0;
+
+    if (this->_dataset)
+        return this->_assignStreamed();
+
+    // Looking for the closest centroid of each point
+    // Now only cosine dissimilarity is supported
+    // cosine dissimilarity is in the range [0, 2] or [0, 1] if tf-idf is used
+    if (this->_kernel == KMeans::PAIRWISE_KERNEL)
+        this->_scorePairwise();
+    else if (this->_kernel == KMeans::TILED_KERNEL)
+        this->_scoreTiled();
+    else
+        this->_scoreBlocked();
+
+    std::fill(this->_changed.begin(), this->_changed.end(), 0);
+    // Points moving between clusters are moved between the running sums of the clusters
+    for (int i = 0; i < this->_n_points; ++i)
+    {
+        if (this->_row_cen[i] == KMeans::_REMOVED)
+            continue;
+        c = this->_closest[i];
+        this->_obj_value += this->_weights.empty() ? this->_min_dissim[i] : this->_rowWeight(i)*this->_min_dissim[i];
+        if (this->_row_cen[i] != c)
+        {
+            if (this->_row_cen[i] != -1)
             {
-                min_dissim = dissim;
-                tar_centroid = c;
+                this->_changed[this->_row_cen[i]/64] |= std::uint64_t(1) << (this->_row_cen[i]%64);
+                this->_subtractWeightedRow(i, this->_centroids[this->_row_cen[i]]->sum);
             }
-            if (dissim <= 3e-16)
-                break;
+            this->_changed[c/64] |= std::uint64_t(1) << (c%64);
+            this->_addWeightedRow(i, this->_centroids[c]->sum);
+            updated++;
+            this->_row_cen[i] = c;
         }
-        this->_obj_value += min_dissim;
-        tar_centroid->pts.push_front(p);
-        if (p->centroid != tar_centroid->id)
+    }
+    this->_groupMembers();
+    return updated;
+}
+
+void KMeans::_groupMembers()
+{
+    // Group rows by cluster; the rows of cluster c are _members[_member_offset[c]] to _members[_member_end[c]-1]
+    int c;
+    std::fill(this->_member_offset.begin(), this->_member_offset.end(), 0);
+    for (int i = 0; i < this->_n_points; ++i)
+    {
+        if (this->_row_cen[i] >= 0)
+            this->_member_offset[this->_row_cen[i]+1]++;
+    }
+    for (c = 0; c < this->_n_clusters; ++c)
+    {
+        this->_member_offset[c+1] += this->_member_offset[c];
+        this->_member_end[c] = this->_member_offset[c];
+    }
+    for (int i = 0; i < this->_n_points; ++i)
+    {
+        if (this->_row_cen[i] >= 0)
+            this->_members[this->_member_end[this->_row_cen[i]]++] = i;
+    }
+    for (c = 0; c < this->_n_clusters; ++c)
+    {
+        this->_centroids[c]->size = this->_member_end[c] - this->_member_offset[c];
+        this->_centroids[c]->weight = this->_centroids[c]->size;
+    }
+    if (this->_weights.empty())
+        return;
+    for (c = 0; c < this->_n_clusters; ++c)
+    {
+        this->_centroids[c]->weight = 0;
+        for (int m = this->_member_offset[c]; m < this->_member_end[c]; ++m)
+            this->_centroids[c]->weight += this->_rowWeight(this->_members[m]);
+    }
+}
+
+int KMeans::_assignStreamed()
+{
+    const int n_tiles = (this->_n_clusters + KMeans::CENTROID_TILE - 1)/KMeans::CENTROID_TILE;
+    const std::size_t tile_size = (std::size_t)(this->_dim+1)*KMeans::CENTROID_TILE;
+    double * sims = this->_similarities.data();
+    double dissim, min_dissim;
+    int updated = 0;
+    int nnz, c, old, row;
+    const int * col;
+    const double * val;
+    const char * data;
+    const Dataset::Block * block;
+
+    std::fill(this->_changed.begin(), this->_changed.end(), 0);
+    for (auto cen : this->_centroids)
+    {
+        cen->size = 0;
+        cen->weight = 0;
+    }
+    // Each block is scored and its points moved while the background thread reads the next one
+    this->_dataset->rewind();
+    while ((block = this->_dataset->next()) != nullptr)
+    {
+        data = block->data;
+        for (row = block->first; row < block->first + block->size; ++row)
         {
-            if (p->centroid != -1)
-                updated_centroids.insert(p->centroid);
-            updated_centroids.insert(tar_centroid->id);
+            data += Dataset::record(data, nnz, col, val);
+            for (int t = 0; t < n_tiles; ++t)
+                KMeans::scoreTile(col, val, nnz, this->_tiles + t*tile_size, sims + t*KMeans::CENTROID_TILE);
+            min_dissim = 3;
+            c = 0;
+            for (int k = 0; k < this->_n_clusters; ++k)
+            {
+                dissim = 1 - sims[k];
+                if (dissim < min_dissim)
+                {
+                    min_dissim = dissim;
+                    c = k;
+                }
+            }
+            this->_obj_value += min_dissim;
+            this->_centroids[c]->size++;
+            this->_centroids[c]->weight++;
+            old = this->_row_cen[row];
+            if (old == c)
+                continue;
+            if (old != -1)
+            {
+                this->_changed[old/64] |= std::uint64_t(1) << (old%64);
+                Eigen::VectorXd & sum = this->_centroids[old]->sum;
+                for (int k = 0; k < nnz; ++k)
+                    sum[col[k]] -= val[k];
+            }
+            this->_changed[c/64] |= std::uint64_t(1) << (c%64);
+            Eigen::VectorXd & sum = this->_centroids[c]->sum;
+            for (int k = 0; k < nnz; ++k)
+                sum[col[k]] += val[k];
             updated++;
-            p->centroid = tar_centroid->id;
+            this->_row_cen[row] = c;
         }
     }
+    if (this->_dataset->failed())
+    {
+        this->log("  Unable to read the dataset file. Stop iterating.");
+        return -1;
+    }
+    return updated;
+}
 
-    if (updated < this->_update_threshold)
-        return updated;
+int KMeans::_assignTrails(const std::vector<_Trail *> & trails)
+{
+    int nnz;
+    const int * col;
+    const double * val;
+    const char * data;
+    const Dataset::Block * block;
+
+    for (auto trail : trails)
+    {
+        trail->obj_value = 0;
+        trail->moved = 0;
+        std::fill(trail->changed.begin(), trail->changed.end(), 0);
+        for (auto cen : trail->centroids)
+        {
+            cen->size = 0;
+            cen->weight = 0;
+        }
+    }
+    // A block of points stays in cache while the centroids of all trails are scored against it
+    if (!this->_dataset)
+    {
+        for (int first = 0; first < this->_n_points; first += this->_point_block)
+            this->_assignTrailBlock(trails, first, std::min(first + this->_point_block, this->_n_points), nullptr);
+        return 0;
+    }
+    this->_dataset->rewind();
+    while ((block = this->_dataset->next()) != nullptr)
+    {
+        data = block->data;
+        for (int first = block->first, last; first < block->first + block->size; first = last)
+        {
+            last = std::min<std::int64_t>(first + this->_point_block, block->first + block->size);
+            this->_assignTrailBlock(trails, first, last, data);
+            for (int row = first; row < last; ++row)
+                data += Dataset::record(data, nnz, col, val);
+        }
+    }
+    if (this->_dataset->failed())
+    {
+        this->log("  Unable to read the dataset file. Stop iterating.");
+        return -1;
+    }
+    return 0;
+}
+
+void KMeans::_assignTrailBlock(const std::vector<_Trail *> & trails, const int & first, const int & last, const char * data)
+{
+    const int n_tiles = (this->_n_clusters + KMeans::CENTROID_TILE - 1)/KMeans::CENTROID_TILE;
+    const std::size_t tile_size = (std::size_t)(this->_dim+1)*KMeans::CENTROID_TILE;
+    double * sims = this->_similarities.data();
+    double dissim, weight;
+    int nnz, c, old;
+    const int * col;
+    const double * val;
+    const char * record;
+    for (auto trail : trails)
+    {
+        // Same comparisons as the tiled kernel, so that ties go to the same centroids
+        record = data;
+        for (int row = first; row < last; ++row)
+        {
+            if (record != nullptr)
+                record += Dataset::record(record, nnz, col, val);
+            else
+                this->_rowEntries(row, nnz, col, val);
+            for (int t = 0; t < n_tiles; ++t)
+                KMeans::scoreTile(col, val, nnz, trail->tiles + t*tile_size, sims + t*KMeans::CENTROID_TILE);
+            this->_min_dissim[row-first] = 3;
+            for (int k = 0; k < this->_n_clusters; ++k)
+            {
+                dissim = 1 - sims[k];
+                if (dissim < this->_min_dissim[row-first])
+                {
+                    this->_min_dissim[row-first] = dissim;
+                    this->_closest[row-first] = k;
+                }
+            }
+        }
+        // Points changing clusters are moved between the running sums of the trail
+        record = data;
+        for (int row = first; row < last; ++row)
+        {
+            if (record != nullptr)
+                record += Dataset::record(record, nnz, col, val);
+            else
+                this->_rowEntries(row, nnz, col, val);
+            c = this->_closest[row-first];
+            weight = this->_rowWeight(row);
+            trail->obj_value += weight*this->_min_dissim[row-first];
+            trail->centroids[c]->size++;
+            trail->centroids[c]->weight += weight;
+            old = trail->row_cen[row];
+            if (old == c)
+                continue;
+            if (old != -1)
+            {
+                trail->changed[old/64] |= std::uint64_t(1) << (old%64);
+                Eigen::VectorXd & sum = trail->centroids[old]->sum;
+                for (int k = 0; k < nnz; ++k)
+                    sum[col[k]] -= weight*val[k];
+            }
+            trail->changed[c/64] |= std::uint64_t(1) << (c%64);
+            Eigen::VectorXd & sum = trail->centroids[c]->sum;
+            for (int k = 0; k < nnz; ++k)
+                sum[col[k]] += weight*val[k];
+            trail->moved++;
+            trail->row_cen[row] = c;
+        }
+    }
+}
+
+void KMeans::_reseedCentroid(const int & cid, const int & donor)
+{
+    // The last row of the donor cluster becomes the only point of the empty cluster.
+    // Streamed points are not grouped by cluster, so that the last row is searched for instead.
+    int p;
+    if (this->_dataset)
+        for (p = this->_n_points; --p > 0 && this->_row_cen[p] != donor;);
     else
-        return this->_updateCentroids(updated_centroids);
+        p = this->_members[--this->_member_end[donor]];
+    this->_centroids[donor]->size--;
+    this->_centroids[donor]->weight -= this->_rowWeight(p);
+    this->_subtractWeightedRow(p, this->_centroids[donor]->sum);
+    this->_row_cen[p] = cid;
+    this->_centroids[cid]->size = 1;
+    this->_centroids[cid]->weight = this->_rowWeight(p);
+    this->_centroids[cid]->sum.setZero();
+    this->_addWeightedRow(p, this->_centroids[cid]->sum);
+    this->_centroids[cid]->vec.setZero();
+    this->_addRow(p, this->_centroids[cid]->vec);
+    this->_centroids[cid]->l2norm = 1;
+    this->_packCentroid(cid);
 }
 
-int KMeans::_updateCentroids(const std::set<int> & centroid_ids)
+int KMeans::_updateCentroids()
 {
     int updated = 0;
-    KMeans::_S_Point * p;
-    std::deque<int> empty_clusters;
-    std::deque<int> nonempty_clusters;
+    std::size_t next_empty = 0;
 
-    for (auto cid: centroid_ids)
+    this->_empty_clusters.clear();
+    this->_nonempty_clusters.clear();
+    for (int cid = this->_n_clusters; --cid > -1;)
     {
-        if (this->_centroids[cid]->pts.empty())
-            empty_clusters.push_front(cid);
+        if ((this->_changed[cid/64] & (std::uint64_t(1) << (cid%64))) == 0)
+            continue;
+        if (this->_centroids[cid]->size == 0)
+            this->_empty_clusters.push_back(cid);
         else
-            nonempty_clusters.push_front(cid);
+            this->_nonempty_clusters.push_back(cid);
     }
     // Deal with empty clusters
-    if (!empty_clusters.empty())
+    if (!this->_empty_clusters.empty())
     {
         // The basic idea is to pick points from nonempty clusters
         // In order to reduce computation, we firstly pick points from the clusters who need to update the centroids.
-        if (!nonempty_clusters.empty())
+        for (auto necid : this->_nonempty_clusters)
         {
-            for (auto necid : nonempty_clusters)
-            {
-                if (empty_clusters.empty())
-                    break;
-                while (!empty_clusters.empty() && this->_centroids[necid]->pts.size() > 1)
-                {
-                    auto cid = empty_clusters.front();
-                    empty_clusters.pop_front();
-                    p = this->_centroids[necid]->pts.front();
-                    this->_centroids[necid]->pts.pop_front();
-                    p->centroid = cid;
-                    this->_centroids[cid]->pts.push_front(p);
-                    this->_centroids[cid]->vec = p->vec;
-                    this->_centroids[cid]->l2norm = 1;
-                }
-            }
+            if (next_empty == this->_empty_clusters.size())
+                break;
+            while (next_empty < this->_empty_clusters.size() && this->_centroids[necid]->size > 1)
+                this->_reseedCentroid(this->_empty_clusters[next_empty++], necid);
         }
 
         // Not enough nonempty clusters
-        if (!empty_clusters.empty())
+        for (; next_empty < this->_empty_clusters.size(); ++next_empty)
         {
-            for (auto cid : empty_clusters)
+            // The amount of calculation can be further reduced by
+            // picking points from the clusters who has minimal amount of points.
+            // But in order to do so, we need to sort current clusters and
+            // would result in an increase in computation as well
+            for (auto ne_c : this->_centroids)
             {
-                // The amount of calculation can be further reduced by
-                // picking points from the clusters who has minimal amount of points.
-                // But in order to do so, we need to sort current clusters and
-                // would result in an increase in computation as well
-                for (auto ne_c : this->_centroids)
+                if (ne_c->size > 1)
                 {
-                    if (ne_c->pts.size() > 1)
-                    {
-                        p = ne_c->pts.front();
-                        ne_c->pts.pop_front();
-                        p->centroid = cid;
-                        this->_centroids[cid]->pts.push_front(p);
-                        this->_centroids[cid]->vec = p->vec;
-                        this->_centroids[cid]->l2norm = 1;
-                        nonempty_clusters.push_front(ne_c->id);
-                        break;
-                    }
+                    this->_reseedCentroid(this->_empty_clusters[next_empty], ne_c->id);
+                    this->_nonempty_clusters.push_back(ne_c->id);
+                    break;
                 }
             }
         }
     }
 
-    updated = nonempty_clusters.size();
+    updated = this->_nonempty_clusters.size();
     if (updated < this->_update_threshold)
         return 0;
 
-    for (auto cid : nonempty_clusters)
+    // The running sums were updated by the points that moved,
+    // so that the cost of an update is proportional to the number of moves
+    for (auto cid : this->_nonempty_clusters)
     {
-        this->_centroids[cid]->vec.setZero();
-        for (auto p : this->_centroids[cid]->pts)
-            this->_centroids[cid]->vec += p->vec;
-        this->_centroids[cid]->vec /= this->_centroids[cid]->pts.size();
+        this->_centroids[cid]->vec = this->_centroids[cid]->sum/this->_centroids[cid]->weight;
         this->_centroids[cid]->l2norm = this->_centroids[cid]->vec.norm();
+        this->_packCentroid(cid);
     }
 
     return updated;
 }
 
+int KMeans::saveModel(const std::string & file)
+{
+    if (this->_completed == false)
+        return 1;       // No clustering solution
+
+    auto align = [](std::uint64_t offset) { return (offset + 63)/64*64; };
+    const int tile = KMeans::CENTROID_TILE;
+    const int n_tiles = (this->_n_clusters + tile - 1)/tile;
+
+    // Only features with a nonzero weight in some centroid are stored
+    std::vector<int> features;
+    for (int d = 0; d <= this->_dim; ++d)
+    {
+        for (auto c : this->_centroids)
+        {
+            if (c->vec[d] != 0)
+            {
+                features.push_back(d);
+                break;
+            }
+        }
+    }
+
+    ModelHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, KMeans::MODEL_MAGIC, sizeof(header.magic));
+    header.version = KMeans::MODEL_VERSION;
+    header.tile = tile;
+    header.n_clusters = this->_n_clusters;
+    header.n_features = features.size();
+    header.n_points = this->_n_points - this->_n_removed;
+    header.iterations = this->_iter_info.size();
+    header.seed = this->seed;
+    header.obj_value = this->_obj_value;
+    header.time_taken = this->_total_time_taken;
+    header.created = std::time(nullptr);
+    header.feature_offset = align(sizeof(header));
+    header.weight_offset = align(header.feature_offset + features.size()*sizeof(int));
+    header.norm_offset = align(header.weight_offset + (std::uint64_t)n_tiles*features.size()*tile*sizeof(double));
+    header.size_offset = align(header.norm_offset + this->_n_clusters*sizeof(double));
+    header.file_size = header.size_offset + this->_n_clusters*sizeof(std::int64_t);
+
+    std::vector<char> buffer(header.file_size, 0);
+    std::memcpy(buffer.data(), &header, sizeof(header));
+    std::memcpy(buffer.data() + header.feature_offset, features.data(), features.size()*sizeof(int));
+    double * weights = reinterpret_cast<double *>(buffer.data() + header.weight_offset);
+    double * norms = reinterpret_cast<double *>(buffer.data() + header.norm_offset);
+    std::int64_t * sizes = reinterpret_cast<std::int64_t *>(buffer.data() + header.size_offset);
+    for (auto c : this->_centroids)
+    {
+        double * w = weights + (std::size_t)(c->id/tile)*features.size()*tile + c->id%tile;
+        for (std::size_t f = 0; f < features.size(); ++f)
+            w[f*tile] = c->vec[features[f]];
+        norms[c->id] = c->l2norm;
+        sizes[c->id] = c->size;
+    }
+
+    std::ofstream output(file, std::ios::binary);
+    if (output.fail())
+        return 2;       // Unable to open the file
+    output.write(buffer.data(), buffer.size());
+    return output.fail() ? 2 : 0;
+}
+
+int KMeans::loadModel(const std::string & file)
+{
+    std::ifstream input(file, std::ios::binary);
+    if (input.fail())
+        return 1;       // Unable to open the file
+    std::vector<char> buffer(input.seekg(0, std::ios::end).tellg());
+    input.seekg(0, std::ios::beg).read(buffer.data(), buffer.size());
+    if (input.fail())
+        return 1;
+
+    ModelHeader header;
+    if (buffer.size() < sizeof(header))
+        return 2;       // Invalid model file
+    std::memcpy(&header, buffer.data(), sizeof(header));
+    if (std::memcmp(header.magic, KMeans::MODEL_MAGIC, sizeof(header.magic)) != 0 || header.version != KMeans::MODEL_VERSION
+        || header.file_size != buffer.size() || header.tile < 1 || header.n_clusters < 1 || header.n_features < 0)
+        return 2;
+    const std::size_t n_features = header.n_features;
+    const std::size_t tile = header.tile;
+    const std::size_t n_tiles = (header.n_clusters + tile - 1)/tile;
+    if (header.feature_offset + n_features*sizeof(int) > header.file_size
+        || header.weight_offset + n_tiles*n_features*tile*sizeof(double) > header.file_size
+        || header.norm_offset + header.n_clusters*sizeof(double) > header.file_size
+        || header.size_offset + header.n_clusters*sizeof(std::int64_t) > header.file_size)
+        return 2;
+
+    const double * weights = reinterpret_cast<const double *>(buffer.data() + header.weight_offset);
+    this->_model.header = header;
+    this->_model.features.assign(reinterpret_cast<const int *>(buffer.data() + header.feature_offset),
+                                 reinterpret_cast<const int *>(buffer.data() + header.feature_offset) + n_features);
+    this->_model.norms.assign(reinterpret_cast<const double *>(buffer.data() + header.norm_offset),
+                              reinterpret_cast<const double *>(buffer.data() + header.norm_offset) + header.n_clusters);
+    this->_model.sizes.assign(reinterpret_cast<const std::int64_t *>(buffer.data() + header.size_offset),
+                              reinterpret_cast<const std::int64_t *>(buffer.data() + header.size_offset) + header.n_clusters);
+    this->_model.weights.resize(header.n_clusters*n_features);
+    for (std::size_t c = 0; c < (std::size_t)header.n_clusters; ++c)
+    {
+        const double * w = weights + c/tile*n_features*tile + c%tile;
+        for (std::size_t f = 0; f < n_features; ++f)
+            this->_model.weights[c*n_features + f] = w[f*tile];
+    }
+    return 0;
+}
+
+const KMeans::Model & KMeans::getModel()
+{
+    return this->_model;
+}
+
+void KMeans::setCheckpoint(const std::string & file, const int & iterations, const double & seconds)
+{
+    this->_checkpoint_file = file;
+    this->_checkpoint_iterations = iterations < 0 ? 0 : iterations;
+    this->_checkpoint_seconds = seconds < 0 ? 0 : seconds;
+    // The writer thread is started here rather than in an iteration
+    if (file.empty())
+        this->_checkpoint_writer.reset();
+    else if (!this->_checkpoint_writer)
+        this->_checkpoint_writer.reset(new AsyncWriter);
+}
+
+void KMeans::_writeCheckpoint(const int & iter, const double & time_taken)
+{
+    if (this->_n_removed > 0)
+        return;
+
+    // Sparse centroids: dimensions where the weight or the running sum is nonzero
+    std::size_t nnz = 0;
+    for (auto c : this->_centroids)
+        for (int d = 0; d <= this->_dim; ++d)
+            if (c->vec[d] != 0 || c->sum[d] != 0)
+                nnz++;
+    const std::size_t n = this->_n_points;
+    const std::size_t size = sizeof(CheckpointHeader) + 3*n*sizeof(std::int32_t)
+                           + this->_iter_info.size()*(sizeof(std::int32_t) + 2*sizeof(double) + sizeof(std::uint64_t))
+                           + this->_n_clusters*(sizeof(double) + sizeof(std::int64_t)) + nnz*(sizeof(std::int32_t) + 2*sizeof(double));
+
+    // The buffer comes back from the writer with its capacity, and grows with some room
+    std::vector<char> & buffer = this->_checkpoint_buffer;
+    if (buffer.capacity() < size)
+        buffer.reserve(size + size/4);
+    buffer.resize(size);
+    char * ptr = buffer.data();
+    auto put = [&ptr](const void * data, const std::size_t & bytes)
+    {
+        std::memcpy(ptr, data, bytes);
+        ptr += bytes;
+    };
+
+    CheckpointHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, KMeans::CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = KMeans::CHECKPOINT_VERSION;
+    header.n_clusters = this->_n_clusters;
+    header.dim = this->_dim;
+    header.n_points = this->_n_points;
+    header.iterations = iter;
+    header.seed = this->seed;
+    header.time_taken = time_taken;
+    header.file_size = size;
+    put(&header, sizeof(header));
+    put(this->_ids.data(), n*sizeof(std::int32_t));
+    put(this->_row_doc.data(), n*sizeof(std::int32_t));
+    put(this->_row_cen.data(), n*sizeof(std::int32_t));
+    std::int32_t updated;
+    double value;
+    std::uint64_t allocations;
+    for (auto & info : this->_iter_info)
+    {
+        updated = std::get<0>(info);
+        put(&updated, sizeof(updated));
+        value = std::get<1>(info);
+        put(&value, sizeof(value));
+        value = std::get<2>(info);
+        put(&value, sizeof(value));
+    }
+    for (auto a : this->_iter_allocations)
+    {
+        allocations = a;
+        put(&allocations, sizeof(allocations));
+    }
+    std::int64_t c_nnz;
+    std::int32_t d32;
+    for (auto c : this->_centroids)
+    {
+        put(&c->l2norm, sizeof(double));
+        c_nnz = 0;
+        for (int d = 0; d <= this->_dim; ++d)
+            if (c->vec[d] != 0 || c->sum[d] != 0)
+                c_nnz++;
+        put(&c_nnz, sizeof(c_nnz));
+        for (int d = 0; d <= this->_dim; ++d)
+        {
+            if (c->vec[d] == 0 && c->sum[d] == 0)
+                continue;
+            d32 = d;
+            put(&d32, sizeof(d32));
+        }
+        for (int d = 0; d <= this->_dim; ++d)
+            if (c->vec[d] != 0 || c->sum[d] != 0)
+                put(&c->vec[d], sizeof(double));
+        for (int d = 0; d <= this->_dim; ++d)
+            if (c->vec[d] != 0 || c->sum[d] != 0)
+                put(&c->sum[d], sizeof(double));
+    }
+    this->_checkpoint_writer->submit(this->_checkpoint_file, buffer);
+}
+
+int KMeans::loadCheckpoint(const std::string & file)
+{
+    std::ifstream input(file, std::ios::binary);
+    if (input.fail())
+        return 1;       // Unable to open the file
+    std::vector<char> buffer(input.seekg(0, std::ios::end).tellg());
+    input.seekg(0, std::ios::beg).read(buffer.data(), buffer.size());
+    if (input.fail())
+        return 1;
+
+    CheckpointHeader header;
+    if (buffer.size() < sizeof(header))
+        return 2;       // Invalid checkpoint file
+    std::memcpy(&header, buffer.data(), sizeof(header));
+    if (std::memcmp(header.magic, KMeans::CHECKPOINT_MAGIC, sizeof(header.magic)) != 0 || header.version != KMeans::CHECKPOINT_VERSION
+        || header.file_size != buffer.size() || header.n_clusters < 1 || header.n_points < header.n_clusters || header.dim < 0
+        || header.iterations < 1)
+        return 2;
+    const std::uint64_t fixed = sizeof(header) + 3*header.n_points*sizeof(std::int32_t)
+                              + header.iterations*(sizeof(std::int32_t) + 2*sizeof(double) + sizeof(std::uint64_t))
+                              + header.n_clusters*(sizeof(double) + sizeof(std::int64_t));
+    if (fixed > header.file_size)
+        return 2;
+    this->_resume.swap(buffer);
+    this->seed = header.seed;
+    return 0;
+}
+
+int KMeans::_applyCheckpoint()
+{
+    const char * ptr = this->_resume.data();
+    const char * end = ptr + this->_resume.size();
+    auto get = [&ptr](void * data, const std::size_t & bytes)
+    {
+        std::memcpy(data, ptr, bytes);
+        ptr += bytes;
+    };
+    CheckpointHeader header;
+    get(&header, sizeof(header));
+    const int n = header.n_points;
+    if (n != this->_n_points || header.n_clusters != this->_n_clusters || header.dim != this->_dim
+        || std::memcmp(ptr, this->_ids.data(), n*sizeof(std::int32_t)) != 0)
+        return 0;       // Different data objects
+    ptr += n*sizeof(std::int32_t);
+
+    auto mismatch = [this]()
+    {
+        std::fill(this->_row_cen.begin(), this->_row_cen.end(), -1);
+        this->_iter_info.clear();
+        this->_iter_allocations.clear();
+        return 0;
+    };
+
+    // Rows are permuted into the order they had when the checkpoint was written
+    std::vector<int> saved_row_doc(n);
+    get(saved_row_doc.data(), n*sizeof(std::int32_t));
+    std::vector<int> new_row(n, -1);
+    for (int r = 0; r < n; ++r)
+    {
+        // Each point has exactly one saved row
+        if (saved_row_doc[r] < 0 || saved_row_doc[r] >= n || new_row[saved_row_doc[r]] != -1)
+            return mismatch();
+        new_row[saved_row_doc[r]] = r;       // saved row of each point
+    }
+    for (int r = 0; r < n; ++r)
+        saved_row_doc[r] = new_row[this->_row_doc[r]];     // saved row of each current row
+    if (this->_dataset)
+    {
+        // Streamed rows stay in the order of points; each row takes the cluster of its saved row instead
+        get(new_row.data(), n*sizeof(std::int32_t));
+        for (int r = 0; r < n; ++r)
+            this->_row_cen[r] = new_row[saved_row_doc[r]];
+    }
+    else
+    {
+        this->_permuteRows(saved_row_doc);
+        get(this->_row_cen.data(), n*sizeof(std::int32_t));
+    }
+    for (auto c : this->_row_cen)
+        if (c < -1 || c >= this->_n_clusters)
+            return mismatch();
+
+    this->_iter_info.clear();
+    this->_iter_allocations.clear();
+    std::int32_t updated;
+    double obj_value, time_taken;
+    for (int i = 0; i < header.iterations; ++i)
+    {
+        get(&updated, sizeof(updated));
+        get(&obj_value, sizeof(obj_value));
+        get(&time_taken, sizeof(time_taken));
+        this->_iter_info.push_back(std::make_tuple(updated, obj_value, time_taken));
+    }
+    std::uint64_t allocations;
+    for (int i = 0; i < header.iterations; ++i)
+    {
+        get(&allocations, sizeof(allocations));
+        this->_iter_allocations.push_back(allocations);
+    }
+    this->_obj_value = std::get<1>(this->_iter_info.back());
+
+    if ((int)this->_centroids.size() != this->_n_clusters || this->_centroids[0]->vec.size() != this->_dim+1)
+    {
+        for (auto c : this->_centroids)
+            delete c;
+        this->_centroids.clear();
+        for (int i = 0; i < this->_n_clusters; ++i)
+            this->_centroids.push_back(new _Centroid(i, Eigen::VectorXd::Zero(this->_dim+1), 1));
+    }
+    std::int64_t nnz;
+    std::vector<std::int32_t> dims;
+    for (auto c : this->_centroids)
+    {
+        c->vec.setZero();
+        c->sum.setZero();
+        c->size = 0;
+        c->weight = 0;
+        get(&c->l2norm, sizeof(double));
+        get(&nnz, sizeof(nnz));
+        if (nnz < 0 || nnz > this->_dim+1 || ptr + nnz*(sizeof(std::int32_t) + 2*sizeof(double)) > end)
+            return mismatch();
+        dims.resize(nnz);
+        get(dims.data(), nnz*sizeof(std::int32_t));
+        for (auto d : dims)
+            if (d < 0 || d > this->_dim)
+                return mismatch();
+        for (auto d : dims)
+            get(&c->vec[d], sizeof(double));
+        for (auto d : dims)
+            get(&c->sum[d], sizeof(double));
+    }
+    for (int r = 0; r < (int)this->_row_cen.size(); ++r)
+    {
+        if (this->_row_cen[r] < 0)
+            continue;
+        this->_centroids[this->_row_cen[r]]->size++;
+        this->_centroids[this->_row_cen[r]]->weight += this->_rowWeight(r);
+    }
+    this->_dirty.assign(this->_n_clusters, 0);
+    this->_packCentroids();
+    this->_total_time_taken = header.time_taken;
+    return header.iterations;
+}
+
 void KMeans::evaluate(const std::unordered_map<std::string, std::set<int> > & class_points_map)
 {
 
@@ -367,15 +2881,22 @@ void KMeans::evaluate(const std::unordered_map<std::string, std::set<int> > & cl
     std::sort(vectorized_cp_map.begin(), vectorized_cp_map.end(), [](const std::pair<std::string, std::set<int> > & a, const std::pair<std::string, std::set<int> > & b){
         return a.second.size() > b.second.size();
     });
+    // Class of each point, indexed by point index. Ids are translated into indices only here.
     int total_class = 0;
     std::deque<std::string> class_collection;
-    std::unordered_map<int, int> pc_map;
+    std::vector<int> point_class(this->_n_points, -1);
+    std::vector<int> collapsed_class(this->_collapsed.size(), -1);
+    std::unordered_map<int, int>::const_iterator index;
     for (auto c : vectorized_cp_map)
     {
         class_collection.push_back(c.first);
         for (auto p : c.second)
         {
-            pc_map[p] = total_class;
+            index = this->_id_index.find(p);
+            if (index != this->_id_index.end())
+                point_class[index->second] = total_class;
+            else if ((index = this->_collapsed_index.find(p)) != this->_collapsed_index.end())
+                collapsed_class[index->second] = total_class;
         }
         total_class++;
     }
@@ -386,26 +2907,47 @@ void KMeans::evaluate(const std::unordered_map<std::string, std::set<int> > & cl
     // unfound points are categoried into the last, extra row
     std::deque<std::deque<int> > comp_mat(this->_n_clusters, std::deque<int>(total_class, 0));
     std::deque<int> ungrouped_points(this->_n_clusters, 0);
-    std::unordered_map<int, int>::iterator ptr;
+    std::deque<int> sizes(this->_n_clusters, 0);
     int max, total_pts;
     double division;
-    for (auto c : this->_centroids)
+    for (int r = 0; r < (int)this->_row_cen.size(); ++r)
     {
-        for (auto p : c->pts)
+        if (this->_row_cen[r] < 0)     // removed or added after the clustering; newer points have no rows yet
+            continue;
+        sizes[this->_row_cen[r]]++;
+        if (point_class[this->_row_doc[r]] == -1)
         {
-            ptr = pc_map.find(p->id);
-            if (ptr == pc_map.end())
-            {
-                ungrouped_points[c->id] += 1;
-                std::cerr << "EMPTY Cluster" << std::endl;
-            }
-            else
-            {
-                comp_mat[c->id][ptr->second] += 1;
-            }
+            ungrouped_points[this->_row_cen[r]] += 1;
+            std::cerr << "EMPTY Cluster" << std::endl;
         }
+        else
+        {
+            comp_mat[this->_row_cen[r]][point_class[this->_row_doc[r]]] += 1;
+        }
+    }
+    // Collapsed points count in the clusters of the points they were collapsed into, with their own classes
+    int n_collapsed = 0;
+    for (std::size_t i = 0; i < this->_collapsed.size(); ++i)
+    {
+        index = this->_id_index.find(this->_collapsed[i].second);
+        if (index == this->_id_index.end())
+            continue;
+        n_collapsed++;
+        if (index->second >= (int)this->_doc_row.size())
+            continue;
+        const int r = this->_doc_row[index->second];
+        if (this->_row_cen[r] < 0)
+            continue;
+        sizes[this->_row_cen[r]]++;
+        if (collapsed_class[i] == -1)
+            ungrouped_points[this->_row_cen[r]] += 1;
+        else
+            comp_mat[this->_row_cen[r]][collapsed_class[i]] += 1;
+    }
+    for (auto c : this->_centroids)
+    {
         max = 0;
-        total_pts = c->pts.size();
+        total_pts = sizes[c->id];
         for (int i = total_class; --i>-1;)
         {
             if (comp_mat[c->id][i] != 0)
@@ -421,12 +2963,12 @@ void KMeans::evaluate(const std::unordered_map<std::string, std::set<int> > & cl
         purity[c->id] = (double)max/total_pts;
         purity.back() += max;
     }
-    entropy.back() /= (double)this->_n_points;
-    purity.back() /= (double)this->_n_points;
+    entropy.back() /= (double)(this->_n_points - this->_n_removed + n_collapsed);
+    purity.back() /= (double)(this->_n_points - this->_n_removed + n_collapsed);
 
     // Output analysis results
     *this->log_stream << "\nClustering Analysis:\n";
-    *this->log_stream << "# of clusters: " << this->_n_clusters << ",\t# of data obj.: " << this->_n_points << ",\t# of dims: " << this->_dim+1 << ",\tTime taken: " << this->getTimeElapse() << "s\n\n";
+    *this->log_stream << "# of clusters: " << this->_n_clusters << ",\t# of data obj.: " << this->_n_points - this->_n_removed + n_collapsed << ",\t# of dims: " << this->_dim+1 << ",\tTime taken: " << this->getTimeElapse() << "s\n\n";
     *this->log_stream << "Cluster\tEntropy \tPurity   " << "\tObj. Value\n";
 
     *this->log_stream << std::setw(7) << " " << "\t" << std::fixed << entropy.back() << "\t" << purity.back() << "\t" << this->getObjValue() << "\n";
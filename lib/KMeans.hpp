@@ -10,6 +10,8 @@
 #define KMeans_hpp
 
 #include <deque>
+#include <queue>
+#include <vector>
 #include <set>
 #include <unordered_map>
 #include <ostream>
@@ -20,25 +22,129 @@
 #include <algorithm>
 #include <chrono>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <limits>
+#include <memory>
+#if defined(__APPLE__)
+#include <sys/sysctl.h>
+#elif defined(__linux__)
+#include <unistd.h>
+#endif
 
 #include "Eigen/Core"
 #include "Eigen/Sparse"
 
+#include "AsyncWriter.hpp"
+#include "Dataset.hpp"
+#include "ThreadPool.hpp"
+
 class KMeans {
  
 public:
     // If the random seed is equal to this flag, a new seed will be generated for initializing centroids.
     static int UNASSIGNED_RANDOM_SEED_FLAG;
+    // Number of centroids a document is scored against at once by the tiled kernel
+    static const int CENTROID_TILE = 8;
+
+    // Kernels available for scoring points against centroids in the assignment step
+    enum AssignKernel
+    {
+        PAIRWISE_KERNEL,    // one sparse dot product per (point, centroid) pair
+        TILED_KERNEL,       // one pass over a point's nonzeros per tile of CENTROID_TILE centroids
+        BLOCKED_KERNEL,     // tiled kernel applied to blocks of points x blocks of centroids that fit in cache
+        AUTO_KERNEL         // BLOCKED_KERNEL if the centroids do not fit in half of L2, otherwise TILED_KERNEL
+    };
     
     // A raw structure of data points
+    // A point and its attributes and values are stored contiguously in an arena owned by the KMeans object
     struct Point
     {
         int id;
-        std::deque<int> attribute;  // It is better to use a decreasing order
-        std::deque<double> value;
-        Point(const int & id, const std::deque<int> & attribute, const std::deque<double> & value) : id(id), attribute(attribute), value(value) {}
+        int size;               // number of attributes
+        int * attribute;        // It is better to use a decreasing order
+        double * value;
     };
     
+    // Header of the binary model file written by saveModel().
+    // The file is in native byte order. It begins with this header and each of the following sections
+    // starts at a 64-byte boundary, so that the file can be memory mapped and used in place.
+    //   int32   ids of features with a nonzero weight in any centroid [n_features], ascending
+    //   double  weights of centroids in the centroid-major layout [ceil(n_clusters/tile)][n_features][tile]
+    //   double  l2-norms of centroids [n_clusters]
+    //   int64   sizes of clusters [n_clusters]
+    struct ModelHeader
+    {
+        char magic[8];              // MODEL_MAGIC
+        std::uint32_t version;      // MODEL_VERSION
+        std::uint32_t tile;         // number of centroids in a tile of the weights section
+        std::int64_t n_clusters;
+        std::int64_t n_features;
+        std::int64_t n_points;      // number of data points clustered
+        std::int64_t iterations;    // number of iterations taken
+        std::int64_t seed;          // random seed used for initial centroids
+        double obj_value;           // value of the objective function
+        double time_taken;          // time taken by clustering in the unit of second
+        std::int64_t created;       // time when the model was saved, in seconds since epoch
+        std::uint64_t feature_offset;
+        std::uint64_t weight_offset;
+        std::uint64_t norm_offset;
+        std::uint64_t size_offset;
+        std::uint64_t file_size;
+        std::uint64_t reserved;
+    };
+    static const char MODEL_MAGIC[8];
+    static const std::uint32_t MODEL_VERSION = 1;
+
+    // Header of a checkpoint file written during run().
+    // It is followed by packed sections in native byte order:
+    //   int32   ids of points [n_points], in the order they were added
+    //   int32   point index of each row [n_points]
+    //   int32   cluster of each row [n_points]
+    //   per iteration: int32 updated centroids, double objective value, double time taken [iterations]
+    //   uint64  allocations of each iteration [iterations]
+    //   per centroid: double l2-norm, int64 nnz, int32 dimensions [nnz], double weights [nnz], double running sums [nnz]
+    // The random generator is only used for the initial centroids, so that no generator state is needed to continue.
+    struct CheckpointHeader
+    {
+        char magic[8];              // CHECKPOINT_MAGIC
+        std::uint32_t version;      // CHECKPOINT_VERSION
+        std::uint32_t reserved;
+        std::int64_t n_clusters;
+        std::int64_t dim;
+        std::int64_t n_points;
+        std::int64_t iterations;    // number of iterations done
+        std::int64_t seed;
+        double time_taken;          // time taken by the iterations done in the unit of second
+        std::uint64_t file_size;
+    };
+    static const char CHECKPOINT_MAGIC[8];
+    static const std::uint32_t CHECKPOINT_VERSION = 1;
+
+    // Centroids loaded from a model file
+    struct Model
+    {
+        ModelHeader header;
+        std::vector<int> features;
+        std::vector<double> weights;        // the i-th weight of the c-th centroid is weights[c*n_features + i]
+        std::vector<double> norms;
+        std::vector<std::int64_t> sizes;
+    };
+
+    // Node of the hierarchy built by runBisecting(). Node 0 holds all data objects,
+    // and each node that was split has two children holding its data objects.
+    struct HierarchyNode
+    {
+        int parent;             // -1 for the root
+        int left;               // children, -1 for leaves
+        int right;
+        int cluster;            // id of the cluster of a leaf, -1 for nodes that were split
+        int size;               // number of data objects
+        double obj_value;       // sum of the dissimilarities between the data objects and their centroid
+    };
+
     // Stream for displaying working log when clustering
     std::ostream * log_stream;
     
@@ -47,38 +153,110 @@ public:
     
 private:
     
-    // The numerical structure of data points
-    struct _S_Point
-    {
-        int id;
-        Eigen::SparseVector<double> vec;
-        int centroid = -1;       // id of the centorid as well as the id of its cluster. See the stucture of _Centroid
-        _S_Point(int id) : id(id) {}
-    };
-    
     // A combination structure of Centroid and Cluster
     struct _Centroid
     {
         int id;
-        std::deque<_S_Point *> pts;
+        int size = 0;           // number of points in the cluster
+        double weight = 0;      // total weight of the points in the cluster, which the running sum is divided by
         Eigen::VectorXd vec;
         double l2norm;
-        _Centroid(const int & id, const Eigen::VectorXd & vec, const double & l2norm) : id(id), vec(vec), l2norm(l2norm) {}
+        Eigen::VectorXd sum;    // running sum of the rows of the points in the cluster
+        _Centroid(const int & id, const Eigen::VectorXd & vec, const double & l2norm) : id(id), vec(vec), l2norm(l2norm), sum(Eigen::VectorXd::Zero(vec.size())) {}
     };
     
+    // Bump allocator handing out memory from large chunks which are only freed all together
+    class _Arena
+    {
+    public:
+        static const std::size_t CHUNK_SIZE = 1 << 20;
+        ~_Arena();
+        // Allocate memory aligned for double
+        void * allocate(const std::size_t & bytes);
+        // Free all chunks
+        void release();
+        // Bytes held by the arena
+        std::size_t capacity() const;
+    private:
+        std::vector<char *> _chunks;
+        std::size_t _used = 0;          // bytes used in the last chunk
+        std::size_t _last_size = 0;     // size of the last chunk
+        std::size_t _capacity = 0;
+    };
+
     // Number of clusters expected
     int _n_clusters;
-    // Number of data points
+    // Number of data points, including removed points not compacted yet
     int _n_points = 0;
+    // Number of removed points not compacted yet
+    int _n_removed = 0;
+    // Removed flag of each point
+    std::vector<bool> _removed;
+    // Weight of each point, counting it as that many points in the running sums, the centroids and the objective value.
+    // Empty while no weight was set, i.e. every point weighs 1.
+    std::vector<double> _weights;
+    // Ids of data objects in the order they were added, including collapsed ones, for expiring them out of the window.
+    // Data objects removed before they expire are counted in _departed, and their entries are skipped.
+    std::deque<int> _arrivals;
+    std::unordered_map<int, int> _departed;
+    // Maximum number of points kept; the oldest points are removed beyond it (0 means unlimited)
+    int _window_size = 0;
+    // Clusters which lost points by removal and whose centroids are not updated yet
+    std::vector<char> _dirty;
     // Threshold for stop ceriterion.
     // K-means iteration will keep going if the number of centroids being updated is greater than this threshold
     int _update_threshold = 0;
+    // Iterations also stop when the objective improves by less than this fraction (0 disables)
+    double _tolerance = 0;
+    // A run is abandoned once the objective after iteration i exceeds _race_bounds[i-1] (empty disables)
+    std::vector<double> _race_bounds;
+    bool _abandoned = false;
     // Dimension of documents
     int _dim = -1;
-    // Table of points
-    std::unordered_map<int, Point *> _pts;
-    // List of structured points
-    std::deque<_S_Point *> _s_pts;
+    // Points in the order they were added. The position of a point in this list is its index,
+    // which is used instead of its id everywhere except when taking or reporting ids.
+    // Released points are nullptr.
+    std::vector<Point *> _pts;
+    // Id of each point
+    std::vector<int> _ids;
+    // Index of each point id
+    std::unordered_map<int, int> _id_index;
+    // Storage of the points
+    _Arena _arena;
+    // Release the points and their storage after vectorization
+    bool _release_raw_data = false;
+    // Data objects whose normalized vectors equal the one of a data object added before are collapsed into it.
+    // Ids of the data objects kept, by the hash of their normalized vectors
+    bool _collapse_duplicates = false;
+    std::unordered_multimap<std::uint64_t, int> _vector_ids;
+    // Id of each collapsed data object and the id of the data object it was collapsed into, in the order they were added
+    std::vector<std::pair<int, int> > _collapsed;
+    // Position of each collapsed data object in _collapsed
+    std::unordered_map<int, int> _collapsed_index;
+    // Vectorized, normalized points in compressed sparse row format.
+    // Columns are sorted in each row. Rows may be permuted so that points of the same cluster are adjacent.
+    std::vector<std::int64_t> _row_ptr;
+    std::vector<int> _col;
+    std::vector<double> _val;
+    // Index of the point in each row
+    std::vector<int> _row_doc;
+    // Id of the centroid of each row (-1 if unassigned, _REMOVED if the point is removed)
+    std::vector<int> _row_cen;
+    static const int _REMOVED = -2;
+    // Maximum number of iterations of the 2-means splitting a cluster in runBisecting()
+    static const int _BISECT_ITERATIONS = 20;
+    // Hierarchy built by the last runBisecting()
+    std::vector<HierarchyNode> _hierarchy;
+    // Row of each point
+    std::vector<int> _doc_row;
+    // Reorder rows by cluster every given number of iterations (0 means never)
+    int _reorder_interval = 0;
+    // Buffers for the permuted copy of rows when reordering, swapped with the rows after reordering
+    std::vector<std::int64_t> _row_ptr_buf;
+    std::vector<int> _col_buf;
+    std::vector<double> _val_buf;
+    std::vector<int> _row_doc_buf;
+    std::vector<int> _row_cen_buf;
     // List of centroids
     std::deque<_Centroid *> _centroids;
     // Flag for multiple runs
@@ -90,12 +268,80 @@ private:
     // Number of centroids changed, value of objetive function and time used at each iteration
     // from the 1st to last iteration.
     std::vector<std::tuple<int, double, double> > _iter_info;
+    // Number of heap allocations made during each iteration
+    std::vector<std::size_t> _iter_allocations;
+    // Rows of the points in each cluster, grouped by cluster in the order of rows.
+    // The rows of cluster c are _members[_member_offset[c]] to _members[_member_end[c]-1].
+    std::vector<int> _members;
+    std::vector<int> _member_offset;
+    std::vector<int> _member_end;
+    // Bitset of the clusters whose points changed in the last assignment
+    std::vector<std::uint64_t> _changed;
+    // Empty and nonempty changed clusters found in the update step
+    std::vector<int> _empty_clusters;
+    std::vector<int> _nonempty_clusters;
     // Total time taken
     double _total_time_taken = 0;
+    // Kernel requested by the user and kernel used in the assignment step
+    AssignKernel _requested_kernel = AUTO_KERNEL;
+    AssignKernel _kernel = TILED_KERNEL;
+    // Block sizes requested by the user for the blocked kernel (0 means auto-selected from cache sizes)
+    int _point_block_size = 0;
+    int _tile_block_size = 0;
+    // Block sizes used by the blocked kernel, in number of points and in number of centroid tiles
+    int _point_block;
+    int _tile_block;
+    // Closest centroid of each point and the dissimilarity to it
+    std::vector<int> _closest;
+    std::vector<double> _min_dissim;
+    // Centroid-major copy of the centroids used by the tiled kernel.
+    // Centroids are grouped into tiles of CENTROID_TILE. Inside a tile, the weights of the same dimension
+    // for all centroids in the tile are adjacent and pre-divided by the centroid's l2-norm,
+    // so that each nonzero of a document gathers one cache line per tile.
+    std::vector<double> _centroid_tiles;
+    double * _tiles = nullptr;      // 64-byte aligned start of _centroid_tiles
+    // Similarity between the point being assigned and each centroid
+    std::vector<double> _similarities;
+    // Model loaded from a model file
+    Model _model;
+    // Seed the centroids from the loaded model
+    bool _warm_start = false;
+    // Checkpoint file and how often it is written (0 disables a criterion)
+    std::string _checkpoint_file;
+    int _checkpoint_iterations = 0;
+    double _checkpoint_seconds = 0;
+    std::unique_ptr<AsyncWriter> _checkpoint_writer;
+    std::vector<char> _checkpoint_buffer;
+    // Contents of a checkpoint loaded by loadCheckpoint(), consumed by the next run()
+    std::vector<char> _resume;
+    // Dataset file the points are streamed from instead of being kept in memory.
+    // Rows are the records of the file, in the order of points, and are never stored.
+    std::unique_ptr<Dataset> _dataset;
     // Clustering solution
     std::deque<std::deque<int> > _clustering;    // each element is a set of a cluster's points
                                                  // the key value is the id of the cluster
-    std::unordered_map<int, int> _point_clustering; // <point.id, cluster.id>
+    std::vector<int> _point_clustering;             // cluster.id of each point, indexed by point index
+    // State of a clustering of runTrails(), swapped with the members above when the trail is selected
+    struct _Trail
+    {
+        int seed;
+        std::deque<_Centroid *> centroids;
+        std::vector<int> row_cen;
+        std::vector<double> centroid_tiles;
+        double * tiles = nullptr;
+        std::vector<std::uint64_t> changed;
+        std::vector<char> dirty;
+        double obj_value = 0;
+        std::vector<std::tuple<int, double, double> > iter_info;
+        std::vector<std::size_t> iter_allocations;
+        std::deque<std::deque<int> > clustering;
+        std::vector<int> point_clustering;
+        int moved = 0;          // points changing clusters in the last pass
+        bool active = false;    // still iterating
+    };
+    // Trails of the last runTrails(). The slot of the selected trail holds an empty state while its state is in the members.
+    std::vector<_Trail> _trails;
+    int _selected_trail = -1;
 public:
     KMeans(const int & n_cluster);
     ~KMeans();
@@ -104,14 +350,138 @@ public:
     // Set a threshold for K-means strop cerition.
     // K-means iteration will keep going if the number of centroids being updated is greater than this threshold
     void setCentroidUpdateThreshold(const int & threshold);
+    // Stop iterating once an iteration improves the objective by less than the given fraction of it.
+    // 0 disables this criterion.
+    void setTolerance(const double & tolerance);
+    // Abandon a run once the objective after iteration i exceeds bounds[i-1], or the last bound after
+    // the given ones, e.g. when the run cannot be expected to beat the best of earlier runs any more.
+    // An empty list disables abandoning.
+    void setRaceBounds(const std::vector<double> & bounds);
+    // Whether the last run was abandoned by the race bounds. Its solution is the one of the iteration where it stopped.
+    bool isAbandoned() const;
     // Set the stream for outputing log information
     void setLogStream(std::ostream * log_stream);
     // Set the random seed for generating initial centroids
     void setRandomSeed(const int & seed);
+    // Permute the rows of vectorized points every given number of iterations so that points in the same cluster
+    // are stored contiguously. 0 disables reordering.
+    void setReorderInterval(const int & iterations);
+    // Set the kernel used for scoring points against centroids
+    void setAssignKernel(const AssignKernel & kernel);
+    // Set the number of points and the number of centroids in a block of the blocked kernel.
+    // 0 means the block size is selected according to the size of L2 cache.
+    void setCacheBlocking(const int & point_block, const int & centroid_block);
+    // Release raw data objects once they are vectorized to reduce memory usage.
+    void setReleaseRawData(const bool & release);
+    // Collapse each data object added from now on whose normalized vector equals the one of a data object kept before
+    // into that data object, whose weight grows by 1 (see setPointWeight()). Collapsed data objects are not clustered;
+    // they belong to the clusters of the data objects they were collapsed into, see getCollapsedPoints().
+    void setCollapseDuplicates(const bool & collapse);
     // Add a data object
+    // Return 0 on success, 1 if it has no attributes, 2 if attributes and values do not match, 3 if the id is repeated,
+    // 4 if data objects are streamed from a dataset file, 5 if it was collapsed into an earlier data object
     int addDataPoint(const int & id, const std::deque<int> & attribute, const std::deque<double> & value);
+    int addDataPoint(const int & id, const int * attribute, const double * value, const int & size);
+    // Remove a data object. It is subtracted from the running sum of its cluster at once,
+    // while its storage is reclaimed lazily by a later run. Removing a collapsed data object lowers the weight
+    // of the data object it was collapsed into by 1. A data object with collapsed duplicates leaves its place
+    // to the earliest of them, one weight lighter.
+    // Return 0 on success, 1 if no data object has the id or data objects are streamed from a dataset file
+    int removeDataPoint(const int & id);
+    // Set the weight of a data object, which then counts as that many data objects in the running sum of its cluster
+    // and in the objective value, e.g. for a weighted sample or a group of duplicates. Data objects weigh 1 by default.
+    // Return 0 on success, 1 if no data object has the id or data objects are streamed from a dataset file,
+    // 2 if the weight is not positive
+    int setPointWeight(const int & id, const double & weight);
+    // Keep at most the given number of the latest data objects, counting collapsed ones. Older data objects are removed
+    // at the beginning of run() and runIncremental(). 0 means no limit.
+    void setWindowSize(const int & size);
+    // Get the number of data objects, excluding removed ones
+    int getNumberOfPoints();
+    // Get the number of clusters, e.g. as chosen by runAutoK()
+    int getNumberOfClusters();
+    // Stream the data objects from a dataset file written by Dataset::Writer instead of keeping them in memory.
+    // Each iteration reads the file sequentially in blocks of about block_bytes bytes, while the next block is
+    // read ahead by a background thread. Only the centroids, their running sums and the cluster of each data object
+    // stay in memory. Data objects cannot be added or removed afterwards, and rows are never reordered.
+    // If block_bytes is 0, the file is mapped into memory read-only instead, so that processes clustering
+    // the same file share a single copy of it.
+    // Only the data objects of the given shard out of shards contiguous shards of the file are used.
+    // Return 0 on success, 1 if the file cannot be opened, 2 if it is not a valid dataset file,
+    // 3 if data objects were already added
+    int openDataset(const std::string & file, const std::size_t & block_bytes, const int & shard = 0, const int & shards = 1);
     // Run clustering
     int run();
+    // Continue clustering from the current centroids after data objects were added.
+    // Only the new data objects are vectorized; they are assigned to the current centroids by the first iteration.
+    // Same as run() if no clustering has completed.
+    int runIncremental();
+    // Continue clustering from the current solution with more clusters, e.g. to sweep the number of clusters.
+    // The clusters with the largest sums of dissimilarities are split until there are n_clusters clusters:
+    // random points of a cluster become the centroids of the new clusters, and a cluster is assumed to lose
+    // half of its sum by a split. Then iterations continue as runIncremental() does.
+    // Same as run() with n_clusters if no clustering has completed or n_clusters is not larger.
+    int growClusters(const int & n_clusters);
+    // Run bisecting clustering: starting from a single cluster of all data objects, the clusters with the largest
+    // sums of dissimilarities are split into two by 2-means over their own data objects until there are as many clusters
+    // as expected, so that a data object is only scored against the two centroids of each split of its cluster.
+    // Each round splits the n_threads worst clusters at once on separate threads; the solution depends on n_threads.
+    // Data objects streamed from a dataset file that is not mapped are read one by one on a single thread.
+    // Return the number of rounds.
+    int runBisecting(const int & n_threads);
+    // Get the hierarchy of splits built by the last runBisecting()
+    const std::vector<HierarchyNode> & getHierarchy();
+    // Run clustering choosing the number of clusters in the style of X-means: starting from the current number of clusters,
+    // every cluster is split on trial by 2-means over its own data objects, all of them at once on n_threads threads.
+    // Splits whose BIC-like score, n log(sum of dissimilarities before / after) - penalty log(n) for a cluster of n data
+    // objects, is positive are taken, and iterations continue as runIncremental() does, until no split pays off or there
+    // are max_clusters clusters. Return the number of iterations of all runs.
+    int runAutoK(const int & max_clusters, const double & penalty, const int & n_threads);
+    // Run clustering on a coreset: after a rough clustering by a single assignment to random initial centroids,
+    // coreset_size data objects are drawn by their sensitivities, i.e. their shares of the objective value and of their
+    // clusters, and weighted by the inverse of their probabilities. The clustering of the coreset gives the centroids,
+    // and a single pass assigns all data objects to them. Return the number of iterations of the coreset.
+    int runCoreset(const int & coreset_size);
+    // Run one clustering per random seed, all advancing in lockstep: each iteration scores every data object against
+    // the centroids of all clusterings not converged yet in a single pass over the data objects, so that a streamed
+    // dataset file is read once per iteration for all of them. Clusterings drop out of the pass as they converge.
+    // Each clustering gives the same solution as run() with the same seed and the tiled kernel, except that rows are
+    // never reordered and neither checkpoints nor race bounds apply.
+    // The clustering with the lowest objective value is selected afterwards, the earliest one on ties.
+    // Return the number of iterations of the longest clustering.
+    int runTrails(const std::vector<int> & seeds);
+    // Number of clusterings of the last runTrails()
+    int getNumberOfTrails() const;
+    // Make a clustering of the last runTrails() the current one, whose solution, objective value, iteration information,
+    // random seed and centroids are then reported and saved as those of the last clustering.
+    // Its time taken is the one of all clusterings together.
+    void selectTrail(const int & trail);
+
+    // Steps of an iteration for clustering driven from outside, e.g. by a coordinator of processes that hold
+    // shards of the data objects. The caller owns the centroids; this object assigns its own data objects.
+    // Prepare for steps with the current number of clusters: data objects are vectorized and unassigned,
+    // and every centroid and running sum is zero.
+    void prepareSteps();
+    // Set the weights and the l2-norm of a centroid from its nonzeros
+    void setCentroid(const int & cid, const int * dims, const double * weights, const int & nnz, const double & l2norm);
+    // Assignment step: find the closest centroid of each data object and move the data objects changing clusters
+    // between the running sums, without updating centroids. Sizes of clusters and the objective value are recomputed.
+    // Return the number of data objects changing clusters, or -1 if the dataset file cannot be read.
+    int assignStep();
+    // Whether data objects joined or left a cluster in the last assignment step
+    bool isClusterChanged(const int & cid) const;
+    int getClusterSize(const int & cid) const;
+    // Running sum of a cluster. A caller clearing it after each step gets the change of the sum by the next step.
+    const Eigen::VectorXd & getRunningSum(const int & cid) const;
+    void clearRunningSum(const int & cid);
+    // Move the last data object of cluster donor into cluster cid, leaving the running sums to the caller.
+    // Return the index of the data object, or -1 if donor has no data objects.
+    int movePoint(const int & donor, const int & cid);
+    // Get the normalized vector of a data object by its index
+    // Return 0 on success, 1 if there is no such data object
+    int getPointVector(const int & index, int & nnz, const int * & dims, const double * & values) const;
+    // Collect the clustering solution after the last step
+    void finishSteps();
     // Perform evaluation
     void evaluate(const std::unordered_map<std::string, std::set<int> > & class_points_map);
     // Get the total time taken of clustering in the unit of second
@@ -122,19 +492,142 @@ public:
     // Get the number of clusters whose centriods are updated, the value of objective function and
     // the time taken at each iteration
     const std::vector<std::tuple<int, double, double> > & getIterationInfo();
-    // Get a map where the key is a data object's id and the value is the id of its cluster
-    const std::unordered_map<int, int> & getEachPointCluster();
+    // Get the number of heap allocations made during each iteration
+    const std::vector<std::size_t> & getIterationAllocations();
+    // Get the number of allocations made through operator new by the calling thread so far
+    // Always 0 unless KMeans.cpp is compiled with KMEANS_ALLOCATION_COUNTER defined
+    static std::size_t getAllocationCount();
+    // Get a list where each element is the id of a data object's cluster
+    // The order of elements is the order data objects were added, see getPointIds()
+    // Removed data objects not reclaimed yet have the cluster -1
+    const std::vector<int> & getEachPointCluster();
+    // Get the ids of data objects in the order they were added
+    const std::vector<int> & getPointIds();
+    // Get the id of each collapsed data object and the id of the data object it was collapsed into, in the order they were added
+    const std::vector<std::pair<int, int> > & getCollapsedPoints();
     // Get a list of clusters
-    // where the order of each element is the id of the correpsonding cluster and
+    // where the index of each element is the id of the correpsonding cluster and
     // the value of each element is a list of the ids of all data objects who belong to the cluster
     const std::deque<std::deque<int> > & getClusters();
+    // Save the centroids of the last clustering into a binary model file
+    int saveModel(const std::string & file);
+    // Load centroids from a binary model file
+    int loadModel(const std::string & file);
+    // Get the model loaded by loadModel()
+    const Model & getModel();
+    // Write a checkpoint into file every given number of iterations and every given number of seconds during run().
+    // 0 disables a criterion and an empty file disables checkpoints. Checkpoints are written by a background thread
+    // from a copy of the state, so that iterations are not stalled by the disk.
+    // No checkpoint is written while removed data objects are not reclaimed.
+    void setCheckpoint(const std::string & file, const int & iterations, const double & seconds);
+    // Load a checkpoint written by a run on the same data objects, added in the same order.
+    // The next run() continues from the iteration where the checkpoint was written, and its random seed is set.
+    // Return 0 on success, 1 if the file cannot be opened, 2 if the file is not a valid checkpoint file
+    // The contents are checked against the data objects by run(), which starts over if they do not match
+    int loadCheckpoint(const std::string & file);
+    // Seed the centroids of run() with the centroids of the model loaded by loadModel() instead of random points.
+    // Weights of features absent from the model start at 0, and features beyond the dimension of the data are dropped.
+    // If the model has more clusters than expected, its largest clusters are used;
+    // if it has fewer, the remaining centroids are random points as usual.
+    void setWarmStart(const bool & warm_start);
+    // Compute the inner products between a sparse vector and the CENTROID_TILE centroids of a tile,
+    // where the tile stores the weights of the same dimension for its centroids adjacently
+    static void scoreTile(const int * index, const double * value, const int & nnz, const double * tile, double * similarity);
     // Output log information
     void log(const std::string & message);
 private:
+    // Vectorize the points that are not vectorized yet, appending their rows
     void _vectorizeData();
+    // Run Lloyd iterations from the current centroids until convergence, counting from the given number of
+    // iterations already done. Return the number of iterations.
+    int _iterate(const int & done = 0);
+    // Snapshot the state after the given iteration and queue it for writing
+    void _writeCheckpoint(const int & iter, const double & time_taken);
+    // Restore the state from the loaded checkpoint. Return the iteration of the checkpoint,
+    // or 0 if the checkpoint does not match the data.
+    int _applyCheckpoint();
+    // Collect the clustering solution from the assignment of rows
+    void _collectSolution();
+    // Permute the rows of vectorized points by their clusters
+    void _reorderPoints();
+    // Move each row r to the row new_row[r]
+    void _permuteRows(const std::vector<int> & new_row);
+    // Get the nonzeros of a row, read from the dataset file if points are streamed
+    void _rowEntries(const int & row, int & nnz, const int * & col, const double * & val) const;
+    // Inner product between a row and a dense vector, and adding a row to a dense vector
+    double _dotRow(const int & row, const Eigen::VectorXd & vec) const;
+    void _addRow(const int & row, Eigen::VectorXd & vec) const;
+    void _subtractRow(const int & row, Eigen::VectorXd & vec) const;
+    // Sort the tokens of a data object and normalize their values to a unit l2-norm, as rows are stored
+    static void _normalize(const int * attribute, const double * value, const int & size, std::vector<std::pair<int, double> > & entries);
+    // Hash of a normalized vector, and the normalized vector of a point
+    static std::uint64_t _hashEntries(const std::vector<std::pair<int, double> > & entries);
+    void _pointEntries(const int & p, std::vector<std::pair<int, double> > & entries) const;
+    // Remove a data object, collapsed or not, without recording it as departed
+    // Return 0 on success, 1 if no data object has the id
+    int _removeDocument(const int & id);
+    // Remove the i-th entry of _collapsed
+    void _eraseCollapsed(const std::size_t & i);
+    // Weight of the point of a row, and adding a row scaled by it to a running sum
+    double _rowWeight(const int & row) const;
+    void _addWeightedRow(const int & row, Eigen::VectorXd & sum) const;
+    void _subtractWeightedRow(const int & row, Eigen::VectorXd & sum) const;
+    // Remove the oldest points beyond the window size
+    void _expireWindow();
+    // Reclaim the storage of removed points; indices of points and rows change
+    void _compact();
+    // Recompute the running sums and the sizes of clusters from their rows, and the centroids of nonempty clusters
+    void _resetSums();
     std::deque<int> _initializeCentroids();
+    // Copy the centroids of the loaded model into the first centroids. Return the number of centroids seeded.
+    int _warmStartCentroids();
     int _assignPoints();
-    int _updateCentroids(const std::set<int> & centroid_ids);
+    // Group the rows of each cluster into _members and count the sizes of clusters
+    void _groupMembers();
+    // Score each point against the centroids of the given trails in one pass and move the points changing clusters
+    // between the running sums of each trail. Return 0 on success, or -1 if the dataset file cannot be read.
+    int _assignTrails(const std::vector<_Trail *> & trails);
+    // Score rows first to last-1 against the centroids of each trail in turn by the tiled kernel.
+    // Streamed rows are the records at data, and rows in memory are read from their storage if data is nullptr.
+    void _assignTrailBlock(const std::vector<_Trail *> & trails, const int & first, const int & last, const char * data);
+    // Exchange the state of a trail with the current clustering
+    void _swapTrail(_Trail & trail);
+    // Free the states of the trails not selected
+    void _releaseTrails();
+    // Find the closest centroid of each point using the pairwise, tiled or blocked kernel
+    void _scorePairwise();
+    void _scoreTiled();
+    void _scoreBlocked();
+    // Score the streamed points block by block and move the points changing clusters between the running sums.
+    // Return the number of points changing clusters, or -1 if the dataset file cannot be read.
+    int _assignStreamed();
+    // Pick the kernel and the block sizes for the current centroids and data
+    void _selectKernel();
+    // Size the buffers used by iterations
+    void _allocateBuffers();
+    // Size in bytes of the L1 data cache or the L2 cache
+    static std::size_t _cacheSize(const int & level);
+    int _updateCentroids();
+    // Move the last point of a donor cluster into an empty cluster and make it the centroid
+    void _reseedCentroid(const int & cid, const int & donor);
+    // Add centroids from random points of the clusters with the largest sums of dissimilarities, up to n_clusters.
+    // Return the number of centroids added, or -1 if the dataset file cannot be read.
+    int _splitClusters(const int & n_clusters);
+    // Dissimilarity of each assigned row to the centroid of its cluster, 0 for other rows
+    // Return 0 on success, 1 if the dataset file cannot be read
+    int _pointDissimilarities(std::vector<double> & dissim);
+    // Split the cluster cid holding the given rows into cid and nid by 2-means seeded from two random rows.
+    // The rows of nid are moved into new_rows, and the sums of dissimilarities of both clusters are set.
+    void _bisectCluster(const int & cid, const int & nid, std::vector<int> & rows, std::vector<int> & new_rows,
+                        double & total, double & new_total, const unsigned int & seed);
+    // 2-means over the given rows seeded from two random rows. The centroids, running sums and sizes of the two halves
+    // are set into a and b, side[i] is 1 if the i-th row goes to b, and the sums of dissimilarities of the halves are
+    // set into total_a and total_b.
+    void _bisectRows(const std::vector<int> & rows, _Centroid * a, _Centroid * b, std::vector<char> & side,
+                     double & total_a, double & total_b, const unsigned int & seed) const;
+    // Rebuild the centroid-major tiles of all centroids or of one centroid
+    void _packCentroids();
+    void _packCentroid(const int & cid);
 };
 
 #endif /* KMeans_hpp */
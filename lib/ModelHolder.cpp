@@ -0,0 +1,89 @@
+//
+//  ModelHolder.cpp
+//  K-means Clustering
+//
+
+#include "ModelHolder.hpp"
+
+#include <thread>
+#include <chrono>
+
+const int ModelHolder::MAX_READERS;
+
+ModelHolder::ModelHolder() : _current(nullptr), _epoch(1)
+{
+    for (auto & slot : this->_slots)
+    {
+        slot.epoch = 0;
+        slot.used = false;
+    }
+}
+
+ModelHolder::~ModelHolder()
+{
+    delete this->_current.load();
+}
+
+int ModelHolder::load(const std::string & file)
+{
+    // The file is opened outside of the publication so that readers keep scoring meanwhile
+    CentroidModel * model = new CentroidModel;
+    int result = model->open(file);
+    if (result != 0)
+    {
+        delete model;
+        return result;
+    }
+    this->publish(model);
+    return 0;
+}
+
+void ModelHolder::publish(CentroidModel * model)
+{
+    std::lock_guard<std::mutex> lock(this->_writer_mutex);
+    CentroidModel * old = this->_current.exchange(model);
+    const std::uint64_t epoch = ++this->_epoch;
+
+    // Readers that pinned before the new epoch may still use the old model
+    std::uint64_t seen;
+    for (auto & slot : this->_slots)
+    {
+        while ((seen = slot.epoch.load()) != 0 && seen < epoch)
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+    delete old;
+}
+
+std::uint64_t ModelHolder::version() const
+{
+    return this->_epoch.load() - 1;
+}
+
+int ModelHolder::registerReader()
+{
+    bool expected;
+    for (int i = 0; i < MAX_READERS; ++i)
+    {
+        expected = false;
+        if (this->_slots[i].used.compare_exchange_strong(expected, true))
+            return i;
+    }
+    return -1;
+}
+
+void ModelHolder::unregisterReader(const int & slot)
+{
+    this->_slots[slot].epoch = 0;
+    this->_slots[slot].used = false;
+}
+
+const CentroidModel * ModelHolder::pin(const int & slot)
+{
+    this->_slots[slot].epoch.store(this->_epoch.load());
+    return this->_current.load();
+}
+
+void ModelHolder::unpin(const int & slot)
+{
+    this->_slots[slot].epoch.store(0);
+}
@@ -0,0 +1,60 @@
+//
+//  ModelHolder.hpp
+//  K-means Clustering
+//
+//  Publication of centroid models to concurrent readers in an epoch-based way:
+//  a new model is swapped in atomically, readers are never blocked, and the
+//  old model is freed by the writer once no reader can still be using it.
+//
+//  Each reading thread registers a slot. Pinning stores the current epoch in the slot
+//  before loading the model pointer; unpinning clears it. After swapping the pointer,
+//  the writer advances the epoch and waits until every slot is either clear or has
+//  observed the new epoch, then deletes the old model.
+//
+
+#ifndef ModelHolder_hpp
+#define ModelHolder_hpp
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <cstdint>
+
+#include "CentroidModel.hpp"
+
+class ModelHolder {
+
+public:
+    static const int MAX_READERS = 64;
+
+    ModelHolder();
+    ~ModelHolder();
+    // Open a model file and publish it
+    // Return the value of CentroidModel::open(). The published model is unchanged on failure.
+    int load(const std::string & file);
+    // Publish a model and take its ownership. Return after the previous model is freed.
+    void publish(CentroidModel * model);
+    // Get the number of models published
+    std::uint64_t version() const;
+
+    // Register the calling thread as a reader. Return the slot of the reader, or -1 if all slots are taken.
+    int registerReader();
+    void unregisterReader(const int & slot);
+    // Get the current model, which stays valid until unpin() is called with the same slot. It may be nullptr.
+    const CentroidModel * pin(const int & slot);
+    void unpin(const int & slot);
+
+private:
+    struct alignas(64) _Slot
+    {
+        std::atomic<std::uint64_t> epoch;   // epoch seen by the pinning reader, 0 if not pinned
+        std::atomic<bool> used;
+    };
+
+    std::atomic<CentroidModel *> _current;
+    std::atomic<std::uint64_t> _epoch;
+    _Slot _slots[MAX_READERS];
+    std::mutex _writer_mutex;           // one writer at a time
+};
+
+#endif /* ModelHolder_hpp */
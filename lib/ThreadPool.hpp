@@ -0,0 +1,99 @@
+//
+//  ThreadPool.hpp
+//  K-means Clustering
+//
+//  A fixed-size pool of worker threads running submitted tasks in FIFO order
+//
+
+#ifndef ThreadPool_hpp
+#define ThreadPool_hpp
+
+#include <vector>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+class ThreadPool {
+
+public:
+    // Start the given number of worker threads. 0 means one thread per hardware thread.
+    ThreadPool(int n_threads = 0)
+    {
+        if (n_threads < 1)
+            n_threads = std::thread::hardware_concurrency();
+        if (n_threads < 1)
+            n_threads = 1;
+        for (int i = 0; i < n_threads; ++i)
+            this->_workers.emplace_back(&ThreadPool::_work, this);
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(this->_mutex);
+            this->_stopping = true;
+        }
+        this->_task_ready.notify_all();
+        for (auto & w : this->_workers)
+            w.join();
+    }
+
+    // Number of worker threads
+    int size() const
+    {
+        return this->_workers.size();
+    }
+
+    // Queue a task
+    void submit(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(this->_mutex);
+            this->_tasks.push_back(std::move(task));
+            this->_pending++;
+        }
+        this->_task_ready.notify_one();
+    }
+
+    // Block until all submitted tasks are finished
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(this->_mutex);
+        this->_all_done.wait(lock, [this]{ return this->_pending == 0; });
+    }
+
+private:
+    std::vector<std::thread> _workers;
+    std::deque<std::function<void()> > _tasks;
+    std::mutex _mutex;
+    std::condition_variable _task_ready;
+    std::condition_variable _all_done;
+    int _pending = 0;           // queued and running tasks
+    bool _stopping = false;
+
+    void _work()
+    {
+        std::function<void()> task;
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(this->_mutex);
+                this->_task_ready.wait(lock, [this]{ return this->_stopping || !this->_tasks.empty(); });
+                if (this->_tasks.empty())
+                    return;
+                task = std::move(this->_tasks.front());
+                this->_tasks.pop_front();
+            }
+            task();
+            {
+                std::lock_guard<std::mutex> lock(this->_mutex);
+                if (--this->_pending == 0)
+                    this->_all_done.notify_all();
+            }
+        }
+    }
+};
+
+#endif /* ThreadPool_hpp */
@@ -14,8 +14,27 @@
 #include <deque>
 #include <limits>
 #include <locale>
+#include <ctime>
+#include <chrono>
+#include <functional>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <csignal>
+#include <iomanip>
+#include <algorithm>
+#include <set>
+#include <mutex>
+#include <random>
+#include <cstdio>
 
 #include "lib/KMeans.hpp"
+#include "lib/Dataset.hpp"
+#include "lib/Distributed.hpp"
+#include "lib/CentroidModel.hpp"
+#include "lib/ClusterServer.hpp"
+#include "lib/ModelHolder.hpp"
+#include "lib/ThreadPool.hpp"
 
 void show_help()
 {
@@ -26,9 +45,80 @@ void show_help()
     std::cout << "    (3) clusters: the number of clusters that are hoped to obtain.\n";
     std::cout << "    (4) trails: the times the clustering needs to be conducted. Best solution of the multiple clustering results will be obtained. If this parameter is provided, then the program will use odd numbers from 1 as the random seed to generate initial centroids so that when this parameter is provided, you will always get the same clustering solution for the same trails if the input-file does not change. This is not a must-have parameter\n";
     std::cout << "    (5) output-file: This file is the file that contains the clustering result. Each line of the file has two integer elements. The first element is the id of a document, while the second element is the id of the cluster into which the document is assigned.\n\n";
+    std::cout << "  Options can be placed anywhere among the parameters:\n";
+    std::cout << "    --release-raw: free the parsed documents once they are vectorized.\n";
+    std::cout << "    --save-model=FILE: save the centroids of the best clustering solution into a binary model file.\n";
+    std::cout << "    --warm-start=FILE: start from the centroids of a model file saved by --save-model instead of random documents, e.g. to recluster a slightly changed dataset in a few iterations. Tokens new to the model start with a weight of 0. If the model has more clusters than expected, its largest clusters are used; if it has fewer, the other clusters start from random documents.\n";
+    std::cout << "    --tolerance=X: also stop once an iteration improves the objective by less than the fraction X of it, e.g. 0.0001.\n";
+    std::cout << "    --checkpoint=FILE: write the state of the clustering into FILE every 10 iterations, or as given by --checkpoint-every=N iterations and/or --checkpoint-seconds=S seconds. Checkpoints are written in the background.\n";
+    std::cout << "    --resume=FILE: continue the clustering saved in a checkpoint file, with the same input-file and clusters. If trails are given, the trails before the one of the checkpoint are skipped.\n";
+    std::cout << "    --stream[=MB]: input-file is a dataset file written by 'sphkmeans pack'. Instead of being loaded into memory, it is read from disk on each iteration in blocks of MB megabytes (default 64), while the next block is read ahead in the background. Only the centroids and the cluster of each document are kept in memory. The time spent on reading and on waiting for reads is reported for each iteration.\n";
+    std::cout << "    --shared=FILE: vectorize input-file into a dataset file FILE, e.g. in /dev/shm, unless FILE already is one, and cluster FILE mapped into memory read-only as with --stream, instead of loading input-file. Concurrent and later runs with the same FILE skip reading input-file and share a single copy of the dataset in memory. Remove FILE after input-file changes.\n";
+    std::cout << "    --race[=MARGIN]: abandon a trail once its objective value exceeds the best final value of the finished trails by more than the largest improvement any finished trail made from the same iteration to its end, enlarged by the fraction MARGIN (default 0.5). Abandoned trails are not evaluated. A larger MARGIN abandons fewer trails, later.\n";
+    std::cout << "    --bisect[=THREADS]: build the clusters of each trail by bisecting instead: starting from one cluster of all documents, the clusters with the largest sums of dissimilarities are split into two by 2-means over their own documents until there are as many clusters as expected, so that a document is only compared with two centroids per split of its cluster. Each round splits the THREADS worst clusters at once on separate threads (default one per hardware thread); the solution depends on THREADS. With --hierarchy=FILE, the splits of the best trail are written into FILE, one node per line: id, parent, left child, right child, cluster (-1 if split), number of documents and sum of dissimilarities, where node 0 holds all documents and -1 means none. --race does not apply.\n";
+    std::cout << "    --auto-k[=MAX]: choose the number of clusters of each trail in the style of X-means, starting from clusters: after each clustering, every cluster is split on trial by 2-means over its own documents, all of them at once over the number of threads given by --threads=N (default one per hardware thread), the splits that pay off are taken, and the iterations continue, until no split pays off or there are MAX clusters (default 4 times clusters). A split of a cluster of n documents pays off if n log(sum of dissimilarities before / sum after) exceeds PENALTY log(n), given by --split-penalty=PENALTY (default 3; 1 is BIC, which keeps splitting documents). The chosen number of clusters is printed after each trail. --race does not apply.\n";
+    std::cout << "    --coreset[=SIZE]: cluster a coreset in each trail instead of all documents: after a rough clustering by one assignment to random initial centroids, SIZE documents (default 100 times clusters, at least clusters) are drawn by their shares of the objective value and of their clusters, and weighted by the inverse of their probabilities. The centroids of the weighted coreset are then used to assign all documents in a single pass, whose objective value is reported. --race does not apply.\n";
+    std::cout << "    --collapse-duplicates: collapse each document whose normalized vector equals the one of an earlier document into that document, which is then weighted by the number of documents it stands for in the centroids and the objective value. Collapsed documents are written at the end of output-file in the clusters of the documents they were collapsed into, and are evaluated with their own classes. Only for documents loaded from input-file into memory.\n";
+    std::cout << "    --sweep=LIST: after each trail, grow its solution into each larger number of clusters in the comma-separated LIST, in ascending order, by splitting the clusters with the largest sums of dissimilarities and continuing the iterations, so that each number of clusters converges in a few iterations. The objective value of the best trail per number of clusters is reported at the end, e.g. to find an elbow, and the best solution for K clusters is written into output-file.K.\n";
+    std::cout << "    --lockstep: run all trails at once, so that each iteration scores every document against the centroids of all trails not converged yet in a single pass over the documents, e.g. to read a dataset file given by --stream or --shared once per iteration for all trails. Trails drop out of the pass as they converge and give the same solutions as when run one after another. Documents are not reordered, and --checkpoint and --race do not apply.\n";
+    std::cout << "    --reorder=N: permute the stored documents every N iterations so that documents of the same cluster are adjacent in memory.\n\n";
+    std::cout << "  Run the program as 'sphkmeans pack input-file dataset-file' to write the documents in input-file, vectorized, into a binary dataset file for --stream. input-file is read line by line, so that it does not need to fit in memory.\n\n";
+    std::cout << "  Run the program as 'sphkmeans grid class-file output-folder clusters trails data-file [data-file ...]' to run the clusterings of run.sh in one process: for each data-file and each number of clusters in the comma-separated list clusters, the given trails (or the comma-separated random seeds of --seeds=LIST) are run, and the log and the best solution are written into output-folder as log_K_NAME_TIME and result_K_NAME_TIME, where NAME is the name of data-file without extension. class-file may be '-' for no evaluation. Each data-file is read and vectorized once into a dataset file in output-folder, or in the folder given by --shared-dir=DIR, which all its trails map as with --shared and which is removed at the end. Trails run in parallel over the number of threads given by --threads=N (default one per hardware thread), the largest ones first. --tolerance and --race work as for clustering, racing against the finished trails of the same data-file and number of clusters.\n\n";
+    std::cout << "  Run the program as 'sphkmeans coordinate address workers clusters output-file [trails]' to cluster a dataset file written by 'sphkmeans pack' with the given number of worker processes, each holding a shard of it, started as 'sphkmeans worker dataset-file address [block-MB]' on the same or other machines with the same byte order. A block-MB of 0 maps dataset-file into memory as with --shared. address is 'host:port' for TCP or the path of a Unix domain socket. Workers stream their shards from disk as with --stream and, on each iteration, send the coordinator only the changes of the sums and sizes of clusters over their shards. trails and --tolerance work as for clustering, and the same random seeds give the same initial centroids as a clustering of the whole dataset file. The time taken by the slowest worker, the time spent on communication and the bytes exchanged are reported for each iteration.\n\n";
+    std::cout << "  Run the program as 'sphkmeans model model-file' to show the information of a model file saved by --save-model.\n\n";
+    std::cout << "  Run the program as 'sphkmeans predict model-file input-file output-file [threads]' to assign the documents in input-file to the clusters of a model file saved by --save-model, without clustering. input-file has the same form as for clustering. Each line of output-file has the id of a document, the id of its cluster and the cosine similarity between the document and the centroid of the cluster, separated by commas. The cluster id is -1 if the document shares no tokens with the centroids. Documents are processed in parallel by the given number of threads, by default one per hardware thread.\n\n";
+    std::cout << "  Run the program as 'sphkmeans serve model-file socket-path [max-batch] [max-wait-us] [threads]' to load a model file once and assign documents sent to a Unix domain socket at socket-path, or read from the standard input if socket-path is '-'. Each request is a line in the same form as a line of input-file, and is answered by a line in the same form as a line of the output of 'predict'. Requests are scored in batches of at most max-batch documents (default 64), and a request waits at most max-wait-us microseconds (default 200) for other requests to join its batch. At most 256 connections are served at a time, and further clients wait until one is closed. Batches are scored by the given number of threads (default 1). Latency percentiles are reported every 10 seconds and when the server is stopped by SIGINT or SIGTERM. On SIGHUP, model-file is loaded again and swapped in without interrupting requests; replace the file by renaming a new one onto it rather than rewriting it in place.\n\n";
+    std::cout << "  Run the program as 'sphkmeans client socket-path input-file [connections]' to send the documents in input-file to a server, one request at a time per connection (default 1). Responses are written to the standard output and latency percentiles to the standard error.\n\n";
+    std::cout << "  Run the program as 'sphkmeans bench input-file clusters [trails]' to compare the time per iteration taken by the kernels available for the assignment step. Each kernel runs the same trails with the same random seeds.\n\n";
     std::cout << "  Run data.py under python 3 environment to obtain a set of input and class files from the reuters21578 dataset, while each input file has the extension '.csv' and the class file has the extensin '.class' and each of the extracted tokens are in the file whose extension is '.clabel'. In the '.clabel' files, each line is a token and the line number is the number that represents the token. E.G. if the 5th line is 'abc', then the number that represents the word 'abc' in the '.csv' file is 5.\n" << std::endl;
 }
 
+int parse_entry(std::string & entry, int & id, std::vector<int> & attribute, std::vector<double> & value)
+{
+    // Each entry is in the following format
+    //      id,"token1,token2","frequency1,frequency2"
+    // Return 0 if the entry is parsed, -1 if it is an empty line, 1 if no tokens are found
+    auto remove_space = []( char c ) { return std::isspace<char>( c, std::locale::classic() ); };
+    entry.erase(std::remove_if(
+        entry.begin(), entry.end(), remove_space
+    ), entry.end());
+
+    // Obtain the document id
+    size_t end = entry.find_first_of(',');
+    if (end == std::string::npos)      // Empty line
+        return -1;
+    id = std::atoi(entry.c_str());
+
+    // Obtain the tokens
+    size_t start = end+2;
+    end = entry.find_first_of('"', start);
+    if (start > entry.size() || end == std::string::npos)
+        return 1;
+    char * next;
+    const char * ptr = entry.c_str() + start;
+    const char * stop = entry.c_str() + end;
+    attribute.clear();
+    while (ptr < stop)
+    {
+        attribute.push_back(std::strtol(ptr, &next, 10));
+        ptr = next + 1;
+    }
+
+    // Obtain the frequencies
+    value.clear();
+    if (end + 3 < entry.size())
+    {
+        ptr = entry.c_str() + end + 3;
+        stop = entry.c_str() + entry.size();
+        while (ptr < stop && *ptr != '"')
+        {
+            value.push_back(std::strtod(ptr, &next));
+            ptr = next + 1;
+        }
+    }
+    return 0;
+}
+
 int load_data_file(const char * data_file, KMeans * cluster)
 {
     // Open data file
@@ -49,86 +139,45 @@ int load_data_file(const char * data_file, KMeans * cluster)
     // Parse contents
     std::istringstream cont_stream(contents);
     std::string entry;
-    size_t start, end;
-    size_t sub_start, sub_end;
-    std::string substring;
     int result, id;
-    int added = 0;
-    std::deque<int> attribute;
-    std::deque<double> value;
-    auto remove_space = []( char c ) { return std::isspace<char>( c, std::locale::classic() ); };
+    int added = 0, collapsed = 0;
+    std::vector<int> attribute;
+    std::vector<double> value;
     while (std::getline(cont_stream, entry))
     {
-        entry.erase(std::remove_if(
-            entry.begin(), entry.end(), remove_space
-        ), entry.end());
-
-        // Each entry is in the following format
-        //      id,"token1,token2","frequency1,frequency2"
-        entry.pop_back();
-
-        // Obtain the document id
-        end = entry.find_first_of(',');
-        if (end == std::string::npos)      // Empty line
+        result = parse_entry(entry, id, attribute, value);
+        if (result == -1)
             continue;
-
-        id = std::atoi(entry.substr(0, end).c_str());
-
-        // Obtain the tokens
-        start = end+2;
-        end = entry.find_first_of('"', start);
-        if (end != std::string::npos)
+        if (result == 1)
         {
-            substring = entry.substr(start, end-start);
-            sub_start = 0;
-            sub_end   = substring.find_first_of(',');
-            attribute.clear();
-            while (sub_end <= std::string::npos)
-            {
-                attribute.push_front( std::atoi(substring.substr(sub_start, sub_end).c_str()) );
-                if (sub_end == std::string::npos)
-                    break;
-                sub_start = sub_end + 1;
-                sub_end = substring.find_first_of(',', sub_start);
-            }
-
-            // Obtain the frequencies
-            substring = entry.substr(end+3);
-            sub_start = 0;
-            sub_end   = substring.find_first_of(',');
-            value.clear();
-            if (id == 0)
-              std::cout << substring << std::endl;
-            while (sub_end <= std::string::npos)
-            {
-                value.push_front( std::atoi(substring.substr(sub_start, sub_end).c_str()) );
-                if (sub_end == std::string::npos)
-                    break;
-                sub_start = sub_end + 1;
-                sub_end = substring.find_first_of(',', sub_start);
-            }
-            result = cluster->addDataPoint(id, attribute, value);
-            switch (result)
-            {
-                case 0:
-                    added++;
-                    break;
-                case 2:
-                    std::cerr << "Ignore invaild Document. ID: " << id << ". Unmatched tokens with frequencies." << std::endl;
-                    break;
-                case 3:
-                    std::cerr << "Ignore invaild Document. ID: " << id << ". Repeated document." << std::endl;
-                    break;
-                // case 1:
-                //    std::cerr << "Ignore invaild Document. ID: " << doc->id << ". No tokens found." << std::endl;
-                // Impossible to happen in this case, see below, such error has been filtered out.
-            }
+            std::cerr << "Ignore invaild Document. ID: " << id << ". No tokens." << std::endl;
+            continue;
         }
+        if (attribute.size() != value.size())
+            result = 2;
         else
+            result = cluster->addDataPoint(id, attribute.data(), value.data(), attribute.size());
+        switch (result)
         {
-            std::cerr << "Ignore invaild Document. ID: " << id << ". No tokens." << std::endl;
+            case 0:
+                added++;
+                break;
+            case 2:
+                std::cerr << "Ignore invaild Document. ID: " << id << ". Unmatched tokens with frequencies." << std::endl;
+                break;
+            case 3:
+                std::cerr << "Ignore invaild Document. ID: " << id << ". Repeated document." << std::endl;
+                break;
+            case 5:
+                collapsed++;
+                break;
+            // case 1:
+            //    std::cerr << "Ignore invaild Document. ID: " << doc->id << ". No tokens found." << std::endl;
+            // Impossible to happen in this case, see above, such error has been filtered out.
         }
     }
+    if (collapsed > 0)
+        std::clog << "Collapsed " << collapsed << " duplicated documents into " << added << " weighted documents." << std::endl;
     return added;
 }
 
@@ -185,6 +234,850 @@ std::unordered_map<std::string, std::set<int> > load_classfication_file(const ch
     return topic_docs_map;
 }
 
+std::vector<double> race_bounds(const std::vector<std::vector<double> > & trajectories, const double & margin)
+{
+    // A trail is hopeless once its objective value exceeds the best final value by more than the largest
+    // improvement any finished trail made from the same iteration to its end, enlarged by the margin.
+    // A finished trajectory keeps its final value after its last iteration.
+    std::vector<double> bounds;
+    double best = std::numeric_limits<double>::infinity();
+    std::size_t length = 0;
+    for (auto & t : trajectories)
+    {
+        best = std::min(best, t.back());
+        length = std::max(length, t.size());
+    }
+    bounds.resize(length);
+    double improvement;
+    for (std::size_t i = 0; i < length; ++i)
+    {
+        improvement = 0;
+        for (auto & t : trajectories)
+            improvement = std::max(improvement, t[std::min(i, t.size() - 1)] - t.back());
+        bounds[i] = best + (1 + margin)*improvement;
+    }
+    return bounds;
+}
+
+std::vector<double> objective_trajectory(KMeans & cluster)
+{
+    std::vector<double> trajectory;
+    for (auto & info : cluster.getIterationInfo())
+        trajectory.push_back(std::get<1>(info));
+    return trajectory;
+}
+
+int parse_options(int argc, char * argv[], std::unordered_map<std::string, std::string> & options)
+{
+    // Options are in the form of --name=value or --name and can be placed anywhere.
+    // They are removed from argv so that the remaining parameters keep their positions.
+    int n = 1;
+    std::string arg;
+    size_t pos;
+    for (int i = 1; i < argc; ++i)
+    {
+        arg = argv[i];
+        if (arg.size() > 2 && arg.compare(0, 2, "--") == 0)
+        {
+            pos = arg.find_first_of('=');
+            if (pos == std::string::npos)
+                options[arg.substr(2)] = "";
+            else
+                options[arg.substr(2, pos-2)] = arg.substr(pos+1);
+        }
+        else
+        {
+            argv[n++] = argv[i];
+        }
+    }
+    return n;
+}
+
+std::vector<int> parse_list(const std::string & list)
+{
+    // Comma-separated integers, e.g. the value of an option
+    std::vector<int> values;
+    std::istringstream stream(list);
+    std::string value;
+    while (std::getline(stream, value, ','))
+        if (!value.empty())
+            values.push_back(std::atoi(value.c_str()));
+    return values;
+}
+
+void write_solution(std::ostream & output, const std::vector<int> & ids, const std::vector<int> & solution,
+                    const std::vector<std::pair<int, int> > & collapsed)
+{
+    // One line per document: id, cluster. Documents collapsed into others follow, in the clusters of those.
+    for (std::size_t d = 0; d < solution.size(); ++d)
+        output << ids[d] << "," << solution[d] << "\n";
+    if (collapsed.empty())
+        return;
+    std::unordered_map<int, int> index;
+    for (std::size_t d = 0; d < solution.size(); ++d)
+        index[ids[d]] = d;
+    for (auto & c : collapsed)
+    {
+        auto kept = index.find(c.second);
+        output << c.first << "," << (kept == index.end() ? -1 : solution[kept->second]) << "\n";
+    }
+}
+
+void pack_documents(std::istream & input, Dataset::Writer & writer);
+
+int pack_dataset(int argc, char * argv[])
+{
+    // sphkmeans pack input-file dataset-file
+    if (argc < 4)
+    {
+        std::cerr << "Program Stopped." << std::endl;
+        std::cerr << "Error: Wrong Number of Parameters were given." << std::endl;
+        std::cerr << "Run the program without any paramter to see help information" << std::endl;
+        throw ;
+    }
+    std::ifstream input(argv[2]);
+    if (input.fail())
+    {
+        std::cerr << "Program Stopped." << std::endl;
+        std::cerr << "Error: Unable to Open the Input File. " << argv[2] << std::endl;
+        throw;
+    }
+    Dataset::Writer writer;
+    if (writer.open(argv[3]) != 0)
+    {
+        std::cerr << "Program Stopped." << std::endl;
+        std::cerr << "Error: Unable to open the output file." << argv[3] << std::endl;
+        throw;
+    }
+
+    pack_documents(input, writer);
+    if (writer.close() != 0)
+    {
+        std::cerr << "Program Stopped." << std::endl;
+        std::cerr << "Error: Unable to write the dataset file." << argv[3] << std::endl;
+        throw;
+    }
+    std::cout << "Packed " << writer.size() << " documents into " << argv[3] << "." << std::endl;
+    return 0;
+}
+
+void pack_documents(std::istream & input, Dataset::Writer & writer)
+{
+    // The input file is read line by line so that it never needs to fit in memory
+    std::string entry;
+    int result, id;
+    std::vector<int> attribute;
+    std::vector<double> value;
+    while (std::getline(input, entry))
+    {
+        result = parse_entry(entry, id, attribute, value);
+        if (result == -1)
+            continue;
+        if (result == 1 || attribute.empty())
+        {
+            std::cerr << "Ignore invaild Document. ID: " << id << ". No tokens." << std::endl;
+            continue;
+        }
+        if (attribute.size() != value.size())
+        {
+            std::cerr << "Ignore invaild Document. ID: " << id << ". Unmatched tokens with frequencies." << std::endl;
+            continue;
+        }
+        if (writer.add(id, attribute.data(), value.data(), attribute.size()) == 3)
+            std::cerr << "Ignore invaild Document. ID: " << id << ". Repeated document." << std::endl;
+    }
+}
+
+void publish_dataset(const char * input_file, const std::string & shared_file)
+{
+    // Published once: later processes find a valid dataset file and only map it
+    Dataset::Header header;
+    if (Dataset::readHeader(shared_file, header) == 0)
+        return;
+    std::ifstream input(input_file);
+    if (input.fail())
+    {
+        std::cerr << "Program Stopped." << std::endl;
+        std::cerr << "Error: Unable to Open the Input File. " << input_file << std::endl;
+        throw;
+    }
+    // The file is written under a temporary name and renamed onto shared_file, so that processes
+    // publishing at the same time never see an incomplete file
+    const std::string tmp = shared_file + "." + std::to_string(std::random_device()()) + ".tmp";
+    Dataset::Writer writer;
+    if (writer.open(tmp) != 0)
+    {
+        std::cerr << "Program Stopped." << std::endl;
+        std::cerr << "Error: Unable to open the output file." << tmp << std::endl;
+        throw;
+    }
+    pack_documents(input, writer);
+    if (writer.close() != 0 || std::rename(tmp.c_str(), shared_file.c_str()) != 0)
+    {
+        std::remove(tmp.c_str());
+        std::cerr << "Program Stopped." << std::endl;
+        std::cerr << "Error: Unable to write the dataset file." << shared_file << std::endl;
+        throw;
+    }
+    std::cout << "Published " << writer.size() << " documents into " << shared_file << "." << std::endl;
+}
+
+int run_coordinator(int argc, char * argv[], std::unordered_map<std::string, std::string> & options)
+{
+    // sphkmeans coordinate address workers clusters output-file [trails]
+    if (argc < 6)
+    {
+        std::cerr << "Program Stopped." << std::endl;
+        std::cerr << "Error: Wrong Number of Parameters were given." << std::endl;
+        std::cerr << "Run the program without any paramter to see help information" << std::endl;
+        throw ;
+    }
+    const int n_workers = std::atoi(argv[3]);
+    const int n_clusters = std::atoi(argv[4]);
+    const int n_trails = argc > 6 ? std::atoi(argv[6]) : 0;
+    if (n_workers < 1 || n_clusters < 1)
+    {
+        std::cerr << "Program Stopped." << std::endl;
+        std::cerr << "Error: The numbers of workers and clusters should be positive." << std::endl;
+        throw;
+    }
+    std::ofstream output(argv[5]);
+    if (output.fail())
+    {
+        std::cerr << "Program Stopped." << std::endl;
+        std::cerr << "Error: Unable to open the output file." << argv[5] << std::endl;
+        throw;
+    }
+    ShardCoordinator coordinator;
+    coordinator.setLogStream(&std::clog);
+    if (options.count("tolerance"))
+        coordinator.setTolerance(std::atof(options["tolerance"].c_str()));
+    int result = coordinator.accept(argv[2], n_workers);
+    if (result != 0)
+    {
+        std::cerr << "Program Stopped." << std::endl;
+        if (result == 1)
+            std::cerr << "Error: Unable to listen on the address. " << argv[2] << std::endl;
+        else
+            std::cerr << "Error: A worker was unable to open its shard, or the workers hold different dataset files." << std::endl;
+        throw;
+    }
+    if (coordinator.getNumberOfPoints() < 2)
+    {
+        std::cerr << "Program Stopped." << std::endl;
+        std::cerr << "Error: Less than 2 data objects added. Unable to perform clustering." << std::endl;
+        throw;
+    }
+
+    std::vector<int> seeds;
+    if (n_trails < 1)
+        seeds.push_back(KMeans::UNASSIGNED_RANDOM_SEED_FLAG);
+    for (int i = 0; i < n_trails; ++i)
+        seeds.push_back(2*i+1);
+    std::vector<int> ids, solution;
+    double obj_val = std::numeric_limits<double>::infinity();
+    for (std::size_t i = 0; i < seeds.size(); ++i)
+    {
+        std::cout << "Parameters:\n  # of Clusters: " << n_clusters << "\n  # of Tails: " << i+1 << "/" << seeds.size() << "\n  Random Seed: ";
+        if (seeds[i] == KMeans::UNASSIGNED_RANDOM_SEED_FLAG)
+            std::cout << "undefined";
+        else
+            std::cout << seeds[i];
+        std::cout << "\n  Workers: " << n_workers << "\n  Data Objects: " << coordinator.getNumberOfPoints() << "\n  Output File: " << argv[5] << "\n" << std::endl;
+        // Assignments are only collected from the workers when a trail improves the objective
+        if (coordinator.run(n_clusters, seeds[i]) < 0
+            || (obj_val > coordinator.getObjValue() && coordinator.collect(ids, solution) != 0))
+        {
+            std::cerr << "Program Stopped." << std::endl;
+            std::cerr << "Error: Lost the connection to a worker." << std::endl;
+            throw;
+        }
+        obj_val = std::min(obj_val, coordinator.getObjValue());
+    }
+    coordinator.stop();
+
+    for (std::size_t d = 0; d < solution.size(); ++d)
+        output << ids[d] << "," << solution[d] << "\n";
+    output.close();
+    return 0;
+}
+
+int run_worker(int argc, char * argv[])
+{
+    // sphkmeans worker dataset-file address [block-MB]
+    if (argc < 4)
+    {
+        std::cerr << "Program Stopped." << std::endl;
+        std::cerr << "Error: Wrong Number of Parameters were given." << std::endl;
+        std::cerr << "Run the program without any paramter to see help information" << std::endl;
+        throw ;
+    }
+    // A block size of 0 maps the file into memory as with --shared
+    const double block_mb = argc > 4 && std::atof(argv[4]) >= 0 ? std::atof(argv[4]) : 64;
+    ShardWorker worker;
+    worker.setLogStream(&std::clog);
+    switch (worker.serve(argv[2], block_mb*1024*1024, argv[3]))
+    {
+        case 0:
+            return 0;
+        case 1:
+            std::cerr << "Program Stopped." << std::endl;
+            std::cerr << "Error: Unable to connect to the coordinator. " << argv[3] << std::endl;
+            throw;
+        case 2:
+            std::cerr << "Program Stopped." << std::endl;
+            std::cerr << "Error: Unable to open the shard of the dataset file. " << argv[2] << std::endl;
+            throw;
+        default:
+            std::cerr << "Program Stopped." << std::endl;
+            std::cerr << "Error: Lost the connection to the coordinator." << std::endl;
+            throw;
+    }
+}
+
+int run_grid(int argc, char * argv[], std::unordered_map<std::string, std::string> & options)
+{
+    // sphkmeans grid class-file output-folder clusters trails data-file [data-file ...]
+    if (argc < 7)
+    {
+        std::cerr << "Program Stopped." << std::endl;
+        std::cerr << "Error: Wrong Number of Parameters were given." << std::endl;
+        std::cerr << "Run the program without any paramter to see help information" << std::endl;
+        throw ;
+    }
+    const std::string class_file(argv[2]);
+    const std::string output_folder(argv[3]);
+    const std::vector<int> clusters = parse_list(argv[4]);
+    std::vector<int> seeds;
+    if (options.count("seeds"))
+        seeds = parse_list(options["seeds"]);
+    else
+        for (int i = 0; i < std::atoi(argv[5]); ++i)
+            seeds.push_back(2*i+1);
+    std::vector<std::string> data_files(argv + 6, argv + argc);
+    if (clusters.empty() || seeds.empty() || *std::min_element(clusters.begin(), clusters.end()) < 1)
+    {
+        std::cerr << "Program Stopped." << std::endl;
+        std::cerr << "Error: No clusters or random seeds were given." << std::endl;
+        throw;
+    }
+
+    // Each dataset is vectorized once into a dataset file, which every job maps read-only
+    std::unordered_map<std::string, std::set<int> > topic_docs_map;
+    if (class_file != "-")
+        topic_docs_map = load_classfication_file(class_file.c_str());
+    const std::string shared_dir = options.count("shared-dir") ? options["shared-dir"] : output_folder;
+    std::vector<std::string> names, packed_files;
+    std::vector<std::int64_t> sizes;
+    Dataset::Header header;
+    for (auto & file : data_files)
+    {
+        std::size_t begin = file.find_last_of("/\\");
+        begin = begin == std::string::npos ? 0 : begin + 1;
+        names.push_back(file.substr(begin, file.find_last_of('.') > begin ? file.find_last_of('.') - begin : std::string::npos));
+        packed_files.push_back(shared_dir + "/sphkmeans_grid_" + names.back() + "_" + std::to_string(std::random_device()()) + ".dat");
+        publish_dataset(file.c_str(), packed_files.back());
+        if (Dataset::readHeader(packed_files.back(), header) != 0 || header.n_points < 2)
+        {
+            std::cerr << "Program Stopped." << std::endl;
+            std::cerr << "Error: Less than 2 data objects added. Unable to perform clustering." << file << std::endl;
+            throw;
+        }
+        sizes.push_back(header.nnz);
+    }
+
+    // Output files are named as by run.sh, one log and one result per dataset and number of clusters
+    char suffix[32];
+    std::time_t now = std::time(nullptr);
+    std::strftime(suffix, sizeof(suffix), "%H-%M-%S_%m-%d-%Y", std::localtime(&now));
+    struct Group
+    {
+        std::string log_file, result_file;
+        std::vector<std::string> logs;      // of each trail
+        std::vector<std::vector<double> > trajectories;     // of finished trails, for racing
+        int remaining;
+        int best_trail = -1;
+        double obj_val = std::numeric_limits<double>::infinity();
+        std::vector<int> ids, solution;
+    };
+    struct Job
+    {
+        int group, dataset, n_clusters, trail;
+        double cost;
+    };
+    std::vector<Group> groups;
+    std::vector<Job> jobs;
+    for (auto k : clusters)
+    {
+        for (std::size_t d = 0; d < data_files.size(); ++d)
+        {
+            Group group;
+            group.log_file = output_folder + "/log_" + std::to_string(k) + "_" + names[d] + "_" + suffix;
+            group.result_file = output_folder + "/result_" + std::to_string(k) + "_" + names[d] + "_" + suffix;
+            group.logs.resize(seeds.size());
+            group.remaining = seeds.size();
+            groups.push_back(std::move(group));
+            for (std::size_t t = 0; t < seeds.size(); ++t)
+                jobs.push_back({(int)groups.size() - 1, (int)d, k, (int)t, (double)sizes[d]*k});
+        }
+    }
+    // The largest jobs start first so that no long job is left running alone at the end
+    std::stable_sort(jobs.begin(), jobs.end(), [](const Job & a, const Job & b) { return a.cost > b.cost; });
+
+    const bool race = options.count("race") > 0;
+    const double race_margin = race && !options["race"].empty() ? std::atof(options["race"].c_str()) : 0.5;
+    std::mutex mutex;
+    int finished_groups = 0;
+    int failures = 0;
+    double job_seconds = 0;
+    auto run_job = [&](const Job & job)
+    {
+        std::chrono::time_point<std::chrono::high_resolution_clock> start_time = std::chrono::high_resolution_clock::now();
+        Group & group = groups[job.group];
+        std::ostringstream log;
+        log << "Parameters:\n  # of Clusters: " << job.n_clusters << "\n  # of Tails: " << job.trail+1 << "/" << seeds.size() << "\n  Random Seed: " << seeds[job.trail]
+            << "\n  Data File: " << data_files[job.dataset] << "\n  Class File: " << (class_file == "-" ? "undefined" : class_file) << "\n  Output File: " << group.result_file << "\n" << std::endl;
+        KMeans cluster(job.n_clusters);
+        cluster.setLogStream(&log);
+        const bool mapped = cluster.openDataset(packed_files[job.dataset], 0) == 0;
+        if (mapped)
+        {
+            cluster.setCentroidUpdateThreshold(0);
+            if (options.count("tolerance"))
+                cluster.setTolerance(std::atof(options["tolerance"].c_str()));
+            if (race)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                cluster.setRaceBounds(race_bounds(group.trajectories, race_margin));
+            }
+            cluster.setRandomSeed(seeds[job.trail]);
+            cluster.run();
+            if (cluster.isAbandoned())
+                log << "\nTrail abandoned." << std::endl;
+            else if (class_file != "-")
+                cluster.evaluate(topic_docs_map);
+        }
+        else
+        {
+            log << "Error: Unable to map the dataset file." << packed_files[job.dataset] << std::endl;
+        }
+        double seconds = std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1> > > (std::chrono::high_resolution_clock::now() - start_time).count();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        job_seconds += seconds;
+        group.logs[job.trail] = log.str();
+        if (race && mapped && !cluster.isAbandoned())
+            group.trajectories.push_back(objective_trajectory(cluster));
+        // Ties go to the earlier trail, as when the trails run one after another
+        if (mapped && !cluster.isAbandoned() && (cluster.getObjValue() < group.obj_val || (cluster.getObjValue() == group.obj_val && job.trail < group.best_trail)))
+        {
+            group.obj_val = cluster.getObjValue();
+            group.best_trail = job.trail;
+            group.solution = cluster.getEachPointCluster();
+            group.ids = cluster.getPointIds();
+        }
+        if (--group.remaining > 0)
+            return;
+
+        // The files of a group are written once all its trails are done
+        std::ofstream log_output(group.log_file);
+        for (auto & l : group.logs)
+            log_output << l;
+        log_output.close();
+        std::ofstream output(group.result_file);
+        for (std::size_t i = 0; i < group.solution.size(); ++i)
+            output << group.ids[i] << "," << group.solution[i] << "\n";
+        output.close();
+        if (log_output.fail() || output.fail() || group.best_trail < 0)
+        {
+            std::cerr << "Unable to write " << group.result_file << " or " << group.log_file << std::endl;
+            failures++;
+        }
+        std::cout << "  [" << ++finished_groups << "/" << groups.size() << "] Clusters: " << job.n_clusters << ". Data File: " << data_files[job.dataset]
+                  << ". Obj. Value: " << std::fixed << group.obj_val << ". Random Seed: " << (group.best_trail < 0 ? -1 : seeds[group.best_trail])
+                  << ". Result File: " << group.result_file << std::endl;
+        std::vector<std::string>().swap(group.logs);
+        std::vector<std::vector<double> >().swap(group.trajectories);
+        std::vector<int>().swap(group.ids);
+        std::vector<int>().swap(group.solution);
+    };
+
+    ThreadPool pool(options.count("threads") ? std::atoi(options["threads"].c_str()) : 0);
+    std::cout << "Running " << jobs.size() << " jobs over " << pool.size() << " threads..." << std::endl;
+    std::chrono::time_point<std::chrono::high_resolution_clock> start_time = std::chrono::high_resolution_clock::now();
+    for (auto & job : jobs)
+        pool.submit([&run_job, job]() { run_job(job); });
+    pool.wait();
+    double time_taken = std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1> > > (std::chrono::high_resolution_clock::now() - start_time).count();
+    for (auto & file : packed_files)
+        std::remove(file.c_str());
+    std::cout << std::fixed << "Grid completed. Total time taken: " << time_taken << "s. Time taken by jobs: " << job_seconds << "s. "
+              << "Average jobs running: " << job_seconds/time_taken << "." << std::endl;
+    return failures > 0 ? 1 : 0;
+}
+
+int run_benchmark(int argc, char * argv[])
+{
+    // sphkmeans bench input-file clusters [trails]
+    if (argc < 4)
+    {
+        std::cerr << "Program Stopped." << std::endl;
+        std::cerr << "Error: Wrong Number of Parameters were given." << std::endl;
+        std::cerr << "Run the program without any paramter to see help information" << std::endl;
+        throw ;
+    }
+    int n_clusters = std::atoi(argv[3]);
+    int n_trails = argc > 4 ? std::atoi(argv[4]) : 3;
+    if (n_clusters < 2)
+        n_clusters = 2;
+    if (n_trails < 1)
+        n_trails = 1;
+
+    const std::deque<std::pair<std::string, KMeans::AssignKernel> > kernels = {
+        {"pairwise", KMeans::PAIRWISE_KERNEL},
+        {"tiled", KMeans::TILED_KERNEL},
+        {"blocked", KMeans::BLOCKED_KERNEL}
+    };
+
+    KMeans * cluster = new KMeans(n_clusters);
+    if (load_data_file(argv[2], cluster) < 2)
+    {
+        std::cerr << "Program Stopped." << std::endl;
+        std::cerr << "Error: Less than 2 data objects added. Unable to perform clustering." << std::endl;
+        throw;
+    }
+    std::ostream null_stream(nullptr);
+    cluster->setLogStream(&null_stream);
+
+    std::cout << "Kernel    \tIterations\tTime/Iter.(s)\tTotal Time(s)\tObj. Value\n";
+    for (auto k : kernels)
+    {
+        int iterations = 0;
+        double time_taken = 0;
+        double obj_val = 0;
+        cluster->setAssignKernel(k.second);
+        for (int i = 0; i < n_trails; ++i)
+        {
+            cluster->setRandomSeed(2*i+1);
+            cluster->run();
+            for (auto info : cluster->getIterationInfo())
+            {
+                iterations++;
+                time_taken += std::get<2>(info);
+            }
+            obj_val += cluster->getObjValue();
+        }
+        std::cout << std::setw(10) << std::left << k.first << "\t" << std::setw(10) << iterations << "\t"
+                  << std::fixed << time_taken/iterations << "\t" << time_taken << "\t" << obj_val/n_trails << std::endl;
+    }
+
+    delete cluster;
+    return 0;
+}
+
+int show_model(int argc, char * argv[])
+{
+    // sphkmeans model model-file
+    if (argc < 3)
+    {
+        std::cerr << "Program Stopped." << std::endl;
+        std::cerr << "Error: Wrong Number of Parameters were given." << std::endl;
+        std::cerr << "Run the program without any paramter to see help information" << std::endl;
+        throw ;
+    }
+    KMeans * cluster = new KMeans(2);
+    if (cluster->loadModel(argv[2]) != 0)
+    {
+        std::cerr << "Program Stopped." << std::endl;
+        std::cerr << "Error: Unable to load the model file. " << argv[2] << std::endl;
+        throw;
+    }
+    const KMeans::Model & model = cluster->getModel();
+    std::time_t created = model.header.created;
+    std::cout << "Model File: " << argv[2] << "\n"
+              << "  # of Clusters: " << model.header.n_clusters << "\n"
+              << "  # of Features: " << model.header.n_features << "\n"
+              << "  # of Data Obj.: " << model.header.n_points << "\n"
+              << "  Iterations: " << model.header.iterations << "\n"
+              << "  Random Seed: " << model.header.seed << "\n"
+              << "  Obj. Value: " << std::fixed << model.header.obj_value << "\n"
+              << "  Time Taken: " << model.header.time_taken << "s\n"
+              << "  Created: " << std::ctime(&created)
+              << "Cluster\tSize\tL2-norm\n";
+    for (int i = 0; i < model.header.n_clusters; ++i)
+        std::cout << std::setw(7) << i << "\t" << model.sizes[i] << "\t" << model.norms[i] << "\n";
+    std::cout << std::flush;
+    delete cluster;
+    return 0;
+}
+
+int run_prediction(int argc, char * argv[])
+{
+    // sphkmeans predict model-file input-file output-file [threads]
+    if (argc < 5)
+    {
+        std::cerr << "Program Stopped." << std::endl;
+        std::cerr << "Error: Wrong Number of Parameters were given." << std::endl;
+        std::cerr << "Run the program without any paramter to see help information" << std::endl;
+        throw ;
+    }
+    CentroidModel model;
+    if (model.open(argv[2]) != 0)
+    {
+        std::cerr << "Program Stopped." << std::endl;
+        std::cerr << "Error: Unable to load the model file. " << argv[2] << std::endl;
+        throw;
+    }
+    std::ifstream input(argv[3]);
+    if (input.fail())
+    {
+        std::cerr << "Program Stopped." << std::endl;
+        std::cerr << "Error: Unable to Open the Input File. " << argv[3] << std::endl;
+        throw;
+    }
+    std::ofstream output(argv[4]);
+    if (output.fail())
+    {
+        std::cerr << "Program Stopped." << std::endl;
+        std::cerr << "Error: Unable to open the output file." << argv[4] << std::endl;
+        throw;
+    }
+    ThreadPool pool(argc > 5 ? std::atoi(argv[5]) : 0);
+
+    // Lines are read in rounds. Each thread parses and scores a batch of a round, and writes its results
+    // into a string. The next round is read while the current round is being scored.
+    const int batch_size = 1024;
+    const int round_size = batch_size*pool.size();
+    std::vector<std::string> lines, next_lines;
+    std::vector<std::string> results(pool.size());
+    std::vector<CentroidModel::Workspace> workspaces(pool.size());
+    std::vector<std::vector<CentroidModel::Document> > documents(pool.size());
+    std::vector<long> counts(pool.size());
+    long n_docs = 0;
+    std::string line;
+
+    auto read_round = [&](std::vector<std::string> & round)
+    {
+        round.clear();
+        while ((int)round.size() < round_size && std::getline(input, line))
+            round.push_back(std::move(line));
+    };
+    auto score_batch = [&](const int & b)
+    {
+        // Documents of a batch are scored together as one block
+        std::vector<CentroidModel::Document> & docs = documents[b];
+        std::vector<const CentroidModel::Document *> block;
+        std::vector<int> ids, clusters;
+        std::vector<double> similarities;
+        int id;
+        std::vector<int> attribute;
+        std::vector<double> value;
+        std::string entry;
+        docs.resize(batch_size);
+        for (std::size_t i = b*batch_size; i < lines.size() && i < (std::size_t)(b+1)*batch_size; ++i)
+        {
+            entry = lines[i];
+            if (parse_entry(entry, id, attribute, value) != 0 || attribute.empty() || attribute.size() != value.size())
+                continue;
+            model.prepare(attribute.data(), value.data(), attribute.size(), docs[block.size()], workspaces[b]);
+            block.push_back(&docs[block.size()]);
+            ids.push_back(id);
+        }
+        clusters.resize(block.size());
+        similarities.resize(block.size());
+        model.scoreBlock(block.data(), block.size(), clusters.data(), similarities.data(), workspaces[b]);
+
+        std::ostringstream out;
+        out << std::fixed;
+        for (std::size_t i = 0; i < block.size(); ++i)
+            out << ids[i] << "," << clusters[i] << "," << similarities[i] << "\n";
+        counts[b] = block.size();
+        results[b] = out.str();
+    };
+
+    std::chrono::time_point<std::chrono::high_resolution_clock> start_time = std::chrono::high_resolution_clock::now();
+    read_round(lines);
+    while (!lines.empty())
+    {
+        for (int b = 0; b < pool.size(); ++b)
+            pool.submit(std::bind(score_batch, b));
+        read_round(next_lines);
+        pool.wait();
+        for (int b = 0; b < pool.size(); ++b)
+        {
+            output << results[b];
+            n_docs += counts[b];
+        }
+        lines.swap(next_lines);
+    }
+    output.close();
+    double time_taken = std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1> > > (std::chrono::high_resolution_clock::now() - start_time).count();
+
+    std::cout << "Assigned " << n_docs << " documents to " << model.size() << " clusters using " << pool.size() << " threads.\n"
+              << "Time Taken: " << std::fixed << time_taken << "s. Throughput: " << n_docs/time_taken << " documents/s." << std::endl;
+    return 0;
+}
+
+ClusterServer * running_server = nullptr;
+
+void stop_server(int)
+{
+    if (running_server != nullptr)
+        running_server->stop();
+}
+
+void reload_server(int)
+{
+    if (running_server != nullptr)
+        running_server->reload();
+}
+
+int run_server(int argc, char * argv[])
+{
+    // sphkmeans serve model-file socket-path [max-batch] [max-wait-us] [threads]
+    if (argc < 4)
+    {
+        std::cerr << "Program Stopped." << std::endl;
+        std::cerr << "Error: Wrong Number of Parameters were given." << std::endl;
+        std::cerr << "Run the program without any paramter to see help information" << std::endl;
+        throw ;
+    }
+    ModelHolder models;
+    if (models.load(argv[2]) != 0)
+    {
+        std::cerr << "Program Stopped." << std::endl;
+        std::cerr << "Error: Unable to load the model file. " << argv[2] << std::endl;
+        throw;
+    }
+    const std::string socket_path(argv[3]);
+    ClusterServer server(&models, parse_entry);
+    server.setModelFile(argv[2]);
+    server.setBatching(argc > 4 ? std::atoi(argv[4]) : 64, argc > 5 ? std::atoi(argv[5]) : 200);
+    server.setScoringThreads(argc > 6 ? std::atoi(argv[6]) : 1);
+
+    // Stop on SIGINT or SIGTERM, reload the model file on SIGHUP.
+    // Blocking reads are interrupted by SIGINT and SIGTERM rather than restarted.
+#if !defined(_WIN32)
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_server;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    action.sa_handler = reload_server;
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGHUP, &action, nullptr);
+    std::signal(SIGPIPE, SIG_IGN);
+#else
+    std::signal(SIGINT, stop_server);
+    std::signal(SIGTERM, stop_server);
+#endif
+    running_server = &server;
+
+    if (socket_path == "-")
+    {
+        // Responses go to the standard output, reports to the standard error
+        server.setLogStream(&std::cerr);
+        std::cerr << "Serving " << argv[2] << " on the standard input." << std::endl;
+        server.serve(std::cin, std::cout);
+    }
+    else
+    {
+        std::cout << "Serving " << argv[2] << " at " << socket_path << "." << std::endl;
+        if (server.serve(socket_path) != 0)
+        {
+            std::cerr << "Program Stopped." << std::endl;
+            std::cerr << "Error: Unable to listen on the socket. " << socket_path << std::endl;
+            throw;
+        }
+    }
+    running_server = nullptr;
+    return 0;
+}
+
+int run_client(int argc, char * argv[])
+{
+    // sphkmeans client socket-path input-file [connections]
+    if (argc < 4)
+    {
+        std::cerr << "Program Stopped." << std::endl;
+        std::cerr << "Error: Wrong Number of Parameters were given." << std::endl;
+        std::cerr << "Run the program without any paramter to see help information" << std::endl;
+        throw ;
+    }
+    std::ifstream input(argv[3]);
+    if (input.fail())
+    {
+        std::cerr << "Program Stopped." << std::endl;
+        std::cerr << "Error: Unable to Open the Input File. " << argv[3] << std::endl;
+        throw;
+    }
+    std::vector<std::string> lines;
+    std::string line;
+    while (std::getline(input, line))
+        if (!line.empty())
+            lines.push_back(std::move(line));
+    const int n_connections = argc > 4 && std::atoi(argv[4]) > 0 ? std::atoi(argv[4]) : 1;
+
+    // Each connection sends its next request once the previous one is answered
+    std::vector<ClusterClient> clients(n_connections);
+    for (auto & client : clients)
+    {
+        if (client.connect(argv[2]) != 0)
+        {
+            std::cerr << "Program Stopped." << std::endl;
+            std::cerr << "Error: Unable to connect to the server. " << argv[2] << std::endl;
+            throw;
+        }
+    }
+    std::atomic<std::size_t> next(0);
+    std::atomic<long> failed(0);
+    std::vector<std::string> responses(n_connections);
+    std::vector<std::vector<double> > latencies(n_connections);
+    auto send_requests = [&](const int & c)
+    {
+        std::string response;
+        std::size_t i;
+        while ((i = next++) < lines.size())
+        {
+            auto start = std::chrono::steady_clock::now();
+            if (clients[c].request(lines[i], response) != 0)
+            {
+                failed++;
+                return;
+            }
+            latencies[c].push_back(std::chrono::duration_cast<std::chrono::duration<double, std::micro> >(std::chrono::steady_clock::now() - start).count());
+            responses[c] += response;
+            responses[c] += "\n";
+        }
+        // Let clients waiting for a connection slot of the server in
+        clients[c].close();
+    };
+
+    std::chrono::time_point<std::chrono::high_resolution_clock> start_time = std::chrono::high_resolution_clock::now();
+    std::vector<std::thread> threads;
+    for (int c = 0; c < n_connections; ++c)
+        threads.emplace_back(send_requests, c);
+    for (auto & t : threads)
+        t.join();
+    double time_taken = std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1> > > (std::chrono::high_resolution_clock::now() - start_time).count();
+
+    std::vector<double> all;
+    for (int c = 0; c < n_connections; ++c)
+    {
+        std::cout << responses[c];
+        all.insert(all.end(), latencies[c].begin(), latencies[c].end());
+    }
+    std::cout.flush();
+    std::cerr << std::fixed << "Sent " << all.size() << " requests over " << n_connections << " connections in " << time_taken << "s. "
+              << "Throughput: " << all.size()/time_taken << " requests/s.\n"
+              << "Latency p50: " << ClusterServer::percentile(all, 0.5) << "us. p90: " << ClusterServer::percentile(all, 0.9)
+              << "us. p99: " << ClusterServer::percentile(all, 0.99) << "us." << std::endl;
+    if (failed > 0)
+        std::cerr << "Error: " << failed << " connections were closed by the server." << std::endl;
+    return failed > 0 ? 1 : 0;
+}
+
 int main(int argc, char * argv[])
 {
     // See show_help() for the explanation of these parameters
@@ -197,6 +1090,28 @@ int main(int argc, char * argv[])
 
     std::ios_base::sync_with_stdio(false);  // No plan to use stdio.h
 
+    std::unordered_map<std::string, std::string> options;
+    argc = parse_options(argc, argv, options);
+
+    if (argc > 1 && std::string(argv[1]) == "bench")
+        return run_benchmark(argc, argv);
+    if (argc > 1 && std::string(argv[1]) == "model")
+        return show_model(argc, argv);
+    if (argc > 1 && std::string(argv[1]) == "predict")
+        return run_prediction(argc, argv);
+    if (argc > 1 && std::string(argv[1]) == "serve")
+        return run_server(argc, argv);
+    if (argc > 1 && std::string(argv[1]) == "client")
+        return run_client(argc, argv);
+    if (argc > 1 && std::string(argv[1]) == "pack")
+        return pack_dataset(argc, argv);
+    if (argc > 1 && std::string(argv[1]) == "grid")
+        return run_grid(argc, argv, options);
+    if (argc > 1 && std::string(argv[1]) == "coordinate")
+        return run_coordinator(argc, argv, options);
+    if (argc > 1 && std::string(argv[1]) == "worker")
+        return run_worker(argc, argv);
+
     // Load parameters
     switch (argc)
     {
@@ -254,8 +1169,44 @@ int main(int argc, char * argv[])
     // Instance the clustering class
     KMeans * cluster = new KMeans(n_clusters);
 
-    // Load document data from the dataset file into the clustering class
-    if (load_data_file(input_file, cluster) < 2)
+    // Load document data from the dataset file into the clustering class,
+    // or stream it from a packed dataset file in blocks of the given megabytes,
+    // or map a packed dataset file shared with other processes
+    if (options.count("shared"))
+    {
+        publish_dataset(input_file, options["shared"]);
+        if (cluster->openDataset(options["shared"], 0) != 0)
+        {
+            std::cerr << "Program Stopped." << std::endl;
+            std::cerr << "Error: Unable to map the dataset file. " << options["shared"] << std::endl;
+            throw;
+        }
+    }
+    else if (options.count("stream"))
+    {
+        double block_mb = options["stream"].empty() ? 64 : std::atof(options["stream"].c_str());
+        if (block_mb <= 0)
+            block_mb = 64;
+        if (cluster->openDataset(input_file, block_mb*1024*1024) != 0)
+        {
+            std::cerr << "Program Stopped." << std::endl;
+            std::cerr << "Error: Unable to open the dataset file. " << input_file << std::endl;
+            throw;
+        }
+    }
+    else
+    {
+        if (options.count("collapse-duplicates"))
+            cluster->setCollapseDuplicates(true);
+        load_data_file(input_file, cluster);
+    }
+    if (options.count("collapse-duplicates") && (options.count("shared") || options.count("stream")))
+    {
+        std::cerr << "Program Stopped." << std::endl;
+        std::cerr << "Error: Duplicates can only be collapsed when documents are loaded into memory." << std::endl;
+        throw;
+    }
+    if (cluster->getNumberOfPoints() < 2)
     {
       std::cerr << "Program Stopped." << std::endl;
       std::cerr << "Error: Less than 2 data objects added. Unable to perform clustering." << std::endl;
@@ -275,10 +1226,40 @@ int main(int argc, char * argv[])
     // K-means iteration will keep going
     // if the number of centroids being updated is greater than the threshold
     cluster->setCentroidUpdateThreshold(0);
+    if (options.count("release-raw"))
+        cluster->setReleaseRawData(true);
+    if (options.count("reorder"))
+        cluster->setReorderInterval(std::atoi(options["reorder"].c_str()));
+    if (options.count("checkpoint"))
+    {
+        int every = options.count("checkpoint-every") ? std::atoi(options["checkpoint-every"].c_str()) : 0;
+        double seconds = options.count("checkpoint-seconds") ? std::atof(options["checkpoint-seconds"].c_str()) : 0;
+        if (every <= 0 && seconds <= 0)
+            every = 10;
+        cluster->setCheckpoint(options["checkpoint"], every, seconds);
+    }
+    if (options.count("resume") && cluster->loadCheckpoint(options["resume"]) != 0)
+    {
+        std::cerr << "Program Stopped." << std::endl;
+        std::cerr << "Error: Unable to load the checkpoint file. " << options["resume"] << std::endl;
+        throw;
+    }
+    if (options.count("tolerance"))
+        cluster->setTolerance(std::atof(options["tolerance"].c_str()));
+    if (options.count("warm-start"))
+    {
+        if (cluster->loadModel(options["warm-start"]) != 0)
+        {
+            std::cerr << "Program Stopped." << std::endl;
+            std::cerr << "Error: Unable to load the model file. " << options["warm-start"] << std::endl;
+            throw;
+        }
+        cluster->setWarmStart(true);
+    }
 
     // Run multiple times of clustering
     std::deque<int> rand_seeds;
-    std::unordered_map<int, int> solution;
+    std::vector<int> solution;
     double obj_val = std::numeric_limits<double>::infinity();
 
     if (n_trails == 0)
@@ -293,11 +1274,100 @@ int main(int argc, char * argv[])
             rand_seeds.push_front(2*i+1);
         }
     }
-    int i = 0;
+    // When resuming, the trails before the one of the checkpoint are skipped
+    if (options.count("resume"))
+    {
+        while (!rand_seeds.empty() && rand_seeds.front() != cluster->seed)
+            rand_seeds.pop_front();
+        if (rand_seeds.empty())
+        {
+            std::cerr << "Program Stopped." << std::endl;
+            std::cerr << "Error: The random seed of the checkpoint is not used by the given trails. " << cluster->seed << std::endl;
+            throw;
+        }
+    }
+    // Lockstep trails are all run at once here and then selected one by one below
+    const bool lockstep = options.count("lockstep") > 0;
+    if (lockstep)
+    {
+        if (options.count("resume"))
+        {
+            std::cerr << "Program Stopped." << std::endl;
+            std::cerr << "Error: A checkpoint cannot be resumed by lockstep trails." << std::endl;
+            throw;
+        }
+        cluster->setLogStream(&std::clog);
+        cluster->runTrails(std::vector<int>(rand_seeds.begin(), rand_seeds.end()));
+        std::clog << std::endl;
+    }
+    // Bisecting replaces the flat clustering of each trail
+    const bool bisect = options.count("bisect") > 0;
+    const int bisect_threads = bisect ? std::atoi(options["bisect"].c_str()) : 0;
+    std::vector<KMeans::HierarchyNode> hierarchy;
+    if (bisect && lockstep)
+    {
+        std::cerr << "Program Stopped." << std::endl;
+        std::cerr << "Error: Lockstep trails cannot be bisected." << std::endl;
+        throw;
+    }
+    // Automatic selection of the number of clusters starts each trail from n_clusters clusters
+    const bool auto_k = options.count("auto-k") > 0;
+    const int auto_k_max = auto_k && !options["auto-k"].empty() ? std::atoi(options["auto-k"].c_str()) : 4*n_clusters;
+    const double split_penalty = options.count("split-penalty") ? std::atof(options["split-penalty"].c_str()) : 3;
+    const int auto_k_threads = options.count("threads") ? std::atoi(options["threads"].c_str()) : 0;
+    if (auto_k && (lockstep || bisect || options.count("sweep")))
+    {
+        std::cerr << "Program Stopped." << std::endl;
+        std::cerr << "Error: The number of clusters cannot be chosen automatically with --lockstep, --bisect or --sweep." << std::endl;
+        throw;
+    }
+    // A coreset replaces the documents clustered by each trail, and all documents are assigned in a final pass
+    const int coreset_size = options.count("coreset") ? (options["coreset"].empty() ? 100*n_clusters : std::atoi(options["coreset"].c_str())) : 0;
+    if (coreset_size > 0 && (lockstep || bisect || auto_k))
+    {
+        std::cerr << "Program Stopped." << std::endl;
+        std::cerr << "Error: A coreset cannot be clustered with --lockstep, --bisect or --auto-k." << std::endl;
+        throw;
+    }
+    if (options.count("coreset") && coreset_size < n_clusters)
+    {
+        std::cerr << "Program Stopped." << std::endl;
+        std::cerr << "Error: The size of a coreset cannot be less than the number of clusters." << std::endl;
+        throw;
+    }
+    // A sweep grows the solution of each trail into larger numbers of clusters, in ascending order
+    std::vector<int> sweep;
+    if (options.count("sweep"))
+    {
+        for (auto k : parse_list(options["sweep"]))
+            if (k > n_clusters)
+                sweep.push_back(k);
+        std::sort(sweep.begin(), sweep.end());
+        sweep.erase(std::unique(sweep.begin(), sweep.end()), sweep.end());
+        if (lockstep)
+        {
+            std::cerr << "Program Stopped." << std::endl;
+            std::cerr << "Error: Lockstep trails cannot be grown by a sweep." << std::endl;
+            throw;
+        }
+    }
+    std::vector<std::vector<int> > sweep_solutions(sweep.size());
+    std::vector<double> sweep_obj_vals(sweep.size(), std::numeric_limits<double>::infinity());
+    std::vector<int> sweep_trails(sweep.size(), 0);
+    std::vector<int> sweep_iterations(sweep.size(), 0);
+    std::vector<double> sweep_times(sweep.size(), 0);
+    int best_trail = 0, best_iterations = 0;
+    // Racing abandons the trails whose objective values fall behind the trajectories of finished trails
+    const bool race = options.count("race") > 0 && !lockstep && !bisect && !auto_k && coreset_size == 0;
+    const double race_margin = race && !options["race"].empty() ? std::atof(options["race"].c_str()) : 0.5;
+    std::vector<std::vector<double> > trajectories;
+    int abandoned = 0;
+    int i = n_trails - rand_seeds.size();
     for (auto rs : rand_seeds)
     {
-        // Set random seed
-        cluster->setRandomSeed(rs);
+        // Set random seed; lockstep trails keep their own
+        if (!lockstep)
+            cluster->setRandomSeed(rs);
         std::cout << "Parameters:\n  # of Clusters: " << n_clusters << "\n  # of Tails: " << ++i << "/" << n_trails << "\n  Random Seed: ";
         if (rs == KMeans::UNASSIGNED_RANDOM_SEED_FLAG)
           std::cout << "undefined";
@@ -308,13 +1378,42 @@ int main(int argc, char * argv[])
 
         // Clustering
         cluster->setLogStream(&std::clog);
-        cluster->run();
+        if (race)
+            cluster->setRaceBounds(race_bounds(trajectories, race_margin));
+        if (!sweep.empty() || auto_k)
+            cluster->setNumberOfClusters(n_clusters);
+        if (lockstep)
+            cluster->selectTrail(i-1);
+        else if (bisect)
+            cluster->runBisecting(bisect_threads);
+        else if (auto_k)
+            cluster->runAutoK(auto_k_max, split_penalty, auto_k_threads);
+        else if (coreset_size > 0)
+            cluster->runCoreset(coreset_size);
+        else
+            cluster->run();
+        if (cluster->isAbandoned())
+        {
+            std::cout << "\nTrail abandoned." << std::endl;
+            abandoned++;
+            continue;
+        }
+        if (race)
+            trajectories.push_back(objective_trajectory(*cluster));
+        if (auto_k)
+            std::cout << "\n# of Clusters Chosen: " << cluster->getNumberOfClusters() << std::endl;
 
         // Get the value of objective function
         if (obj_val > cluster->getObjValue())
         {
             obj_val = cluster->getObjValue();
             solution = cluster->getEachPointCluster();
+            best_trail = i;
+            best_iterations = cluster->getIterationInfo().size();
+            if (bisect)
+                hierarchy = cluster->getHierarchy();
+            if (options.count("save-model") && cluster->saveModel(options["save-model"]) != 0)
+                std::cerr << "Unable to save the model file. " << options["save-model"] << std::endl;
         }
 
         // Evaluation
@@ -324,13 +1423,65 @@ int main(int argc, char * argv[])
             cluster->evaluate(topic_docs_map);
         }
 
+        // Grow the solution into each number of clusters of the sweep, seeding it with the solution of the previous one
+        cluster->setLogStream(&std::clog);
+        cluster->setRaceBounds(std::vector<double>());
+        for (std::size_t s = 0; s < sweep.size(); ++s)
+        {
+            std::clog << "\nGrow into " << sweep[s] << " clusters..." << std::endl;
+            double time_taken = cluster->getTimeElapse();
+            int iterations = cluster->growClusters(sweep[s]);
+            time_taken = cluster->getTimeElapse() - time_taken;
+            std::clog << std::endl;
+            if (sweep_obj_vals[s] > cluster->getObjValue())
+            {
+                sweep_obj_vals[s] = cluster->getObjValue();
+                sweep_solutions[s] = cluster->getEachPointCluster();
+                sweep_trails[s] = i;
+                sweep_iterations[s] = iterations;
+                sweep_times[s] = time_taken;
+            }
+        }
     }
 
+    if (race)
+        std::cout << "Abandoned " << abandoned << " of " << rand_seeds.size() << " trails." << std::endl;
+
     // Output best clustering result according the requirement of the project
-    for (auto d : solution)
-        output << d.first << "," << d.second << "\n";
+    const std::vector<int> & ids = cluster->getPointIds();
+    write_solution(output, ids, solution, cluster->getCollapsedPoints());
     output.close();
 
+    // Each line of the hierarchy file is a node: id, parent, left child, right child, cluster, size, objective value
+    if (options.count("hierarchy"))
+    {
+        output.open(options["hierarchy"]);
+        for (std::size_t n = 0; n < hierarchy.size(); ++n)
+            output << n << "," << hierarchy[n].parent << "," << hierarchy[n].left << "," << hierarchy[n].right << ","
+                   << hierarchy[n].cluster << "," << hierarchy[n].size << "," << std::fixed << hierarchy[n].obj_value << "\n";
+        output.close();
+        if (output.fail())
+            std::cerr << "Unable to write the hierarchy file. " << options["hierarchy"] << std::endl;
+    }
+
+    // Objective value per number of clusters, and the best solution of each into output-file.K
+    if (!sweep.empty())
+    {
+        std::cout << "Sweep:\n  # of Clusters: " << n_clusters << ". Obj. Value: " << std::fixed << obj_val
+                  << ". Trail: " << best_trail << ". Iterations: " << best_iterations << "." << std::endl;
+        for (std::size_t s = 0; s < sweep.size(); ++s)
+        {
+            std::cout << "  # of Clusters: " << sweep[s] << ". Obj. Value: " << sweep_obj_vals[s]
+                      << ". Trail: " << sweep_trails[s] << ". Iterations: " << sweep_iterations[s]
+                      << ". Time Taken: " << sweep_times[s] << "s." << std::endl;
+            output.open(std::string(output_file) + "." + std::to_string(sweep[s]));
+            write_solution(output, ids, sweep_solutions[s], cluster->getCollapsedPoints());
+            output.close();
+            if (output.fail())
+                std::cerr << "Unable to write the output file. " << output_file << "." << sweep[s] << std::endl;
+        }
+    }
+
     delete cluster;
 
     return 0;